@@ -0,0 +1,242 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <pthread.h>
+#include "analyzer.h"
+#include "quickdebayer.h"
+
+#define MAX_ANALYZERS 4
+
+extern const struct analyzer exposure_analyzer;
+
+static const struct analyzer *available[] = {
+	&exposure_analyzer,
+};
+
+struct worker {
+	const struct analyzer *analyzer;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t cond;
+	int busy;
+	int stop;
+
+	// Owned by the main thread while idle and by the worker while busy
+	struct analyzer_frame frame;
+	uint8_t *luma;
+	size_t luma_size;
+	uint8_t *raw;
+	size_t raw_size;
+
+	// The worker writes result, which is swapped with published when done
+	void *result;
+	void *published;
+	int have_result;
+
+	unsigned long analyzed;
+	unsigned long dropped;
+};
+
+static struct worker workers[MAX_ANALYZERS];
+static int n_workers = 0;
+static uint64_t sequence = 0;
+
+static void *
+worker_run(void *data)
+{
+	struct worker *worker = data;
+	void *done;
+
+	pthread_mutex_lock(&worker->lock);
+	while (1) {
+		while (!worker->busy && !worker->stop) {
+			pthread_cond_wait(&worker->cond, &worker->lock);
+		}
+		if (worker->stop) {
+			break;
+		}
+		pthread_mutex_unlock(&worker->lock);
+
+		worker->analyzer->analyze(&worker->frame, worker->result);
+
+		pthread_mutex_lock(&worker->lock);
+		done = worker->result;
+		worker->result = worker->published;
+		worker->published = done;
+		worker->have_result = 1;
+		worker->analyzed++;
+		worker->busy = 0;
+	}
+	pthread_mutex_unlock(&worker->lock);
+	return NULL;
+}
+
+int
+analyzer_start(const char *name)
+{
+	const struct analyzer *analyzer = NULL;
+	struct worker *worker;
+
+	for (int i = 0; i < sizeof(available) / sizeof(*available); i++) {
+		if (strcmp(available[i]->name, name) == 0) {
+			analyzer = available[i];
+		}
+	}
+	if (!analyzer || n_workers == MAX_ANALYZERS) {
+		return -1;
+	}
+
+	worker = &workers[n_workers];
+	memset(worker, 0, sizeof(*worker));
+	worker->analyzer = analyzer;
+	worker->result = calloc(1, analyzer->result_size);
+	worker->published = calloc(1, analyzer->result_size);
+	if (!worker->result || !worker->published) {
+		free(worker->result);
+		free(worker->published);
+		return -1;
+	}
+	pthread_mutex_init(&worker->lock, NULL);
+	pthread_cond_init(&worker->cond, NULL);
+	if (pthread_create(&worker->thread, NULL, worker_run, worker) != 0) {
+		free(worker->result);
+		free(worker->published);
+		return -1;
+	}
+
+	n_workers++;
+	printf("Started the %s analyzer\n", name);
+	return 0;
+}
+
+void
+analyzers_stop()
+{
+	for (int i = 0; i < n_workers; i++) {
+		struct worker *worker = &workers[i];
+
+		pthread_mutex_lock(&worker->lock);
+		worker->stop = 1;
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->lock);
+		pthread_join(worker->thread, NULL);
+
+		printf("Analyzer %s looked at %lu frames and dropped %lu\n",
+			worker->analyzer->name, worker->analyzed, worker->dropped);
+		free(worker->luma);
+		free(worker->raw);
+		free(worker->result);
+		free(worker->published);
+	}
+	n_workers = 0;
+}
+
+int
+analyzers_active()
+{
+	return n_workers > 0;
+}
+
+static int
+reserve(uint8_t **buffer, size_t *size, size_t needed)
+{
+	if (*size >= needed) {
+		return 0;
+	}
+	free(*buffer);
+	*buffer = malloc(needed);
+	*size = *buffer ? needed : 0;
+	return *buffer ? 0 : -1;
+}
+
+// Called with every preview frame. Everything an analyzer gets is copied,
+// so the V4L2 buffer can be queued again right after this returns no matter
+// how slow the analyzers are.
+void
+analyzers_offer(const uint8_t *raw, int width, int height, int stride, enum raw_layout layout)
+{
+	const uint8_t *luma = NULL;
+	int luma_stride = width / 2;
+	size_t luma_size = (size_t)luma_stride * (height / 2);
+	int busy;
+
+	sequence++;
+	for (int i = 0; i < n_workers; i++) {
+		struct worker *worker = &workers[i];
+
+		pthread_mutex_lock(&worker->lock);
+		busy = worker->busy;
+		pthread_mutex_unlock(&worker->lock);
+		if (busy) {
+			worker->dropped++;
+			continue;
+		}
+
+		if (reserve(&worker->luma, &worker->luma_size, luma_size) < 0) {
+			continue;
+		}
+		// The luma plane is only computed once, busy workers only read it
+		if (luma) {
+			memcpy(worker->luma, luma, luma_size);
+		} else {
+			quick_luma(raw, worker->luma, width, height, stride, luma_stride, layout);
+			luma = worker->luma;
+		}
+
+		worker->frame.raw = NULL;
+		if (worker->analyzer->flags & ANALYZER_RAW) {
+			if (reserve(&worker->raw, &worker->raw_size, (size_t)stride * height) < 0) {
+				continue;
+			}
+			memcpy(worker->raw, raw, (size_t)stride * height);
+			worker->frame.raw = worker->raw;
+		}
+
+		worker->frame.sequence = sequence;
+		worker->frame.luma = worker->luma;
+		worker->frame.width = width / 2;
+		worker->frame.height = height / 2;
+		worker->frame.stride = luma_stride;
+		worker->frame.raw_width = width;
+		worker->frame.raw_height = height;
+		worker->frame.raw_stride = stride;
+		worker->frame.layout = layout;
+
+		pthread_mutex_lock(&worker->lock);
+		worker->busy = 1;
+		pthread_cond_signal(&worker->cond);
+		pthread_mutex_unlock(&worker->lock);
+	}
+}
+
+// Draws the latest result of every analyzer, cr has to map the luma plane
+// coordinates to the preview
+void
+analyzers_overlay(cairo_t *cr)
+{
+	for (int i = 0; i < n_workers; i++) {
+		struct worker *worker = &workers[i];
+
+		if (!worker->analyzer->overlay) {
+			continue;
+		}
+		pthread_mutex_lock(&worker->lock);
+		if (worker->have_result) {
+			cairo_save(cr);
+			worker->analyzer->overlay(worker->published, cr);
+			cairo_restore(cr);
+		}
+		pthread_mutex_unlock(&worker->lock);
+	}
+}
+
+unsigned long
+analyzers_dropped()
+{
+	unsigned long dropped = 0;
+
+	for (int i = 0; i < n_workers; i++) {
+		dropped += workers[i].dropped;
+	}
+	return dropped;
+}
@@ -0,0 +1,52 @@
+#ifndef ANALYZER_H
+#define ANALYZER_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <cairo.h>
+#include "rawformat.h"
+
+// Also hand the analyzer a copy of the raw frame, not just the luma plane
+#define ANALYZER_RAW 1
+
+struct analyzer_frame {
+	uint64_t sequence;
+
+	// Half resolution luma in sensor orientation, overlays are drawn in
+	// these coordinates
+	const uint8_t *luma;
+	int width;
+	int height;
+	int stride;
+
+	// Only with ANALYZER_RAW
+	const uint8_t *raw;
+	int raw_width;
+	int raw_height;
+	int raw_stride;
+	enum raw_layout layout;
+};
+
+// Analyzers look at preview frames on their own thread. A frame is only
+// handed over when the analyzer is done with the previous one, otherwise
+// it's dropped for that analyzer.
+struct analyzer {
+	const char *name;
+	int flags;
+	size_t result_size;
+
+	// Runs on the analyzer thread and fills in a result_size block
+	void (*analyze)(const struct analyzer_frame *frame, void *result);
+	// Runs on the main thread with the latest result, may be NULL
+	void (*overlay)(const void *result, cairo_t *cr);
+};
+
+int analyzer_start(const char *name);
+void analyzers_stop();
+
+int analyzers_active();
+void analyzers_offer(const uint8_t *raw, int width, int height, int stride, enum raw_layout layout);
+void analyzers_overlay(cairo_t *cr);
+unsigned long analyzers_dropped();
+
+#endif
@@ -0,0 +1,92 @@
+#include <string.h>
+#include "analyzer.h"
+
+// Example analyzer, marks the parts of the frame that are clipped or
+// crushed to black
+#define ZONES_X 16
+#define ZONES_Y 12
+#define CLIP_HIGH 250
+#define CLIP_LOW 5
+
+struct exposure_result {
+	int width;
+	int height;
+	int mean;
+	int histogram[256];
+	// Percentage of the zone that is clipped, positive for highlights and
+	// negative for shadows, whichever is larger
+	int8_t zones[ZONES_Y][ZONES_X];
+};
+
+static void
+exposure_analyze(const struct analyzer_frame *frame, void *data)
+{
+	struct exposure_result *result = data;
+	int high[ZONES_Y][ZONES_X] = {0};
+	int low[ZONES_Y][ZONES_X] = {0};
+	uint64_t total = 0;
+
+	memset(result->histogram, 0, sizeof(result->histogram));
+	result->width = frame->width;
+	result->height = frame->height;
+
+	for (int y = 0; y < frame->height; y++) {
+		const uint8_t *line = frame->luma + y * frame->stride;
+		int zy = y * ZONES_Y / frame->height;
+
+		for (int x = 0; x < frame->width; x++) {
+			int zx = x * ZONES_X / frame->width;
+			uint8_t v = line[x];
+
+			result->histogram[v]++;
+			total += v;
+			high[zy][zx] += v >= CLIP_HIGH;
+			low[zy][zx] += v <= CLIP_LOW;
+		}
+	}
+
+	int pixels = frame->width * frame->height;
+	int zone_pixels = pixels / (ZONES_X * ZONES_Y);
+	result->mean = pixels ? total / pixels : 0;
+	for (int zy = 0; zy < ZONES_Y; zy++) {
+		for (int zx = 0; zx < ZONES_X; zx++) {
+			int h = zone_pixels ? high[zy][zx] * 100 / zone_pixels : 0;
+			int l = zone_pixels ? low[zy][zx] * 100 / zone_pixels : 0;
+			result->zones[zy][zx] = h >= l ? h : -l;
+		}
+	}
+}
+
+static void
+exposure_overlay(const void *data, cairo_t *cr)
+{
+	const struct exposure_result *result = data;
+	double zone_w = (double)result->width / ZONES_X;
+	double zone_h = (double)result->height / ZONES_Y;
+
+	for (int zy = 0; zy < ZONES_Y; zy++) {
+		for (int zx = 0; zx < ZONES_X; zx++) {
+			int zone = result->zones[zy][zx];
+
+			// Only zones that are mostly clipped, a few specular
+			// highlights are fine
+			if (zone > 25) {
+				cairo_set_source_rgba(cr, 1, 0, 0, zone / 200.0);
+			} else if (zone < -25) {
+				cairo_set_source_rgba(cr, 0, 0, 1, -zone / 200.0);
+			} else {
+				continue;
+			}
+			cairo_rectangle(cr, zx * zone_w, zy * zone_h, zone_w, zone_h);
+			cairo_fill(cr);
+		}
+	}
+}
+
+const struct analyzer exposure_analyzer = {
+	.name = "exposure",
+	.flags = 0,
+	.result_size = sizeof(struct exposure_result),
+	.analyze = exposure_analyze,
+	.overlay = exposure_overlay,
+};
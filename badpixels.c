@@ -0,0 +1,271 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "badpixels.h"
+#include "textfile.h"
+
+// Same color samples further away than this are too different to stand in
+#define SEARCH_STEPS 4
+
+static int
+compare_pixels(const void *a, const void *b)
+{
+	const struct badpixel *pa = a;
+	const struct badpixel *pb = b;
+	if (pa->y != pb->y) {
+		return pa->y - pb->y;
+	}
+	return pa->x - pb->x;
+}
+
+static int
+is_bad(const struct badpixels *map, int x, int y)
+{
+	struct badpixel key = {.x = x, .y = y};
+	return bsearch(&key, map->pixels + map->rows[y], map->rows[y + 1] - map->rows[y],
+		sizeof(struct badpixel), compare_pixels) != NULL;
+}
+
+// Nearest good sample of the same color in a direction, or -1
+static int
+good_neighbor(const struct badpixels *map, int x, int y, int direction)
+{
+	for (int step = 1; step <= SEARCH_STEPS; step++) {
+		int n = x + direction * 2 * step;
+		if (n < 0 || n >= map->width) {
+			break;
+		}
+		if (!is_bad(map, n, y)) {
+			return n;
+		}
+	}
+	return -1;
+}
+
+struct badpixels *
+badpixels_new(int width, int height, const uint16_t *coords, int count)
+{
+	if (width < 1 || height < 1 || width > BADPIXELS_MAX_SIZE || height > BADPIXELS_MAX_SIZE) {
+		return NULL;
+	}
+
+	struct badpixels *map = calloc(1, sizeof(struct badpixels));
+	map->width = width;
+	map->height = height;
+	map->pixels = malloc((count + 1) * sizeof(struct badpixel));
+	map->rows = calloc(height + 1, sizeof(uint32_t));
+
+	for (int i = 0; i < count; i++) {
+		if (coords[i * 2] >= width || coords[i * 2 + 1] >= height) {
+			badpixels_free(map);
+			return NULL;
+		}
+		map->pixels[i].x = coords[i * 2];
+		map->pixels[i].y = coords[i * 2 + 1];
+	}
+	qsort(map->pixels, count, sizeof(struct badpixel), compare_pixels);
+
+	for (int i = 0; i < count; i++) {
+		if (map->count > 0 && compare_pixels(&map->pixels[map->count - 1], &map->pixels[i]) == 0) {
+			continue;
+		}
+		map->pixels[map->count++] = map->pixels[i];
+	}
+
+	for (int i = 0; i < map->count; i++) {
+		map->rows[map->pixels[i].y + 1]++;
+	}
+	for (int y = 0; y < height; y++) {
+		map->rows[y + 1] += map->rows[y];
+	}
+
+	// Without a good sample on one side both come from the other, without
+	// any the sample is left as it is
+	for (int i = 0; i < map->count; i++) {
+		struct badpixel *p = &map->pixels[i];
+		int left = good_neighbor(map, p->x, p->y, -1);
+		int right = good_neighbor(map, p->x, p->y, 1);
+		p->left = left >= 0 ? left : right >= 0 ? right : p->x;
+		p->right = right >= 0 ? right : p->left;
+	}
+	return map;
+}
+
+void
+badpixels_free(struct badpixels *map)
+{
+	if (!map) {
+		return;
+	}
+	free(map->pixels);
+	free(map->rows);
+	free(map);
+}
+
+struct badpixels *
+badpixels_load(const char *path)
+{
+	struct badpixels *map = NULL;
+	uint16_t *coords = NULL;
+	char word[8];
+	int count = 0, allocated = 0;
+	int width, height, x, y;
+
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		return NULL;
+	}
+
+	if (text_read_word(file, word, sizeof(word)) < 0 || strcmp(word, "size") != 0 ||
+			text_read_int(file, &width) < 0 || text_read_int(file, &height) < 0 ||
+			width < 1 || height < 1) {
+		goto out;
+	}
+
+	while (text_read_int(file, &x) == 0) {
+		if (text_read_int(file, &y) < 0 || x < 0 || y < 0 || x >= width || y >= height) {
+			goto out;
+		}
+		if (count == allocated) {
+			allocated = allocated ? allocated * 2 : 64;
+			coords = realloc(coords, allocated * 2 * sizeof(uint16_t));
+		}
+		coords[count * 2] = x;
+		coords[count * 2 + 1] = y;
+		count++;
+	}
+	map = badpixels_new(width, height, coords, count);
+
+out:
+	free(coords);
+	fclose(file);
+	return map;
+}
+
+int
+badpixels_save(const char *path, const struct badpixels *map)
+{
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		return -1;
+	}
+
+	fprintf(file, "# Defective pixels measured by Megapixels\n");
+	fprintf(file, "size %d %d\n", map->width, map->height);
+	for (int i = 0; i < map->count; i++) {
+		fprintf(file, "%d %d\n", map->pixels[i].x, map->pixels[i].y);
+	}
+	return fclose(file) == 0 ? 0 : -1;
+}
+
+void
+badpixels_apply_row(const struct badpixels *map, int y, uint16_t *row)
+{
+	const struct badpixel *p = map->pixels + map->rows[y];
+	const struct badpixel *end = map->pixels + map->rows[y + 1];
+
+	// The replacements are never defects themselves, so no defect sees
+	// another one's new value
+	for (; p < end; p++) {
+		row[p->x] = (row[p->left] + row[p->right] + 1) >> 1;
+	}
+}
+
+struct badpixels_calibration *
+badpixels_calibration_new(int width, int height, enum raw_layout layout)
+{
+	struct badpixels_calibration *cal = calloc(1, sizeof(struct badpixels_calibration));
+	cal->width = width;
+	cal->height = height;
+	cal->bits = raw_bits(layout);
+	cal->sums = calloc((size_t)width * height, sizeof(uint32_t));
+	if (!cal->sums) {
+		free(cal);
+		return NULL;
+	}
+	return cal;
+}
+
+void
+badpixels_calibration_free(struct badpixels_calibration *cal)
+{
+	if (!cal) {
+		return;
+	}
+	free(cal->sums);
+	free(cal);
+}
+
+void
+badpixels_measure(struct badpixels_calibration *cal, const uint8_t *raw, enum raw_layout layout, int stride)
+{
+	uint16_t *line = malloc(cal->width * sizeof(uint16_t));
+
+	for (int y = 0; y < cal->height; y++) {
+		uint32_t *sums = cal->sums + (size_t)y * cal->width;
+		raw_unpack_row(layout, raw + (size_t)y * stride, line, cal->width);
+		for (int x = 0; x < cal->width; x++) {
+			sums[x] += line[x];
+		}
+	}
+	cal->frames++;
+	free(line);
+}
+
+// Median of the up to eight samples of the same color around a sample
+static uint32_t
+neighbor_median(const struct badpixels_calibration *cal, int x, int y)
+{
+	uint32_t values[8];
+	int count = 0;
+
+	for (int dy = -2; dy <= 2; dy += 2) {
+		for (int dx = -2; dx <= 2; dx += 2) {
+			int nx = x + dx, ny = y + dy;
+			if ((dx == 0 && dy == 0) || nx < 0 || ny < 0 || nx >= cal->width || ny >= cal->height) {
+				continue;
+			}
+			uint32_t v = cal->sums[(size_t)ny * cal->width + nx];
+			int i = count++;
+			for (; i > 0 && values[i - 1] > v; i--) {
+				values[i] = values[i - 1];
+			}
+			values[i] = v;
+		}
+	}
+	return count ? values[count / 2] : 0;
+}
+
+struct badpixels *
+badpixels_finish(struct badpixels_calibration *cal)
+{
+	// A dark frame doesn't have more than a handful of defects per thousand
+	int limit = (int)((size_t)cal->width * cal->height / 1000);
+	uint32_t threshold = (uint32_t)cal->frames * ((1 << cal->bits) / BADPIXELS_THRESHOLD);
+	uint16_t *coords = NULL;
+	int count = 0;
+
+	if (cal->frames == 0) {
+		return NULL;
+	}
+	coords = malloc((limit + 1) * 2 * sizeof(uint16_t));
+
+	for (int y = 0; y < cal->height; y++) {
+		for (int x = 0; x < cal->width; x++) {
+			if (cal->sums[(size_t)y * cal->width + x] <= neighbor_median(cal, x, y) + threshold) {
+				continue;
+			}
+			if (count == limit) {
+				free(coords);
+				return NULL;
+			}
+			coords[count * 2] = x;
+			coords[count * 2 + 1] = y;
+			count++;
+		}
+	}
+
+	struct badpixels *map = badpixels_new(cal->width, cal->height, coords, count);
+	free(coords);
+	return map;
+}
@@ -0,0 +1,69 @@
+#ifndef BADPIXELS_H
+#define BADPIXELS_H
+
+#include <stdint.h>
+#include "rawformat.h"
+
+// Hot and stuck pixels of a camera, a sparse list of coordinates in the
+// capture mode. Every defect is replaced by the average of the nearest good
+// samples of the same color left and right of it, which are looked up once
+// when the list is loaded, so fixing a frame only touches the listed pixels.
+//
+// Stored as text, whitespace separated and # starts a comment:
+//
+//   size <width> <height>
+//   <x> <y>
+//   ...
+#define BADPIXELS_MAX_SIZE 65535
+
+// A sample is hot when its average over the dark frames is this fraction
+// of the range above the median of its neighbors
+#define BADPIXELS_THRESHOLD 32
+
+struct badpixel {
+	uint16_t x;
+	uint16_t y;
+	// Columns of the samples it's replaced with
+	uint16_t left;
+	uint16_t right;
+};
+
+struct badpixels {
+	int width;
+	int height;
+	int count;
+	// Sorted by row, then column
+	struct badpixel *pixels;
+	// Index of the first defect of every row and one past the last row
+	uint32_t *rows;
+};
+
+// Sums of dark frames while calibrating
+struct badpixels_calibration {
+	int width;
+	int height;
+	int bits;
+	int frames;
+	uint32_t *sums;
+};
+
+struct badpixels *badpixels_load(const char *path);
+int badpixels_save(const char *path, const struct badpixels *map);
+void badpixels_free(struct badpixels *map);
+
+// Builds the list from coordinates in any order, duplicates are dropped.
+// Returns NULL when a coordinate is outside the frame.
+struct badpixels *badpixels_new(int width, int height, const uint16_t *coords, int count);
+
+// Replaces the defects in row y of unpacked samples
+void badpixels_apply_row(const struct badpixels *map, int y, uint16_t *row);
+
+struct badpixels_calibration *badpixels_calibration_new(int width, int height, enum raw_layout layout);
+void badpixels_calibration_free(struct badpixels_calibration *cal);
+void badpixels_measure(struct badpixels_calibration *cal, const uint8_t *raw, enum raw_layout layout, int stride);
+
+// The samples that stand out of the measured frames, NULL when there were
+// no frames or when so many stand out that the frames weren't dark
+struct badpixels *badpixels_finish(struct badpixels_calibration *cal);
+
+#endif
@@ -0,0 +1,102 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include "bufferpool.h"
+
+#define HUGEPAGE_SIZE (2 * 1024 * 1024)
+
+static size_t
+align_up(size_t value, size_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+// All buffers come out of a single anonymous mapping. With hugepages it's
+// first tried on hugetlbfs pages, which fails unless the admin reserved
+// some, and then falls back to asking for transparent hugepages.
+int
+buffer_pool_init(struct buffer_pool *pool, int count, size_t size, int hugepages)
+{
+	size_t page = sysconf(_SC_PAGESIZE);
+
+	pool->count = count;
+	pool->hugepages = 0;
+	pool->size = align_up(size, page);
+	pool->mapped = align_up(pool->size * count, page);
+	pool->memory = MAP_FAILED;
+
+	if (hugepages) {
+		size_t mapped = align_up(pool->size * count, HUGEPAGE_SIZE);
+		pool->memory = mmap(NULL, mapped, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB | MAP_POPULATE, -1, 0);
+		if (pool->memory != MAP_FAILED) {
+			pool->mapped = mapped;
+			pool->hugepages = 1;
+		}
+	}
+
+	if (pool->memory == MAP_FAILED) {
+		pool->memory = mmap(NULL, pool->mapped, PROT_READ | PROT_WRITE,
+			MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+		if (pool->memory == MAP_FAILED) {
+			return -1;
+		}
+		if (hugepages) {
+			madvise(pool->memory, pool->mapped, MADV_HUGEPAGE);
+		}
+		// Fault the pages in now instead of in the first frames
+		madvise(pool->memory, pool->mapped, MADV_WILLNEED);
+	}
+
+	pool->free = calloc(count, sizeof(void *));
+	if (!pool->free) {
+		munmap(pool->memory, pool->mapped);
+		return -1;
+	}
+	for (int i = 0; i < count; i++) {
+		pool->free[i] = (uint8_t *)pool->memory + i * pool->size;
+	}
+	pool->n_free = count;
+	pthread_mutex_init(&pool->lock, NULL);
+
+	printf("Allocated %d frame buffers of %zu bytes%s\n", count, pool->size,
+		pool->hugepages ? " on hugepages" : "");
+	return 0;
+}
+
+void
+buffer_pool_destroy(struct buffer_pool *pool)
+{
+	if (!pool->free) {
+		return;
+	}
+	munmap(pool->memory, pool->mapped);
+	free(pool->free);
+	pool->free = NULL;
+	pool->n_free = 0;
+	pthread_mutex_destroy(&pool->lock);
+}
+
+// Returns NULL when every buffer is in use
+void *
+buffer_pool_take(struct buffer_pool *pool)
+{
+	void *buffer = NULL;
+
+	pthread_mutex_lock(&pool->lock);
+	if (pool->n_free > 0) {
+		buffer = pool->free[--pool->n_free];
+	}
+	pthread_mutex_unlock(&pool->lock);
+	return buffer;
+}
+
+void
+buffer_pool_release(struct buffer_pool *pool, void *buffer)
+{
+	pthread_mutex_lock(&pool->lock);
+	pool->free[pool->n_free++] = buffer;
+	pthread_mutex_unlock(&pool->lock);
+}
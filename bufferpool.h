@@ -0,0 +1,28 @@
+#ifndef BUFFERPOOL_H
+#define BUFFERPOOL_H
+
+#include <stddef.h>
+#include <pthread.h>
+
+// Application allocated frame buffers for V4L2_MEMORY_USERPTR. The pool holds
+// more buffers than are queued to the driver, so a filled buffer can be taken
+// out of the queue and replaced with a spare instead of being copied.
+struct buffer_pool {
+	void *memory;
+	size_t mapped;
+	size_t size;
+	int count;
+	int hugepages;
+
+	void **free;
+	int n_free;
+	pthread_mutex_t lock;
+};
+
+int buffer_pool_init(struct buffer_pool *pool, int count, size_t size, int hugepages);
+void buffer_pool_destroy(struct buffer_pool *pool);
+
+void *buffer_pool_take(struct buffer_pool *pool);
+void buffer_pool_release(struct buffer_pool *pool, void *buffer);
+
+#endif
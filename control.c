@@ -0,0 +1,361 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <glib.h>
+#include <glib-unix.h>
+#include "control.h"
+
+#define MAX_CLIENTS 8
+// Bursts a client can wait for at once, the journal lets new bursts start
+// while earlier ones are still written
+#define MAX_PENDING_BURSTS 8
+
+struct client {
+	int fd;
+	guint source;
+	char line[256];
+	int length;
+	int preview;
+	// Ids of the bursts this client started that aren't written yet, 0 is
+	// a free slot
+	int bursts[MAX_PENDING_BURSTS];
+};
+
+static const struct control_handlers *handlers;
+static struct client clients[MAX_CLIENTS];
+static int listen_fd = -1;
+
+static int preview_fd = -1;
+static struct control_preview *preview;
+
+uint64_t
+control_timestamp()
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return now.tv_sec * 1000000000ull + now.tv_nsec;
+}
+
+// Replies are small and clients are expected to keep up, a client that
+// doesn't just misses messages instead of blocking the capture loop
+static void
+client_send(struct client *client, const char *message)
+{
+	send(client->fd, message, strlen(message), MSG_NOSIGNAL | MSG_DONTWAIT);
+}
+
+static void
+client_close(struct client *client)
+{
+	g_source_remove(client->source);
+	close(client->fd);
+	memset(client, 0, sizeof(*client));
+	client->fd = -1;
+}
+
+static int
+preview_init()
+{
+	if (preview) {
+		return 0;
+	}
+
+	preview_fd = memfd_create("megapixels-preview", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	if (preview_fd < 0) {
+		return -1;
+	}
+	if (ftruncate(preview_fd, CONTROL_PREVIEW_SIZE) < 0) {
+		goto fail;
+	}
+	// Clients can rely on the mapping size never changing
+	fcntl(preview_fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_SEAL);
+
+	preview = mmap(NULL, CONTROL_PREVIEW_SIZE, PROT_READ | PROT_WRITE, MAP_SHARED, preview_fd, 0);
+	if (preview == MAP_FAILED) {
+		preview = NULL;
+		goto fail;
+	}
+	preview->magic = CONTROL_PREVIEW_MAGIC;
+	return 0;
+
+fail:
+	close(preview_fd);
+	preview_fd = -1;
+	return -1;
+}
+
+// Hands out a read-only descriptor for the preview memory
+static int
+send_preview_fd(struct client *client)
+{
+	char path[64];
+	char reply[64];
+	char control[CMSG_SPACE(sizeof(int))] = {0};
+	struct iovec iov;
+	struct msghdr msg = {0};
+	struct cmsghdr *cmsg;
+	int fd;
+	int ret;
+
+	sprintf(path, "/proc/self/fd/%d", preview_fd);
+	fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return -1;
+	}
+
+	sprintf(reply, "ok preview %d\n", CONTROL_PREVIEW_SIZE);
+	iov.iov_base = reply;
+	iov.iov_len = strlen(reply);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &fd, sizeof(int));
+
+	ret = sendmsg(client->fd, &msg, MSG_NOSIGNAL);
+	close(fd);
+	return ret < 0 ? -1 : 0;
+}
+
+static void
+handle_command(struct client *client, char *line)
+{
+	char reply[512];
+	char *arg = strchr(line, ' ');
+
+	if (arg) {
+		*arg++ = '\0';
+	}
+
+	if (strcmp(line, "burst") == 0) {
+		uint64_t received = control_timestamp();
+		int length = arg ? atoi(arg) : 0;
+		int slot, id;
+		for (slot = 0; slot < MAX_PENDING_BURSTS && client->bursts[slot]; slot++) {
+		}
+		if (slot == MAX_PENDING_BURSTS || (id = handlers->burst(length)) < 0) {
+			client_send(client, "error busy\n");
+			return;
+		}
+		client->bursts[slot] = id;
+		sprintf(reply, "ok %d %llu\n", id, (unsigned long long)received);
+		client_send(client, reply);
+	} else if (strcmp(line, "switch") == 0) {
+		int camera = handlers->switch_camera();
+		if (camera < 0) {
+			client_send(client, "error switch\n");
+			return;
+		}
+		sprintf(reply, "ok camera %d\n", camera);
+		client_send(client, reply);
+	} else if (strcmp(line, "stats") == 0) {
+		strcpy(reply, "stats ");
+		handlers->stats(reply + 6, sizeof(reply) - 7);
+		strcat(reply, "\n");
+		client_send(client, reply);
+	} else if (strcmp(line, "record") == 0) {
+		if (!arg || handlers->record(strcmp(arg, "stop") == 0 ? NULL : arg) < 0) {
+			client_send(client, "error record\n");
+			return;
+		}
+		client_send(client, "ok\n");
+	} else if (strcmp(line, "zoom") == 0) {
+		double factor = arg ? strtod(arg, NULL) : 0;
+		if (factor <= 0) {
+			client_send(client, "error zoom\n");
+			return;
+		}
+		sprintf(reply, "ok zoom %.2f\n", handlers->zoom(factor));
+		client_send(client, reply);
+	} else if (strcmp(line, "lowlight") == 0) {
+		int on = arg && strcmp(arg, "on") == 0;
+		if (!arg || (!on && strcmp(arg, "off") != 0) || handlers->low_light(on) < 0) {
+			client_send(client, "error lowlight\n");
+			return;
+		}
+		client_send(client, "ok\n");
+	} else if (strcmp(line, "preview") == 0) {
+		if (preview_init() < 0 || send_preview_fd(client) < 0) {
+			client_send(client, "error preview\n");
+			return;
+		}
+		client->preview = 1;
+	} else {
+		client_send(client, "error unknown command\n");
+	}
+}
+
+static gboolean
+on_client_data(gint fd, GIOCondition condition, gpointer data)
+{
+	struct client *client = data;
+	ssize_t len;
+	char *end;
+
+	len = read(fd, client->line + client->length, sizeof(client->line) - 1 - client->length);
+	if (len < 0 && errno == EAGAIN) {
+		return TRUE;
+	}
+	if (len <= 0) {
+		// The source is removed together with the client
+		client_close(client);
+		return TRUE;
+	}
+	client->length += len;
+	client->line[client->length] = '\0';
+
+	while ((end = strchr(client->line, '\n')) != NULL) {
+		*end = '\0';
+		if (end > client->line && end[-1] == '\r') {
+			end[-1] = '\0';
+		}
+		handle_command(client, client->line);
+		if (client->fd < 0) {
+			return TRUE;
+		}
+		client->length -= end + 1 - client->line;
+		memmove(client->line, end + 1, client->length + 1);
+	}
+
+	if (client->length == sizeof(client->line) - 1) {
+		client_send(client, "error line too long\n");
+		client->length = 0;
+	}
+	return TRUE;
+}
+
+static gboolean
+on_connect(gint fd, GIOCondition condition, gpointer data)
+{
+	int client_fd = accept4(fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+	if (client_fd < 0) {
+		return TRUE;
+	}
+
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i].fd < 0) {
+			clients[i].fd = client_fd;
+			clients[i].source = g_unix_fd_add(client_fd, G_IO_IN | G_IO_HUP,
+				on_client_data, &clients[i]);
+			return TRUE;
+		}
+	}
+
+	close(client_fd);
+	return TRUE;
+}
+
+int
+control_init(const char *path, const struct control_handlers *control_handlers)
+{
+	struct sockaddr_un addr = {0};
+
+	handlers = control_handlers;
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		clients[i].fd = -1;
+	}
+
+	if (strlen(path) >= sizeof(addr.sun_path)) {
+		return -1;
+	}
+	addr.sun_family = AF_UNIX;
+	strcpy(addr.sun_path, path);
+
+	listen_fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd < 0) {
+		return -1;
+	}
+	unlink(path);
+	if (bind(listen_fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 ||
+		listen(listen_fd, MAX_CLIENTS) < 0) {
+		close(listen_fd);
+		listen_fd = -1;
+		return -1;
+	}
+	chmod(path, 0600);
+
+	g_unix_fd_add(listen_fd, G_IO_IN, on_connect, NULL);
+	printf("Control socket at %s\n", path);
+	return 0;
+}
+
+int
+control_preview_wanted()
+{
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0 && clients[i].preview) {
+			return 1;
+		}
+	}
+	return 0;
+}
+
+void
+control_publish_preview(const uint8_t *pixels, int width, int height, int stride)
+{
+	char message[64];
+	uint64_t sequence;
+	int row_size = width * 3;
+
+	if (!preview || !control_preview_wanted() ||
+		sizeof(*preview) + (size_t)row_size * height > CONTROL_PREVIEW_SIZE) {
+		return;
+	}
+
+	sequence = preview->sequence;
+	__atomic_store_n(&preview->sequence, sequence + 1, __ATOMIC_RELAXED);
+	// A release store only keeps earlier writes before it, the fence keeps
+	// the pixels from becoming visible before the odd sequence
+	__atomic_thread_fence(__ATOMIC_RELEASE);
+
+	uint8_t *out = (uint8_t *)(preview + 1);
+	for (int y = 0; y < height; y++) {
+		memcpy(out + y * row_size, pixels + y * stride, row_size);
+	}
+	preview->width = width;
+	preview->height = height;
+	preview->stride = row_size;
+	preview->timestamp = control_timestamp();
+
+	__atomic_store_n(&preview->sequence, sequence + 2, __ATOMIC_RELEASE);
+
+	sprintf(message, "frame %llu %llu\n", (unsigned long long)sequence + 2,
+		(unsigned long long)preview->timestamp);
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		if (clients[i].fd >= 0 && clients[i].preview) {
+			client_send(&clients[i], message);
+		}
+	}
+}
+
+void
+control_burst_done(int id, const char *dir, uint64_t first_frame, int complete)
+{
+	char message[600];
+
+	snprintf(message, sizeof(message), "%s %d %s %llu %llu\n", complete ? "done" : "failed", id, dir,
+		(unsigned long long)first_frame,
+		(unsigned long long)control_timestamp());
+	// Only the client that asked for the burst waits for it
+	for (int i = 0; i < MAX_CLIENTS; i++) {
+		for (int slot = 0; clients[i].fd >= 0 && slot < MAX_PENDING_BURSTS; slot++) {
+			if (clients[i].bursts[slot] == id) {
+				client_send(&clients[i], message);
+				clients[i].bursts[slot] = 0;
+			}
+		}
+	}
+}
@@ -0,0 +1,68 @@
+#ifndef CONTROL_H
+#define CONTROL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Line based control socket for other processes. Commands:
+//
+//   burst [N]    take a burst, replies "ok <id> <received>" and later
+//                "done <id> <dir> <first frame> <written>"
+//   switch       switch to the next camera
+//   stats        one line of key=value pipeline stats
+//   record PATH  start recording raw video to PATH
+//   record stop  stop the recording
+//   zoom FACTOR  zoom the preview and the pictures, replies "ok zoom <factor>"
+//                with the zoom that was set
+//   lowlight on|off  average the preview over the last frames and brighten it
+//   preview      replies "ok preview <size>" with a read-only memfd attached
+//                and then sends "frame <sequence> <timestamp>" for every
+//                preview frame written to it
+//
+// All timestamps are CLOCK_MONOTONIC in nanoseconds so a client on the same
+// machine can measure the latency against its own clock.
+struct control_handlers {
+	// Returns the id of the burst, -1 when it can't start
+	int (*burst)(int length);
+	int (*switch_camera)(void);
+	void (*stats)(char *buf, size_t size);
+	// Stops the recording when path is NULL
+	int (*record)(const char *path);
+	// Returns the zoom after clamping
+	double (*zoom)(double factor);
+	int (*low_light)(int on);
+};
+
+// Start of the shared preview memory, the RGB pixels follow the header.
+// The sequence is odd while a frame is being written, readers retry when
+// it's odd or changed while they were copying:
+//
+//   do {
+//           seq = __atomic_load_n(&p->sequence, __ATOMIC_ACQUIRE);
+//           copy the header fields and pixels
+//           __atomic_thread_fence(__ATOMIC_ACQUIRE);
+//   } while ((seq & 1) || __atomic_load_n(&p->sequence, __ATOMIC_RELAXED) != seq);
+//
+// The fence keeps the copy from being read after the second load.
+struct control_preview {
+	uint32_t magic;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint64_t sequence;
+	uint64_t timestamp;
+};
+
+#define CONTROL_PREVIEW_MAGIC 0x5650504d
+#define CONTROL_PREVIEW_SIZE (16 * 1024 * 1024)
+
+uint64_t control_timestamp();
+
+int control_init(const char *path, const struct control_handlers *handlers);
+int control_preview_wanted();
+void control_publish_preview(const uint8_t *pixels, int width, int height, int stride);
+// Tells the client that started burst id, complete is 0 when not all DNG
+// files of the burst could be written
+void control_burst_done(int id, const char *dir, uint64_t first_frame, int complete);
+
+#endif
@@ -0,0 +1,779 @@
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include "dng.h"
+#include "ini.h"
+#include "quickdebayer.h"
+
+// Develops directories of Megapixels DNGs to JPEG or TIFF files with the
+// color settings from a config file, to redo an archive after the color
+// matrices changed. Frames go through the same binned debayer and color
+// stage as the preview, at half the sensor resolution with one output pixel
+// per bayer quad. The lens shading and defective pixel opcodes Megapixels
+// stores are applied too, files with other opcodes fail.
+//
+// Every worker thread has its own queue of tasks. A worker opens the next
+// file when there's nothing left to do, reads the raw frame and queues a
+// task for every band of rows. Idle workers steal bands from the others, so
+// a large file is spread over all of them while small ones are each handled
+// by one. The worker that finishes the last band of a file encodes it. Files
+// are only opened while the frames in memory fit in the memory limit.
+
+// Quad rows per band, 128 sensor rows
+#define BAND_QUADS 64
+#define QUEUE_SIZE 1024
+#define JPEG_QUALITY "92"
+
+enum format {
+	FORMAT_JPEG,
+	FORMAT_TIFF,
+};
+
+// Color settings of the camera section in the config, anything not set
+// comes from the DNG itself
+struct settings {
+	float colormatrix[9];
+	float forwardmatrix[9];
+	int blacklevel;
+	int whitelevel;
+	// Numbered like the sections main.c reads, rear is 0 and front is 1
+	const char *camera;
+	int found;
+};
+
+struct source {
+	char *path;
+	char *output;
+};
+
+struct job {
+	const struct source *source;
+	int width;
+	int height;
+	enum raw_layout layout;
+	enum bayer_order order;
+	uint8_t *raw;
+	int stride;
+	// One pixel per quad
+	uint8_t *rgb;
+	int rgb_stride;
+	size_t bytes;
+	struct preview_color color;
+	// Lens shading from OpcodeList2 for every output pixel, or NULL
+	uint16_t *shading;
+	int bands;
+	int remaining;
+};
+
+struct task {
+	struct job *job;
+	int band;
+};
+
+// The owner pushes and pops at the bottom, thieves take from the top
+struct queue {
+	pthread_mutex_t lock;
+	struct task tasks[QUEUE_SIZE];
+	unsigned top;
+	unsigned bottom;
+};
+
+struct worker {
+	pthread_t thread;
+	int index;
+	struct queue queue;
+	unsigned long steals;
+};
+
+static struct settings settings = {
+	.blacklevel = -1,
+	.whitelevel = -1,
+	.camera = "0",
+};
+static enum format format = FORMAT_JPEG;
+static int overwrite = 0;
+
+static struct worker *workers;
+static int worker_count;
+
+// Files and memory, everything under lock
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t pool_wake = PTHREAD_COND_INITIALIZER;
+static struct source *sources;
+static int source_count;
+static int next_source = 0;
+static int in_flight = 0;
+static size_t memory = 0;
+static size_t memory_peak = 0;
+static size_t memory_largest = 0;
+static size_t memory_limit = 256 * 1024 * 1024;
+static int developed = 0;
+static int failed = 0;
+
+// Tasks in all queues, changed atomically and waited for under pool_lock
+static int queued = 0;
+
+static const char cfa_patterns[][4] = {
+	[BAYER_BGGR] = {2, 1, 1, 0},
+	[BAYER_GBRG] = {1, 2, 0, 1},
+	[BAYER_GRBG] = {1, 0, 2, 1},
+	[BAYER_RGGB] = {0, 1, 1, 2},
+};
+
+static int
+config_ini_handler(void *user, const char *section, const char *name,
+	const char *value)
+{
+	struct settings *s = user;
+
+	if (strcmp(section, s->camera) != 0) {
+		return 1;
+	}
+	s->found = 1;
+	if (strcmp(name, "colormatrix") == 0) {
+		sscanf(value, "%f,%f,%f,%f,%f,%f,%f,%f,%f",
+			s->colormatrix+0, s->colormatrix+1, s->colormatrix+2,
+			s->colormatrix+3, s->colormatrix+4, s->colormatrix+5,
+			s->colormatrix+6, s->colormatrix+7, s->colormatrix+8);
+	} else if (strcmp(name, "forwardmatrix") == 0) {
+		sscanf(value, "%f,%f,%f,%f,%f,%f,%f,%f,%f",
+			s->forwardmatrix+0, s->forwardmatrix+1, s->forwardmatrix+2,
+			s->forwardmatrix+3, s->forwardmatrix+4, s->forwardmatrix+5,
+			s->forwardmatrix+6, s->forwardmatrix+7, s->forwardmatrix+8);
+	} else if (strcmp(name, "blacklevel") == 0) {
+		s->blacklevel = strtol(value, NULL, 10);
+	} else if (strcmp(name, "whitelevel") == 0) {
+		s->whitelevel = strtol(value, NULL, 10);
+	}
+	return 1;
+}
+
+// Next to the DNG the name gets a suffix, the plain one is usually the
+// full resolution picture postprocess.sh made. Existing files are skipped
+// unless --overwrite is given.
+static void
+add_source(GPtrArray *list, const char *path, const char *relative, const char *output_dir)
+{
+	char *name = g_strndup(relative, strlen(relative) - strlen(".dng"));
+	const char *extension = format == FORMAT_JPEG ? ".jpg" : ".tif";
+	char *output;
+
+	if (output_dir) {
+		char *file = g_strconcat(name, extension, NULL);
+		output = g_build_filename(output_dir, file, NULL);
+		g_free(file);
+	} else {
+		char *dir = g_path_get_dirname(path);
+		char *base = g_path_get_basename(name);
+		char *file = g_strconcat(base, "-developed", extension, NULL);
+		output = g_build_filename(dir, file, NULL);
+		g_free(dir);
+		g_free(base);
+		g_free(file);
+	}
+	g_free(name);
+
+	if (!overwrite && g_file_test(output, G_FILE_TEST_EXISTS)) {
+		printf("Skipping %s, %s exists\n", path, output);
+		g_free(output);
+		return;
+	}
+	struct source *source = g_new0(struct source, 1);
+	source->path = g_strdup(path);
+	source->output = output;
+	g_ptr_array_add(list, source);
+}
+
+static int
+is_dng(const char *name)
+{
+	size_t length = strlen(name);
+	return length > 4 && g_ascii_strcasecmp(name + length - 4, ".dng") == 0;
+}
+
+// Finds the DNGs below a directory, paths relative to the directory keep
+// bursts apart in the output directory
+static void
+scan_directory(GPtrArray *list, const char *root, const char *relative, const char *output_dir)
+{
+	char *path = relative ? g_build_filename(root, relative, NULL) : g_strdup(root);
+	GDir *dir = g_dir_open(path, 0, NULL);
+	const char *name;
+
+	if (!dir) {
+		g_free(path);
+		return;
+	}
+	while ((name = g_dir_read_name(dir))) {
+		char *child = g_build_filename(path, name, NULL);
+		char *child_relative = relative ? g_build_filename(relative, name, NULL) : g_strdup(name);
+
+		if (g_file_test(child, G_FILE_TEST_IS_DIR)) {
+			scan_directory(list, root, child_relative, output_dir);
+		} else if (is_dng(name)) {
+			add_source(list, child, child_relative, output_dir);
+		}
+		g_free(child);
+		g_free(child_relative);
+	}
+	g_dir_close(dir);
+	g_free(path);
+}
+
+static int
+compare_sources(gconstpointer a, gconstpointer b)
+{
+	const struct source *sa = *(struct source **)a;
+	const struct source *sb = *(struct source **)b;
+	return strcmp(sa->path, sb->path);
+}
+
+static void
+queue_push(struct worker *worker, const struct task *task)
+{
+	struct queue *q = &worker->queue;
+
+	pthread_mutex_lock(&q->lock);
+	q->tasks[q->bottom % QUEUE_SIZE] = *task;
+	q->bottom++;
+	pthread_mutex_unlock(&q->lock);
+
+	// Wakes the idle workers so they can steal it
+	__atomic_add_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+	pthread_mutex_lock(&pool_lock);
+	pthread_cond_broadcast(&pool_wake);
+	pthread_mutex_unlock(&pool_lock);
+}
+
+static int
+queue_full(struct worker *worker)
+{
+	struct queue *q = &worker->queue;
+	pthread_mutex_lock(&q->lock);
+	int full = q->bottom - q->top >= QUEUE_SIZE;
+	pthread_mutex_unlock(&q->lock);
+	return full;
+}
+
+static int
+queue_pop(struct queue *q, struct task *task, int steal)
+{
+	int found = 0;
+
+	pthread_mutex_lock(&q->lock);
+	if (q->bottom != q->top) {
+		if (steal) {
+			*task = q->tasks[q->top % QUEUE_SIZE];
+			q->top++;
+		} else {
+			q->bottom--;
+			*task = q->tasks[q->bottom % QUEUE_SIZE];
+		}
+		found = 1;
+	}
+	pthread_mutex_unlock(&q->lock);
+
+	if (found) {
+		__atomic_sub_fetch(&queued, 1, __ATOMIC_SEQ_CST);
+	}
+	return found;
+}
+
+// Own tasks first, newest first while they're in cache, then the oldest
+// tasks of the other workers
+static int
+next_task(struct worker *worker, struct task *task)
+{
+	if (queue_pop(&worker->queue, task, 0)) {
+		return 1;
+	}
+	for (int i = 1; i < worker_count; i++) {
+		struct worker *victim = &workers[(worker->index + i) % worker_count];
+		if (queue_pop(&victim->queue, task, 1)) {
+			worker->steals++;
+			return 1;
+		}
+	}
+	return 0;
+}
+
+static void
+job_free(struct job *job)
+{
+	free(job->raw);
+	free(job->rgb);
+	free(job->shading);
+	free(job);
+}
+
+// Replaces the defects listed in OpcodeList1 in the raw frame
+static void
+fix_badpixels(struct job *job, const struct badpixels *map)
+{
+	uint16_t *line = malloc(job->width * sizeof(uint16_t));
+
+	for (int y = 0; y < job->height; y++) {
+		uint8_t *row = job->raw + (size_t)y * job->stride;
+		if (job->layout != RAW_8) {
+			badpixels_apply_row(map, y, (uint16_t *)row);
+			continue;
+		}
+		raw_unpack_row(RAW_8, row, line, job->width);
+		badpixels_apply_row(map, y, line);
+		for (int x = 0; x < job->width; x++) {
+			row[x] = line[x];
+		}
+	}
+	free(line);
+}
+
+// Reads the raw frame and sets up the color stage for it
+static struct job *
+job_load(const struct source *source)
+{
+	uint16_t count, bits = 0;
+	uint32_t width = 0, height = 0;
+	uint64_t *subifds = NULL;
+	float *values = NULL;
+	uint8_t *pattern = NULL;
+	float colormatrix[9] = {0}, forwardmatrix[9] = {0}, neutral[3] = {1, 1, 1};
+	int has_colormatrix = 0, has_forwardmatrix = 0;
+	int blacklevel = 0, whitelevel = 0;
+	uint32_t opcodes_size;
+	uint8_t *opcodes;
+	struct shading_grid *grid = NULL;
+	struct badpixels *badpixels = NULL;
+	struct job *job = NULL;
+
+	TIFF *tif = TIFFOpen(source->path, "r");
+	if (!tif) {
+		return NULL;
+	}
+
+	if (TIFFGetField(tif, TIFFTAG_COLORMATRIX1, &count, &values) && count == 9) {
+		memcpy(colormatrix, values, sizeof(colormatrix));
+		has_colormatrix = 1;
+	}
+	if (TIFFGetField(tif, TIFFTAG_FORWARDMATRIX1, &count, &values) && count == 9) {
+		memcpy(forwardmatrix, values, sizeof(forwardmatrix));
+		has_forwardmatrix = 1;
+	}
+	if (TIFFGetField(tif, TIFFTAG_ASSHOTNEUTRAL, &count, &values) && count == 3) {
+		memcpy(neutral, values, sizeof(neutral));
+	}
+
+	if (!TIFFGetField(tif, TIFFTAG_SUBIFD, &count, &subifds) || count < 1 ||
+			!TIFFSetSubDirectory(tif, subifds[0])) {
+		goto fail;
+	}
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &width);
+	TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &height);
+	TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &bits);
+	if (TIFFGetField(tif, TIFFTAG_BLACKLEVEL, &count, &values) && count >= 1) {
+		blacklevel = values[0];
+	}
+	uint32_t *levels = NULL;
+	if (TIFFGetField(tif, TIFFTAG_WHITELEVEL, &count, &levels) && count >= 1) {
+		whitelevel = levels[0];
+	}
+	// libtiff 4.2 made the pattern variable length
+#if TIFFLIB_VERSION >= 20201219
+	if (!TIFFGetField(tif, TIFFTAG_CFAPATTERN, &count, &pattern) || count != 4) {
+		goto fail;
+	}
+#else
+	if (!TIFFGetField(tif, TIFFTAG_CFAPATTERN, &pattern)) {
+		goto fail;
+	}
+#endif
+
+	job = calloc(1, sizeof(struct job));
+	job->source = source;
+	job->width = width & ~1;
+	job->height = height & ~1;
+
+	int order = -1;
+	for (int i = 0; i < 4; i++) {
+		if (memcmp(pattern, cfa_patterns[i], 4) == 0) {
+			order = i;
+		}
+	}
+	job->order = order;
+	if (settings.whitelevel > 0) {
+		whitelevel = settings.whitelevel;
+	}
+	// Samples above 8 bits are stored in 16, the white level says how many
+	if (bits == 8) {
+		job->layout = RAW_8;
+	} else if (bits == 16 && whitelevel > 0 && whitelevel < 4096) {
+		job->layout = whitelevel < 1024 ? RAW_10 : RAW_12;
+	} else {
+		goto fail;
+	}
+	if (order < 0 || job->width < 2 || job->height < 2) {
+		goto fail;
+	}
+
+	// Corrections Megapixels left to the raw developer
+	if (TIFFGetField(tif, TIFFTAG_OPCODELIST1, &opcodes_size, &opcodes) &&
+			!(badpixels = dng_read_badpixels(opcodes, opcodes_size, width, height))) {
+		g_printerr("%s has bad pixel opcodes that can't be applied\n", source->path);
+		goto fail;
+	}
+	if (TIFFGetField(tif, TIFFTAG_OPCODELIST2, &opcodes_size, &opcodes) &&
+			!(grid = dng_read_gainmaps(opcodes, opcodes_size, (const char *)pattern, width, height))) {
+		g_printerr("%s has lens shading opcodes that can't be applied\n", source->path);
+		goto fail;
+	}
+
+	job->stride = width * (bits / 8);
+	job->rgb_stride = job->width / 2 * 3;
+	job->bytes = (size_t)job->stride * height + (size_t)job->rgb_stride * (job->height / 2);
+	job->raw = malloc((size_t)job->stride * height);
+	job->rgb = malloc((size_t)job->rgb_stride * (job->height / 2));
+	if (!job->raw || !job->rgb) {
+		goto fail;
+	}
+	for (uint32_t row = 0; row < height; row++) {
+		if (TIFFReadScanline(tif, job->raw + (size_t)row * job->stride, row, 0) < 0) {
+			goto fail;
+		}
+	}
+	TIFFClose(tif);
+
+	if (badpixels) {
+		fix_badpixels(job, badpixels);
+		badpixels_free(badpixels);
+	}
+	if (grid) {
+		job->shading = shading_preview_table(grid, job->width / 2, job->height / 2, 0, 0, 1, 1);
+		job->bytes += (size_t)job->width / 2 * (job->height / 2) * 3 * sizeof(uint16_t);
+		shading_grid_free(grid);
+	}
+
+	// The config replaces both matrices when it has either
+	float matrix[9];
+	if (settings.colormatrix[0] || settings.forwardmatrix[0]) {
+		preview_color_matrix(settings.colormatrix[0] ? settings.colormatrix : NULL,
+			settings.forwardmatrix[0] ? settings.forwardmatrix : NULL, matrix);
+	} else {
+		preview_color_matrix(has_colormatrix ? colormatrix : NULL,
+			has_forwardmatrix ? forwardmatrix : NULL, matrix);
+	}
+	if (settings.blacklevel >= 0) {
+		blacklevel = settings.blacklevel;
+	}
+	preview_color_init(&job->color, raw_bits(job->layout), blacklevel, whitelevel, matrix, neutral);
+
+	job->bands = (job->height / 2 + BAND_QUADS - 1) / BAND_QUADS;
+	job->remaining = job->bands;
+	return job;
+
+fail:
+	if (job) {
+		job_free(job);
+	}
+	shading_grid_free(grid);
+	badpixels_free(badpixels);
+	TIFFClose(tif);
+	return NULL;
+}
+
+static int
+write_tiff(const struct job *job, const char *path)
+{
+	int width = job->width / 2, height = job->height / 2;
+	TIFF *tif = TIFFOpen(path, "w");
+	if (!tif) {
+		return -1;
+	}
+
+	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, width);
+	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, height);
+	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
+	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 3);
+	TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+	TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+	TIFFSetField(tif, TIFFTAG_ROWSPERSTRIP, TIFFDefaultStripSize(tif, 0));
+	TIFFSetField(tif, TIFFTAG_SOFTWARE, "Megapixels");
+	for (int row = 0; row < height; row++) {
+		if (TIFFWriteScanline(tif, job->rgb + (size_t)row * job->rgb_stride, row, 0) < 0) {
+			TIFFClose(tif);
+			return -1;
+		}
+	}
+	TIFFClose(tif);
+	return 0;
+}
+
+static int
+write_jpeg(const struct job *job, const char *path)
+{
+	GError *error = NULL;
+	GdkPixbuf *pixbuf = gdk_pixbuf_new_from_data(job->rgb, GDK_COLORSPACE_RGB, FALSE, 8,
+		job->width / 2, job->height / 2, job->rgb_stride, NULL, NULL);
+	gboolean saved = gdk_pixbuf_save(pixbuf, path, "jpeg", &error, "quality", JPEG_QUALITY, NULL);
+
+	g_object_unref(pixbuf);
+	if (!saved) {
+		g_error_free(error);
+		return -1;
+	}
+	return 0;
+}
+
+static void
+encode_job(struct job *job)
+{
+	char *dir = g_path_get_dirname(job->source->output);
+	int ok = g_mkdir_with_parents(dir, 0755) == 0 &&
+		(format == FORMAT_JPEG ? write_jpeg(job, job->source->output) :
+		write_tiff(job, job->source->output)) == 0;
+	g_free(dir);
+
+	if (!ok) {
+		g_printerr("Could not write %s\n", job->source->output);
+	}
+
+	pthread_mutex_lock(&pool_lock);
+	memory -= job->bytes;
+	in_flight--;
+	if (ok) {
+		developed++;
+	} else {
+		failed++;
+	}
+	pthread_cond_broadcast(&pool_wake);
+	pthread_mutex_unlock(&pool_lock);
+	job_free(job);
+}
+
+static void
+run_task(const struct task *task)
+{
+	struct job *job = task->job;
+	int first = task->band * BAND_QUADS;
+	int quads = MIN(BAND_QUADS, job->height / 2 - first);
+	const struct debayer_kernels *kernels = debayer_kernels_get(job->order, job->layout);
+	struct preview_color color = job->color;
+
+	// The band is a frame of its own to the kernel, with its rows of gains
+	if (job->shading) {
+		color.shading = job->shading + (size_t)first * (job->width / 2) * 3;
+		color.shading_width = job->width / 2;
+		color.shading_height = quads;
+	}
+	kernels->binned(job->raw + (size_t)first * 2 * job->stride,
+		job->rgb + (size_t)first * job->rgb_stride, job->width, quads * 2, job->stride,
+		job->width / 2, quads, job->rgb_stride, &color);
+
+	// Whoever does the last band encodes the file
+	if (__atomic_sub_fetch(&job->remaining, 1, __ATOMIC_ACQ_REL) == 0) {
+		encode_job(job);
+	}
+}
+
+// Whether another file may be opened, with pool_lock held. The next file is
+// assumed to be as large as the largest one so far.
+static int
+can_open()
+{
+	return next_source < source_count &&
+		(in_flight == 0 || memory + memory_largest <= memory_limit);
+}
+
+// Opens the next file and queues its bands, 0 when there is nothing to open
+// right now
+static int
+open_next(struct worker *worker)
+{
+	pthread_mutex_lock(&pool_lock);
+	if (!can_open()) {
+		pthread_mutex_unlock(&pool_lock);
+		return 0;
+	}
+	const struct source *source = &sources[next_source++];
+	in_flight++;
+	pthread_mutex_unlock(&pool_lock);
+
+	struct job *job = job_load(source);
+
+	pthread_mutex_lock(&pool_lock);
+	if (!job) {
+		g_printerr("Could not read %s\n", source->path);
+		in_flight--;
+		failed++;
+		pthread_cond_broadcast(&pool_wake);
+		pthread_mutex_unlock(&pool_lock);
+		return 1;
+	}
+	memory += job->bytes;
+	memory_peak = MAX(memory_peak, memory);
+	memory_largest = MAX(memory_largest, job->bytes);
+	pthread_mutex_unlock(&pool_lock);
+
+	// Queued from the bottom up, so the owner starts at the top of the frame
+	// and thieves take the bottom
+	for (int band = job->bands - 1; band >= 0; band--) {
+		struct task task = {.job = job, .band = band};
+		if (queue_full(worker)) {
+			run_task(&task);
+		} else {
+			queue_push(worker, &task);
+		}
+	}
+	return 1;
+}
+
+static void *
+worker_run(void *data)
+{
+	struct worker *worker = data;
+	struct task task;
+
+	for (;;) {
+		if (next_task(worker, &task)) {
+			run_task(&task);
+			continue;
+		}
+		if (open_next(worker)) {
+			continue;
+		}
+
+		// Nothing to steal and no file that fits, wait for either
+		pthread_mutex_lock(&pool_lock);
+		if (next_source == source_count && in_flight == 0) {
+			pthread_mutex_unlock(&pool_lock);
+			return NULL;
+		}
+		if (__atomic_load_n(&queued, __ATOMIC_SEQ_CST) == 0 && !can_open()) {
+			pthread_cond_wait(&pool_wake, &pool_lock);
+		}
+		pthread_mutex_unlock(&pool_lock);
+	}
+}
+
+static double
+seconds_since(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return (now.tv_sec - start->tv_sec) + (now.tv_nsec - start->tv_nsec) / 1e9;
+}
+
+static void
+usage(const char *name)
+{
+	printf("Usage: %s [--config FILE [--camera SECTION]] [--format jpeg|tiff] [--jobs N] [--memory MB] [--output DIR] [--overwrite] DIR|FILE...\n", name);
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *config = NULL;
+	const char *output_dir = NULL;
+	GPtrArray *inputs = g_ptr_array_new();
+	GPtrArray *list = g_ptr_array_new();
+	struct timespec start;
+	unsigned long steals = 0;
+
+	worker_count = sysconf(_SC_NPROCESSORS_ONLN);
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--config") == 0 && i + 1 < argc) {
+			config = argv[++i];
+		} else if (strcmp(argv[i], "--camera") == 0 && i + 1 < argc) {
+			i++;
+			settings.camera = strcmp(argv[i], "rear") == 0 ? "0" :
+				strcmp(argv[i], "front") == 0 ? "1" : argv[i];
+		} else if (strcmp(argv[i], "--format") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "jpeg") == 0) {
+				format = FORMAT_JPEG;
+			} else if (strcmp(argv[i], "tiff") == 0) {
+				format = FORMAT_TIFF;
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--jobs") == 0 && i + 1 < argc) {
+			worker_count = strtol(argv[++i], NULL, 10);
+		} else if (strcmp(argv[i], "--memory") == 0 && i + 1 < argc) {
+			long megabytes = strtol(argv[++i], NULL, 10);
+			memory_limit = (size_t)MAX(megabytes, 1) * 1024 * 1024;
+		} else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+			output_dir = argv[++i];
+		} else if (strcmp(argv[i], "--overwrite") == 0) {
+			overwrite = 1;
+		} else if (strcmp(argv[i], "--help") == 0) {
+			usage(argv[0]);
+			return 0;
+		} else if (argv[i][0] == '-') {
+			usage(argv[0]);
+			return 1;
+		} else {
+			g_ptr_array_add(inputs, argv[i]);
+		}
+	}
+	if (inputs->len == 0) {
+		usage(argv[0]);
+		return 1;
+	}
+	worker_count = MAX(worker_count, 1);
+
+	if (config && ini_parse(config, config_ini_handler, &settings) != 0) {
+		g_printerr("Could not parse config file %s\n", config);
+		return 1;
+	}
+	if (config && !settings.found) {
+		g_printerr("No camera %s in %s\n", settings.camera, config);
+		return 1;
+	}
+
+	for (int i = 0; i < inputs->len; i++) {
+		const char *input = g_ptr_array_index(inputs, i);
+		if (g_file_test(input, G_FILE_TEST_IS_DIR)) {
+			scan_directory(list, input, NULL, output_dir);
+		} else if (is_dng(input)) {
+			char *name = g_path_get_basename(input);
+			add_source(list, input, name, output_dir);
+			g_free(name);
+		} else {
+			g_printerr("%s is not a DNG file or a directory\n", input);
+			return 1;
+		}
+	}
+	g_ptr_array_sort(list, compare_sources);
+	source_count = list->len;
+	sources = calloc(source_count + 1, sizeof(struct source));
+	for (int i = 0; i < source_count; i++) {
+		sources[i] = *(struct source *)g_ptr_array_index(list, i);
+	}
+
+	dng_init();
+	clock_gettime(CLOCK_MONOTONIC, &start);
+
+	workers = calloc(worker_count, sizeof(struct worker));
+	for (int i = 0; i < worker_count; i++) {
+		workers[i].index = i;
+		pthread_mutex_init(&workers[i].queue.lock, NULL);
+	}
+	for (int i = 0; i < worker_count; i++) {
+		pthread_create(&workers[i].thread, NULL, worker_run, &workers[i]);
+	}
+	for (int i = 0; i < worker_count; i++) {
+		pthread_join(workers[i].thread, NULL);
+		steals += workers[i].steals;
+	}
+
+	double seconds = seconds_since(&start);
+	printf("Developed %d of %d images in %.2f s, %.2f images/s with %d threads\n",
+		developed, source_count, seconds, seconds > 0 ? developed / seconds : 0.0, worker_count);
+	printf("Peak frame memory %.1f MB, %lu bands stolen\n", memory_peak / (1024.0 * 1024.0), steals);
+	return failed ? 1 : 0;
+}
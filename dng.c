@@ -0,0 +1,447 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "dng.h"
+
+static void
+register_custom_tiff_tags(TIFF *tif)
+{
+	static const TIFFFieldInfo custom_fields[] = {
+		{TIFFTAG_FORWARDMATRIX1, -1, -1, TIFF_SRATIONAL, FIELD_CUSTOM, 1, 1, "ForwardMatrix1"},
+		{TIFFTAG_OPCODELIST1, TIFF_VARIABLE2, TIFF_VARIABLE2, TIFF_UNDEFINED, FIELD_CUSTOM, 1, 1, "OpcodeList1"},
+		{TIFFTAG_OPCODELIST2, TIFF_VARIABLE2, TIFF_VARIABLE2, TIFF_UNDEFINED, FIELD_CUSTOM, 1, 1, "OpcodeList2"},
+	};
+
+	// Add missing dng fields
+	TIFFMergeFieldInfo(tif, custom_fields, sizeof(custom_fields) / sizeof(custom_fields[0]));
+}
+
+void
+dng_init()
+{
+	TIFFSetTagExtender(register_custom_tiff_tags);
+}
+
+// Opcode parameters are big endian whatever the byte order of the file
+static uint8_t *
+put_u32(uint8_t *p, uint32_t v)
+{
+	p[0] = v >> 24;
+	p[1] = v >> 16;
+	p[2] = v >> 8;
+	p[3] = v;
+	return p + 4;
+}
+
+static uint8_t *
+put_f64(uint8_t *p, double v)
+{
+	uint64_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	p = put_u32(p, bits >> 32);
+	return put_u32(p, bits);
+}
+
+static uint8_t *
+put_f32(uint8_t *p, float v)
+{
+	uint32_t bits;
+	memcpy(&bits, &v, sizeof(bits));
+	return put_u32(p, bits);
+}
+
+static uint32_t
+get_u32(const uint8_t *p)
+{
+	return (uint32_t)p[0] << 24 | p[1] << 16 | p[2] << 8 | p[3];
+}
+
+static double
+get_f64(const uint8_t *p)
+{
+	uint64_t bits = (uint64_t)get_u32(p) << 32 | get_u32(p + 4);
+	double v;
+	memcpy(&v, &bits, sizeof(v));
+	return v;
+}
+
+static float
+get_f32(const uint8_t *p)
+{
+	uint32_t bits = get_u32(p);
+	float v;
+	memcpy(&v, &bits, sizeof(v));
+	return v;
+}
+
+#define OPCODE_FIXBADPIXELSLIST 5
+#define OPCODE_GAINMAP 9
+#define OPCODE_GAINMAP_PARAMS 76
+#define OPCODE_VERSION 0x01030000
+// Readers that don't know an opcode may skip it
+#define OPCODE_OPTIONAL 1
+
+// An opcode list with one GainMap per position in the bayer quad, each
+// covering every other row and column starting at its position
+static uint8_t *
+gainmap_opcodes(const struct shading_grid *grid, const char *cfapattern,
+	int width, int height, uint32_t *size)
+{
+	int points = grid->cols * grid->rows;
+	uint32_t params = OPCODE_GAINMAP_PARAMS + points * 4;
+	uint8_t *list, *p;
+
+	*size = 4 + 4 * (16 + params);
+	p = list = malloc(*size);
+	p = put_u32(p, 4);
+
+	for (int pos = 0; pos < 4; pos++) {
+		int top = pos >> 1;
+		int left = pos & 1;
+		enum shading_plane plane;
+
+		// Greens are told apart by the other color in their row
+		switch (cfapattern[pos]) {
+			case 0:
+				plane = SHADING_R;
+				break;
+			case 2:
+				plane = SHADING_B;
+				break;
+			default:
+				plane = cfapattern[pos ^ 1] == 0 ? SHADING_GR : SHADING_GB;
+				break;
+		}
+
+		p = put_u32(p, OPCODE_GAINMAP);
+		p = put_u32(p, OPCODE_VERSION);
+		p = put_u32(p, OPCODE_OPTIONAL);
+		p = put_u32(p, params);
+		p = put_u32(p, top);
+		p = put_u32(p, left);
+		p = put_u32(p, height);
+		p = put_u32(p, width);
+		p = put_u32(p, 0);  // Plane
+		p = put_u32(p, 1);  // Planes
+		p = put_u32(p, 2);  // RowPitch
+		p = put_u32(p, 2);  // ColPitch
+		p = put_u32(p, grid->rows);
+		p = put_u32(p, grid->cols);
+		p = put_f64(p, 1.0 / (grid->rows - 1));
+		p = put_f64(p, 1.0 / (grid->cols - 1));
+		p = put_f64(p, 0.0);
+		p = put_f64(p, 0.0);
+		p = put_u32(p, 1);  // MapPlanes
+		for (int i = 0; i < points; i++) {
+			p = put_f32(p, grid->gains[plane][i]);
+		}
+	}
+	return list;
+}
+
+// An opcode list with the defects as bad points, the bayer phase is the
+// color of the top left sample
+static uint8_t *
+badpixel_opcodes(const struct badpixels *map, const char *cfapattern, uint32_t *size)
+{
+	uint32_t params = 12 + map->count * 8;
+	uint32_t phase;
+	uint8_t *list, *p;
+
+	switch (cfapattern[0]) {
+		case 0:
+			phase = 0;
+			break;
+		case 2:
+			phase = 3;
+			break;
+		default:
+			phase = cfapattern[1] == 0 ? 1 : 2;
+			break;
+	}
+
+	*size = 4 + 16 + params;
+	p = list = malloc(*size);
+	p = put_u32(p, 1);
+	p = put_u32(p, OPCODE_FIXBADPIXELSLIST);
+	p = put_u32(p, OPCODE_VERSION);
+	p = put_u32(p, OPCODE_OPTIONAL);
+	p = put_u32(p, params);
+	p = put_u32(p, phase);
+	p = put_u32(p, map->count);
+	p = put_u32(p, 0);  // BadRectCount
+	for (int i = 0; i < map->count; i++) {
+		p = put_u32(p, map->pixels[i].y);
+		p = put_u32(p, map->pixels[i].x);
+	}
+	return list;
+}
+
+// Plane of the GainMap at a position in the quad, like gainmap_opcodes()
+static enum shading_plane
+gainmap_plane(const char *cfapattern, int pos)
+{
+	switch (cfapattern[pos]) {
+		case 0:
+			return SHADING_R;
+		case 2:
+			return SHADING_B;
+		default:
+			return cfapattern[pos ^ 1] == 0 ? SHADING_GR : SHADING_GB;
+	}
+}
+
+struct shading_grid *
+dng_read_gainmaps(const uint8_t *list, uint32_t size, const char *cfapattern, int width, int height)
+{
+	struct shading_grid *grid = NULL;
+	int found[4] = {0};
+	const uint8_t *p = list + 4, *end = list + size;
+
+	if (size < 4) {
+		return NULL;
+	}
+	for (uint32_t i = get_u32(list); i > 0; i--) {
+		if (end - p < 16 + OPCODE_GAINMAP_PARAMS || get_u32(p) != OPCODE_GAINMAP) {
+			goto fail;
+		}
+		uint32_t params = get_u32(p + 12);
+		const uint8_t *q = p + 16;
+		int top = get_u32(q), left = get_u32(q + 4);
+		int rows = get_u32(q + 32), cols = get_u32(q + 36);
+		// Only the layout gainmap_opcodes() writes, a grid over the whole
+		// frame for one position in the quad
+		if (params > end - q || top > 1 || left > 1 || get_u32(q + 8) < height ||
+				get_u32(q + 12) < width || get_u32(q + 16) != 0 || get_u32(q + 20) != 1 ||
+				get_u32(q + 24) != 2 || get_u32(q + 28) != 2 || rows < 2 || cols < 2 ||
+				rows > SHADING_MAX_POINTS || cols > SHADING_MAX_POINTS ||
+				get_f64(q + 56) != 0.0 || get_f64(q + 64) != 0.0 || get_u32(q + 72) != 1 ||
+				params != OPCODE_GAINMAP_PARAMS + rows * cols * 4 ||
+				fabs(get_f64(q + 40) * (rows - 1) - 1) > 1e-6 ||
+				fabs(get_f64(q + 48) * (cols - 1) - 1) > 1e-6) {
+			goto fail;
+		}
+		if (!grid) {
+			grid = shading_grid_new(cols, rows);
+		}
+		enum shading_plane plane = gainmap_plane(cfapattern, top * 2 + left);
+		if (grid->cols != cols || grid->rows != rows || found[plane]) {
+			goto fail;
+		}
+		for (int k = 0; k < rows * cols; k++) {
+			grid->gains[plane][k] = get_f32(q + OPCODE_GAINMAP_PARAMS + k * 4);
+		}
+		found[plane] = 1;
+		p = q + params;
+	}
+	if (found[0] && found[1] && found[2] && found[3]) {
+		return grid;
+	}
+
+fail:
+	shading_grid_free(grid);
+	return NULL;
+}
+
+struct badpixels *
+dng_read_badpixels(const uint8_t *list, uint32_t size, int width, int height)
+{
+	const uint8_t *p = list + 4, *end = list + size;
+
+	// One list of bad points and no rectangles, as badpixel_opcodes() writes
+	if (size < 4 + 16 + 12 || get_u32(list) != 1 || get_u32(p) != OPCODE_FIXBADPIXELSLIST) {
+		return NULL;
+	}
+	uint32_t params = get_u32(p + 12);
+	const uint8_t *q = p + 16;
+	uint32_t count = get_u32(q + 4);
+	if (params > end - q || get_u32(q + 8) != 0 || count > (params - 12) / 8) {
+		return NULL;
+	}
+
+	uint16_t *coords = malloc((count + 1) * 2 * sizeof(uint16_t));
+	for (uint32_t i = 0; i < count; i++) {
+		uint32_t y = get_u32(q + 12 + i * 8);
+		uint32_t x = get_u32(q + 16 + i * 8);
+		if (x >= width || y >= height) {
+			free(coords);
+			return NULL;
+		}
+		coords[i * 2] = x;
+		coords[i * 2 + 1] = y;
+	}
+	struct badpixels *map = badpixels_new(width, height, coords, count);
+	free(coords);
+	return map;
+}
+
+void
+dng_write(TIFF *tif, const uint8_t *raw, const struct dng_info *info)
+{
+	struct tm tim;
+	char datetime[20] = {0};
+	char uniquecameramodel[255];
+	long sub_offset = 0;
+	uint64 exif_offset = 0;
+	static const short cfapatterndim[] = {2, 2};
+	int bits = raw_bits(info->layout);
+	int shading_opcodes = info->shading_grid && !info->shading_table;
+	int fix_opcodes = info->badpixels && info->badpixel_opcodes;
+	int fix_pixels = info->badpixels && !info->badpixel_opcodes;
+	// Opcodes are only understood from DNG 1.3 on
+	int opcodes = shading_opcodes || fix_opcodes;
+
+	localtime_r(&info->time, &tim);
+	strftime(datetime, 20, "%Y:%m:%d %H:%M:%S", &tim);
+
+	// Define TIFF thumbnail
+	TIFFSetField(tif, TIFFTAG_SUBFILETYPE, 1);
+	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, info->width >> 4);
+	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, info->height >> 4);
+	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
+	TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
+	TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
+	TIFFSetField(tif, TIFFTAG_MAKE, info->make);
+	TIFFSetField(tif, TIFFTAG_MODEL, info->model);
+	TIFFSetField(tif, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
+	TIFFSetField(tif, TIFFTAG_DATETIME, datetime);
+	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 3);
+	TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField(tif, TIFFTAG_SOFTWARE, "Megapixels");
+	TIFFSetField(tif, TIFFTAG_SUBIFD, 1, &sub_offset);
+	if (opcodes) {
+		TIFFSetField(tif, TIFFTAG_DNGVERSION, "\001\003\0\0");
+		TIFFSetField(tif, TIFFTAG_DNGBACKWARDVERSION, "\001\003\0\0");
+	} else {
+		TIFFSetField(tif, TIFFTAG_DNGVERSION, "\001\001\0\0");
+		TIFFSetField(tif, TIFFTAG_DNGBACKWARDVERSION, "\001\0\0\0");
+	}
+	snprintf(uniquecameramodel, sizeof(uniquecameramodel), "%s %s", info->make, info->model);
+	TIFFSetField(tif, TIFFTAG_UNIQUECAMERAMODEL, uniquecameramodel);
+	TIFFSetField(tif, TIFFTAG_COLORMATRIX1, 9, info->colormatrix);
+	if(info->forwardmatrix) {
+		TIFFSetField(tif, TIFFTAG_FORWARDMATRIX1, 9, info->forwardmatrix);
+	}
+	TIFFSetField(tif, TIFFTAG_ASSHOTNEUTRAL, 3, info->neutral);
+	TIFFSetField(tif, TIFFTAG_CALIBRATIONILLUMINANT1, 21);
+	// Write black thumbnail, only windows uses this
+	{
+		unsigned char *buf = (unsigned char *)calloc(3, (int)info->width >> 4);
+		for (int row = 0; row < info->height>>4; row++) {
+			TIFFWriteScanline(tif, buf, row, 0);
+		}
+		free(buf);
+	}
+	TIFFWriteDirectory(tif);
+
+
+	// Define main photo
+	TIFFSetField(tif, TIFFTAG_SUBFILETYPE, 0);
+	TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, info->width);
+	TIFFSetField(tif, TIFFTAG_IMAGELENGTH, info->height);
+	TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, bits > 8 ? 16 : 8);
+	TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_CFA);
+	TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
+	TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
+	TIFFSetField(tif, TIFFTAG_CFAREPEATPATTERNDIM, cfapatterndim);
+	// libtiff 4.2 made the pattern variable length
+#if TIFFLIB_VERSION >= 20201219
+	TIFFSetField(tif, TIFFTAG_CFAPATTERN, 4, info->cfapattern);
+#else
+	TIFFSetField(tif, TIFFTAG_CFAPATTERN, info->cfapattern);
+#endif
+	if(info->whitelevel) {
+		TIFFSetField(tif, TIFFTAG_WHITELEVEL, 1, &info->whitelevel);
+	} else if(bits > 8) {
+		// Samples are stored in 16 bits, the range isn't implied anymore
+		int whitelevel = (1 << bits) - 1;
+		TIFFSetField(tif, TIFFTAG_WHITELEVEL, 1, &whitelevel);
+	}
+	if(info->blacklevel) {
+		// libtiff takes the rational BlackLevel as floats
+		float blacklevel = info->blacklevel;
+		TIFFSetField(tif, TIFFTAG_BLACKLEVEL, 1, &blacklevel);
+	}
+	if (info->crop_width) {
+		float origin[] = {info->crop_x, info->crop_y};
+		float size[] = {info->crop_width, info->crop_height};
+		TIFFSetField(tif, TIFFTAG_DEFAULTCROPORIGIN, origin);
+		TIFFSetField(tif, TIFFTAG_DEFAULTCROPSIZE, size);
+	}
+	if (fix_opcodes) {
+		uint32_t size;
+		uint8_t *list = badpixel_opcodes(info->badpixels, info->cfapattern, &size);
+		TIFFSetField(tif, TIFFTAG_OPCODELIST1, size, list);
+		free(list);
+	}
+	if (shading_opcodes) {
+		uint32_t size;
+		uint8_t *list = gainmap_opcodes(info->shading_grid, info->cfapattern,
+			info->width, info->height, &size);
+		TIFFSetField(tif, TIFFTAG_OPCODELIST2, size, list);
+		free(list);
+	}
+	TIFFCheckpointDirectory(tif);
+
+	if (info->shading_table || fix_pixels) {
+		// Unpacked for the corrections, 8 bit samples are packed again after
+		uint16_t *pLine = malloc(info->width * sizeof(uint16_t));
+		uint8_t *line8 = malloc(info->width);
+		for(int row = 0; row < info->height; row++){
+			raw_unpack_row(info->layout, raw+(row*info->stride), pLine, info->width);
+			if (fix_pixels) {
+				badpixels_apply_row(info->badpixels, row, pLine);
+			}
+			if (info->shading_table) {
+				shading_apply_row(info->shading_table + (size_t)row * info->width, pLine,
+					info->width, info->blacklevel, (1 << bits) - 1);
+			}
+			if (bits > 8) {
+				TIFFWriteScanline(tif, pLine, row, 0);
+			} else {
+				for (int x = 0; x < info->width; x++) {
+					line8[x] = pLine[x];
+				}
+				TIFFWriteScanline(tif, line8, row, 0);
+			}
+		}
+		free(pLine);
+		free(line8);
+	} else if (bits > 8) {
+		uint16_t *pLine = malloc(info->width * sizeof(uint16_t));
+		for(int row = 0; row < info->height; row++){
+			raw_unpack_row(info->layout, raw+(row*info->stride), pLine, info->width);
+			TIFFWriteScanline(tif, pLine, row, 0);
+		}
+		free(pLine);
+	} else {
+		for(int row = 0; row < info->height; row++){
+			TIFFWriteScanline(tif, (uint8_t *)raw+(row*info->stride), row, 0);
+		}
+	}
+	TIFFWriteDirectory(tif);
+
+	// Add an EXIF block to the tiff
+	TIFFCreateEXIFDirectory(tif);
+	// 1 = manual, 2 = full auto, 3 = aperture priority, 4 = shutter priority
+	TIFFSetField(tif, EXIFTAG_EXPOSUREPROGRAM, 2);
+	TIFFSetField(tif, EXIFTAG_DATETIMEORIGINAL, datetime);
+	TIFFSetField(tif, EXIFTAG_DATETIMEDIGITIZED, datetime);
+	if(info->fnumber) {
+		TIFFSetField(tif, EXIFTAG_FNUMBER, info->fnumber);
+	}
+	if(info->focallength) {
+		TIFFSetField(tif, EXIFTAG_FOCALLENGTH, info->focallength);
+	}
+	if(info->focallength && info->cropfactor) {
+		TIFFSetField(tif, EXIFTAG_FOCALLENGTHIN35MMFILM, (short)(info->focallength * info->cropfactor));
+	}
+	TIFFWriteCustomDirectory(tif, &exif_offset);
+	TIFFFreeDirectory(tif);
+
+	// Update exif pointer
+	TIFFSetDirectory(tif, 0);
+	TIFFSetField(tif, TIFFTAG_EXIFIFD, exif_offset);
+	TIFFRewriteDirectory(tif);
+}
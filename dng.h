@@ -0,0 +1,77 @@
+#ifndef DNG_H
+#define DNG_H
+
+#include <stdint.h>
+#include <time.h>
+#include <tiffio.h>
+#include "rawformat.h"
+#include "badpixels.h"
+#include "shading.h"
+
+#define TIFFTAG_FORWARDMATRIX1 50964
+#ifndef TIFFTAG_OPCODELIST1
+#define TIFFTAG_OPCODELIST1 51008
+#endif
+#ifndef TIFFTAG_OPCODELIST2
+#define TIFFTAG_OPCODELIST2 51009
+#endif
+
+// Everything that goes into a DNG besides the pixels
+struct dng_info {
+	int width;
+	int height;
+	int stride;
+	enum raw_layout layout;
+	// DNG CFAPattern, 0 = red, 1 = green, 2 = blue
+	const char *cfapattern;
+
+	const char *make;
+	const char *model;
+	const float *colormatrix;
+	// NULL when the camera has none
+	const float *forwardmatrix;
+	const float *neutral;
+	int blacklevel;
+	int whitelevel;
+
+	// Lens shading, either a gain for every pixel from shading_table() that
+	// is applied to the samples, or a grid that's stored as GainMap opcodes
+	// for the raw developer. Either or both may be NULL.
+	const uint16_t *shading_table;
+	const struct shading_grid *shading_grid;
+
+	// Defective pixels of a list the size of the frame, replaced in the
+	// samples or stored as a FixBadPixelsList opcode when badpixel_opcodes
+	// is set. May be NULL.
+	const struct badpixels *badpixels;
+	int badpixel_opcodes;
+
+	// Part of the frame to show, stored as DefaultCrop. The whole frame when
+	// crop_width is 0.
+	int crop_x;
+	int crop_y;
+	int crop_width;
+	int crop_height;
+
+	float focallength;
+	float cropfactor;
+	double fnumber;
+	time_t time;
+};
+
+// Registers the DNG tags libtiff doesn't know about, call once before
+// opening any file
+void dng_init();
+
+// Writes the raw frame with a thumbnail and EXIF block, the caller opens
+// and closes the file
+void dng_write(TIFF *tif, const uint8_t *raw, const struct dng_info *info);
+
+// Read back the opcode lists dng_write() makes, the GainMaps of OpcodeList2
+// as a shading grid and the FixBadPixelsList of OpcodeList1 as a list of
+// the frame size. NULL for lists with anything else in them.
+struct shading_grid *dng_read_gainmaps(const uint8_t *list, uint32_t size, const char *cfapattern,
+	int width, int height);
+struct badpixels *dng_read_badpixels(const uint8_t *list, uint32_t size, int width, int height);
+
+#endif
@@ -0,0 +1,132 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include "gallery.h"
+
+#define PAGE_SIZE 4096
+#define SLOT_SIZE (GALLERY_THUMB_SIZE * GALLERY_THUMB_SIZE * 4)
+
+static int gallery_fd = -1;
+static uint8_t *gallery_map = NULL;
+static size_t gallery_size;
+static struct gallery_header *header;
+static struct gallery_entry *entries;
+static uint8_t *atlas;
+
+static size_t
+page_align(size_t size)
+{
+	return (size + PAGE_SIZE - 1) / PAGE_SIZE * PAGE_SIZE;
+}
+
+int
+gallery_open(const char *path)
+{
+	struct gallery_header existing = {0};
+	struct stat st;
+	size_t index_size = page_align(GALLERY_CAPACITY * sizeof(struct gallery_entry));
+
+	gallery_size = PAGE_SIZE + index_size + (size_t)GALLERY_CAPACITY * SLOT_SIZE;
+	gallery_fd = open(path, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (gallery_fd < 0) {
+		return -1;
+	}
+
+	// Start over when the file is from an older version or damaged, it
+	// only holds thumbnails
+	int valid = fstat(gallery_fd, &st) == 0 && (size_t)st.st_size == gallery_size &&
+		pread(gallery_fd, &existing, sizeof(existing), 0) == sizeof(existing) &&
+		memcmp(existing.magic, GALLERY_MAGIC, 8) == 0 && existing.version == 1 &&
+		existing.thumb_size == GALLERY_THUMB_SIZE && existing.capacity == GALLERY_CAPACITY;
+	if (!valid && (ftruncate(gallery_fd, 0) < 0 || ftruncate(gallery_fd, gallery_size) < 0)) {
+		goto fail;
+	}
+
+	gallery_map = mmap(NULL, gallery_size, PROT_READ | PROT_WRITE, MAP_SHARED, gallery_fd, 0);
+	if (gallery_map == MAP_FAILED) {
+		gallery_map = NULL;
+		goto fail;
+	}
+	header = (struct gallery_header *)gallery_map;
+	entries = (struct gallery_entry *)(gallery_map + PAGE_SIZE);
+	atlas = gallery_map + PAGE_SIZE + index_size;
+
+	if (!valid) {
+		memcpy(header->magic, GALLERY_MAGIC, 8);
+		header->version = 1;
+		header->thumb_size = GALLERY_THUMB_SIZE;
+		header->capacity = GALLERY_CAPACITY;
+		header->count = 0;
+	}
+	return 0;
+
+fail:
+	close(gallery_fd);
+	gallery_fd = -1;
+	return -1;
+}
+
+// Adds an RGB thumbnail of at most GALLERY_THUMB_SIZE square
+void
+gallery_add(const char *path, int64_t time, const uint8_t *rgb, int width, int height, int stride)
+{
+	if (!gallery_map || width > GALLERY_THUMB_SIZE || height > GALLERY_THUMB_SIZE) {
+		return;
+	}
+
+	int slot = header->count % GALLERY_CAPACITY;
+	struct gallery_entry *entry = &entries[slot];
+	uint32_t *pixels = (uint32_t *)(atlas + (size_t)slot * SLOT_SIZE);
+
+	snprintf(entry->path, sizeof(entry->path), "%s", path);
+	entry->time = time;
+	entry->width = width;
+	entry->height = height;
+	for (int y = 0; y < height; y++) {
+		const uint8_t *src = rgb + y * stride;
+		uint32_t *dst = pixels + y * GALLERY_THUMB_SIZE;
+		for (int x = 0; x < width; x++) {
+			dst[x] = (src[0] << 16) | (src[1] << 8) | src[2];
+			src += 3;
+		}
+	}
+	// Only counted once it's complete
+	header->count++;
+}
+
+int
+gallery_count()
+{
+	if (!gallery_map) {
+		return 0;
+	}
+	return header->count < GALLERY_CAPACITY ? header->count : GALLERY_CAPACITY;
+}
+
+const struct gallery_entry *
+gallery_get(int index)
+{
+	return &entries[(header->count - 1 - index) % GALLERY_CAPACITY];
+}
+
+uint8_t *
+gallery_pixels(int index)
+{
+	return atlas + (size_t)((header->count - 1 - index) % GALLERY_CAPACITY) * SLOT_SIZE;
+}
+
+void
+gallery_close()
+{
+	if (gallery_map) {
+		munmap(gallery_map, gallery_size);
+		gallery_map = NULL;
+	}
+	if (gallery_fd >= 0) {
+		close(gallery_fd);
+		gallery_fd = -1;
+	}
+}
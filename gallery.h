@@ -0,0 +1,44 @@
+#ifndef GALLERY_H
+#define GALLERY_H
+
+#include <stdint.h>
+
+// Thumbnails of recent captures, kept in a single memory mapped file so the
+// gallery can show thousands of them without decoding any image:
+//
+//   header    struct gallery_header, padded to a page
+//   index     GALLERY_CAPACITY struct gallery_entry, padded to a page
+//   atlas     GALLERY_CAPACITY thumbnails of GALLERY_THUMB_SIZE square,
+//             cairo RGB24 pixels with a stride of GALLERY_THUMB_SIZE * 4
+//
+// The index and atlas are rings, the oldest capture is replaced once it's
+// full. The file is sparse so only the thumbnails taken use disk space.
+#define GALLERY_MAGIC "MPTHUMBS"
+#define GALLERY_THUMB_SIZE 96
+#define GALLERY_CAPACITY 4096
+
+struct gallery_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t thumb_size;
+	uint32_t capacity;
+	uint32_t reserved;
+	uint64_t count; // Thumbnails ever added
+};
+
+struct gallery_entry {
+	char path[256];
+	int64_t time;
+	uint32_t width;
+	uint32_t height;
+};
+
+int gallery_open(const char *path);
+void gallery_add(const char *path, int64_t time, const uint8_t *rgb, int width, int height, int stride);
+int gallery_count();
+// Index 0 is the newest capture
+const struct gallery_entry *gallery_get(int index);
+uint8_t *gallery_pixels(int index);
+void gallery_close();
+
+#endif
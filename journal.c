@@ -0,0 +1,192 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <dirent.h>
+#include <signal.h>
+#include <sys/mman.h>
+#include <sys/uio.h>
+#include "journal.h"
+
+// Disk space is reserved in steps this large, a few full resolution bursts
+#define PREALLOCATE_SIZE (256ULL * 1024 * 1024)
+
+static const uint8_t padding[JOURNAL_ALIGN];
+
+static uint64_t
+align_up(uint64_t value)
+{
+	return (value + JOURNAL_ALIGN - 1) / JOURNAL_ALIGN * JOURNAL_ALIGN;
+}
+
+static int
+writev_all(int fd, struct iovec *iov, int count, off_t offset)
+{
+	while (count > 0) {
+		ssize_t written = pwritev(fd, iov, count, offset);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		offset += written;
+		while (count > 0 && (size_t)written >= iov->iov_len) {
+			written -= iov->iov_len;
+			iov++;
+			count--;
+		}
+		if (count > 0) {
+			iov->iov_base = (uint8_t *)iov->iov_base + written;
+			iov->iov_len -= written;
+		}
+	}
+	return 0;
+}
+
+int
+journal_open(struct journal *journal, const char *path)
+{
+	uint8_t block[JOURNAL_ALIGN] = {0};
+	struct journal_header *header = (struct journal_header *)block;
+
+	memset(journal, 0, sizeof(*journal));
+	snprintf(journal->path, sizeof(journal->path), "%s", path);
+	journal->fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (journal->fd < 0) {
+		return -1;
+	}
+
+	memcpy(header->magic, JOURNAL_MAGIC, 8);
+	header->version = 2;
+	struct iovec iov = {block, sizeof(block)};
+	if (writev_all(journal->fd, &iov, 1, 0) < 0) {
+		close(journal->fd);
+		unlink(path);
+		return -1;
+	}
+	journal->end = JOURNAL_ALIGN;
+	journal->allocated = JOURNAL_ALIGN;
+	return 0;
+}
+
+// Writes the record and the pixels with one syscall straight from the
+// capture buffer, the offset of the record is returned in offset
+int
+journal_append(struct journal *journal, struct journal_frame *frame, const uint8_t *data, uint64_t *offset)
+{
+	uint8_t block[JOURNAL_ALIGN] = {0};
+	uint64_t length = JOURNAL_ALIGN + align_up(frame->size);
+
+	memcpy(frame->magic, JOURNAL_FRAME_MAGIC, 8);
+	memcpy(block, frame, sizeof(*frame));
+
+	if (journal->end + length > journal->allocated) {
+		uint64_t size = length > PREALLOCATE_SIZE ? align_up(length) : PREALLOCATE_SIZE;
+		// Not every filesystem supports this, the writes work either way
+		fallocate(journal->fd, FALLOC_FL_KEEP_SIZE, journal->allocated, size);
+		journal->allocated += size;
+	}
+
+	struct iovec iov[3] = {
+		{block, sizeof(block)},
+		{(void *)data, frame->size},
+		{(void *)padding, align_up(frame->size) - frame->size},
+	};
+	if (writev_all(journal->fd, iov, iov[2].iov_len ? 3 : 2, journal->end) < 0) {
+		return -1;
+	}
+	*offset = journal->end;
+	journal->end += length;
+	return 0;
+}
+
+// Pages can be larger than JOURNAL_ALIGN, 16K and 64K on some arm64 kernels
+static uint64_t
+page_start(uint64_t offset)
+{
+	uint64_t page = sysconf(_SC_PAGESIZE);
+	return offset / page * page;
+}
+
+// Maps a record and its pixels read-only, the pixels start JOURNAL_ALIGN
+// bytes after the returned record. next is set to the following record.
+const struct journal_frame *
+journal_map(struct journal *journal, uint64_t offset, uint64_t *next)
+{
+	struct journal_frame frame;
+
+	if (pread(journal->fd, &frame, sizeof(frame), offset) != sizeof(frame) ||
+		memcmp(frame.magic, JOURNAL_FRAME_MAGIC, 8) != 0) {
+		return NULL;
+	}
+
+	// The mapping starts at the page the record is in
+	uint64_t start = page_start(offset);
+	size_t length = offset - start + JOURNAL_ALIGN + frame.size;
+	uint8_t *map = mmap(NULL, length, PROT_READ, MAP_SHARED, journal->fd, start);
+	if (map == MAP_FAILED) {
+		return NULL;
+	}
+	// The pixels are read once from start to end
+	madvise(map, length, MADV_SEQUENTIAL);
+	if (next) {
+		*next = offset + JOURNAL_ALIGN + align_up(frame.size);
+	}
+	return (const struct journal_frame *)(map + (offset - start));
+}
+
+void
+journal_unmap(const struct journal_frame *frame)
+{
+	uint8_t *map = (uint8_t *)page_start((uintptr_t)frame);
+	munmap(map, (const uint8_t *)frame - map + JOURNAL_ALIGN + frame->size);
+}
+
+// Frees the disk space of records that are no longer needed, the file
+// keeps its size so later offsets stay valid
+void
+journal_release(struct journal *journal, uint64_t start, uint64_t end)
+{
+	fallocate(journal->fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE, start, end - start);
+}
+
+void
+journal_close(struct journal *journal)
+{
+	close(journal->fd);
+	unlink(journal->path);
+}
+
+void
+journal_remove_stale(const char *dir)
+{
+	char path[PATH_MAX];
+	struct dirent *entry;
+	int pid, length;
+
+	DIR *d = opendir(dir);
+	if (!d) {
+		return;
+	}
+	while ((entry = readdir(d))) {
+		length = 0;
+		if (sscanf(entry->d_name, "journal-%d.raw%n", &pid, &length) != 1 ||
+			length != strlen(entry->d_name)) {
+			continue;
+		}
+		// Still in use by another instance
+		if (pid == getpid() || kill(pid, 0) == 0 || errno != ESRCH) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "%s/%s", dir, entry->d_name);
+		if (unlink(path) == 0) {
+			printf("Removed the capture journal %s left by an earlier crash\n", path);
+		}
+	}
+	closedir(d);
+}
@@ -0,0 +1,68 @@
+#ifndef JOURNAL_H
+#define JOURNAL_H
+
+#include <stddef.h>
+#include <stdint.h>
+
+// Capture journal, one file per session that burst frames are appended to
+// as they arrive. All little endian:
+//
+//   header    struct journal_header, padded to JOURNAL_ALIGN
+//   records   struct journal_frame padded to JOURNAL_ALIGN, followed by size
+//             bytes of pixel data exactly as the sensor delivered them,
+//             padded to JOURNAL_ALIGN
+//
+// Records are never changed once written. The DNG files are made from it
+// later, after which the space of the burst is given back to the filesystem.
+// The file is journal-<pid>.raw, it's removed when the session ends.
+#define JOURNAL_MAGIC "MPJOURNL"
+#define JOURNAL_FRAME_MAGIC "MPJFRAME"
+#define JOURNAL_ALIGN 4096
+
+struct journal_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t reserved;
+};
+
+struct journal_frame {
+	char magic[8];
+	uint32_t burst;       // Burst number in this session
+	uint32_t index;       // Frame in the burst, starting at 1
+	uint32_t camera;      // Index in the config
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t pixelformat; // V4L2 fourcc
+	uint32_t layout;      // enum raw_layout
+	uint32_t cfa;         // enum bayer_order
+	int32_t exposure;     // Sensor exposure control, -1 when unknown
+	int32_t gain;         // Sensor gain control, -1 when unknown
+	uint32_t sequence;    // V4L2 frame sequence
+	uint64_t timestamp;   // CLOCK_MONOTONIC ns
+	int64_t time;         // Wall clock seconds for the EXIF dates
+	uint32_t crop_x;      // Part of the frame that was zoomed in on, the
+	uint32_t crop_y;      // whole frame when not zoomed
+	uint32_t crop_width;
+	uint32_t crop_height;
+	uint64_t size;        // Bytes of pixel data following the record
+};
+
+struct journal {
+	int fd;
+	char path[512];
+	uint64_t end;
+	uint64_t allocated;
+};
+
+int journal_open(struct journal *journal, const char *path);
+int journal_append(struct journal *journal, struct journal_frame *frame, const uint8_t *data, uint64_t *offset);
+const struct journal_frame *journal_map(struct journal *journal, uint64_t offset, uint64_t *next);
+void journal_unmap(const struct journal_frame *frame);
+void journal_release(struct journal *journal, uint64_t start, uint64_t end);
+void journal_close(struct journal *journal);
+// Removes the journals in dir of processes that are gone, their
+// preallocated space isn't part of the file size
+void journal_remove_stale(const char *dir);
+
+#endif
@@ -6,9 +6,11 @@
 #include <sys/ioctl.h>
 #include <sys/mman.h>
 #include <sys/stat.h>
+#include <sys/utsname.h>
 #include <time.h>
 #include <assert.h>
 #include <limits.h>
+#include <math.h>
 #include <linux/kdev_t.h>
 #include <sys/sysmacros.h>
 #include <asm/errno.h>
@@ -18,6 +20,16 @@
 #include "config.h"
 #include "ini.h"
 #include "quickdebayer.h"
+#include "bufferpool.h"
+#include "control.h"
+#include "analyzer.h"
+#include "rawvideo.h"
+#include "output.h"
+#include "journal.h"
+#include "gallery.h"
+#include "dng.h"
+#include "shading.h"
+#include "badpixels.h"
 
 enum io_method {
 	IO_METHOD_READ,
@@ -25,7 +37,16 @@ enum io_method {
 	IO_METHOD_USERPTR,
 };
 
-#define TIFFTAG_FORWARDMATRIX1 50964
+// Time budget from pressing the camera switch button to the first frame
+#define SWITCH_TARGET_MS 300
+
+// While nobody looks at the preview the sensor runs at this rate and the
+// frames aren't converted, after the timeout the stream is stopped. Cameras
+// that take longer than the target to start streaming again are only
+// slowed down from then on.
+#define POWER_IDLE_RATE 5
+#define POWER_SUSPEND_SECONDS 10
+#define RESUME_TARGET_MS 200
 
 #define ARRAY_SIZE(array) \
     (sizeof(array) / sizeof(*array))
@@ -35,37 +56,94 @@ struct buffer {
 	size_t length;
 };
 
-struct camerainfo {
-	char dev_name[260];
-	unsigned int entity_id;
-	char dev[260];
+struct camera_mode {
 	int width;
 	int height;
 	int rate;
-	int rotate;
 	int fmt;
 	int mbus;
+	enum bayer_order cfa;
+	enum raw_layout layout;
+};
+
+// Part of a frame in sensor pixels
+struct region {
+	int x;
+	int y;
+	int width;
+	int height;
+};
+
+struct camerainfo {
+	char dev_name[260];
+	unsigned int entity_id;
+	char dev[260];
+	struct camera_mode mode;
+	struct camera_mode capture_mode;
+	struct camera_mode preview_mode;
+	int rotate;
+	int stride;
 	int fd;
+	// Mode the sensor subdev was last configured for, the subdev keeps
+	// its format while another camera is streaming
+	struct camera_mode sensor_mode;
+
+	enum io_method io;
+	int buffers;
+	int hugepages;
 
 	float colormatrix[9];
 	float forwardmatrix[9];
 	int blacklevel;
 	int whitelevel;
 
+	// Lens shading grid, with the gains for the capture mode when they're
+	// applied to the pixels instead of stored as DNG opcodes
+	struct shading_grid *shading;
+	int shading_opcodes;
+	uint16_t *shading_table;
+
+	// Defects in the capture mode, fixed in the samples or stored as a DNG
+	// opcode
+	struct badpixels *badpixels;
+	int badpixel_opcodes;
+
 	float focallength;
 	float cropfactor;
 	double fnumber;
 	char valid;
 };
 
-static float colormatrix_srgb[] = {
-	3.2409, -1.5373, -0.4986,
-	-0.9692, 1.8759, 0.0415,
-	0.0556, -0.2039, 1.0569
+static const float neutral[] = {1.0, 1.0, 1.0};
+
+#define BAYER_FORMATS(order, cfa, cfapattern) \
+	{#order "8", V4L2_PIX_FMT_S##order##8, MEDIA_BUS_FMT_S##order##8_1X8, cfa, RAW_8, cfapattern}, \
+	{#order "10", V4L2_PIX_FMT_S##order##10, MEDIA_BUS_FMT_S##order##10_1X10, cfa, RAW_10, cfapattern}, \
+	{#order "10P", V4L2_PIX_FMT_S##order##10P, MEDIA_BUS_FMT_S##order##10_1X10, cfa, RAW_10P, cfapattern}, \
+	{#order "12", V4L2_PIX_FMT_S##order##12, MEDIA_BUS_FMT_S##order##12_1X12, cfa, RAW_12, cfapattern}, \
+	{#order "12P", V4L2_PIX_FMT_S##order##12P, MEDIA_BUS_FMT_S##order##12_1X12, cfa, RAW_12P, cfapattern}
+
+static const struct {
+	const char *name;
+	int fmt;
+	int mbus;
+	enum bayer_order cfa;
+	enum raw_layout layout;
+	// DNG CFAPattern, 0 = red, 1 = green, 2 = blue
+	const char *cfapattern;
+} formats[] = {
+	BAYER_FORMATS(BGGR, BAYER_BGGR, "\002\001\001\000"),
+	BAYER_FORMATS(GBRG, BAYER_GBRG, "\001\002\000\001"),
+	BAYER_FORMATS(GRBG, BAYER_GRBG, "\001\000\002\001"),
+	BAYER_FORMATS(RGGB, BAYER_RGGB, "\000\001\001\002"),
 };
 
 struct buffer *buffers;
 static unsigned int n_buffers;
+static struct buffer_pool pool;
+// Mode the video node buffers were allocated for
+static struct camera_mode device_mode;
+static int device_checked = 0;
 
 struct camerainfo cameras[4]; /* 4 is a sane default for now, raise as needed */
 struct camerainfo current;
@@ -90,8 +168,157 @@ static char *last_path = NULL;
 static int auto_exposure = 1;
 static int auto_gain = 1;
 static int burst_length = 5;
-static char burst_dir[20];
+static int burst_frames = 5;
+static uint64_t burst_first_frame;
+static struct region burst_crop;
+static unsigned long frame_count = 0;
+static int burst_count = 0;
+// Of the burst being taken, bursts can still be written after the next one
+// started
+static int burst_id = 0;
+// Of the frame being processed, CLOCK_MONOTONIC ns and the V4L2 sequence
+static uint64_t frame_timestamp;
+static uint32_t frame_sequence;
+
+// Digital zoom, only the part of the frame that's shown is converted for the
+// preview and the DNGs store it as their default crop
+#define ZOOM_MAX 4.0
+static double zoom = 1.0;
+static double zoom_gesture_start;
+static GtkGesture *zoom_gesture;
+
+// How much the preview costs, see update_power()
+enum power_state {
+	POWER_ACTIVE,    // full rate, every frame converted
+	POWER_THROTTLED, // idle rate, frames only used for bursts and recordings
+	POWER_SUSPENDED, // not streaming
+};
+static enum power_state power_state = POWER_ACTIVE;
+static const char *power_state_names[] = {"active", "throttled", "suspended"};
+// Only every rate_skip-th frame is used while throttled, for sensors that
+// couldn't be slowed down
+static int rate_skip = 1;
+static int window_active = 1;
+static int window_iconified = 0;
+static int main_page_shown = 1;
+static guint suspend_timer = 0;
+static guint frame_source = 0;
+static struct timespec resume_start;
+static int resume_pending = 0;
+static double resume_ms = 0;
+static int suspend_allowed = 1;
+
+// Low light preview, the preview is averaged over the last frames and
+// brightened by LOWLIGHT_GAIN. Pictures and the proxy JPEG aren't affected.
+#define LOWLIGHT_GAIN 4
+static int low_light = 0;
+static struct preview_color lowlight_color;
+static struct preview_accumulator *lowlight_accumulator;
+
+// Frames kept in memory for the recording writer thread
+#define RECORD_BUFFERS 8
+static struct raw_video recorder;
+static int recording = 0;
+static struct preview_color preview_color;
+static const struct debayer_kernels *debayer;
+static char burst_dir[512];
 static char processing_script[512];
+static int active_camera = -1;
+static struct timespec switch_start;
+static int switch_pending = 0;
+
+// Startup timing in ms since main() started, reported on the first frame
+static struct timespec startup_start;
+static double startup_config_ms;
+static double startup_hardware_ms;
+static double startup_ui_ms;
+static double startup_ready_ms;
+static int startup_reported = 0;
+
+// Headless mode, bursts are taken on a timer without any UI
+static int headless = 0;
+static int headless_bursts = 1;
+static int headless_interval = 0;
+static const char *headless_output = ".";
+static int headless_synthetic = 0;
+static int headless_started = 0;
+static int headless_done = 0;
+static int headless_frames = 0;
+static double headless_total_ms = 0;
+static double headless_max_ms = 0;
+static GMainLoop *main_loop;
+static uint8_t *synthetic_frame;
+static int synthetic_rate = 0;
+static int headless_record = 0;
+static char headless_record_path[512];
+// Set when the headless recording dropped frames or wrote a broken file
+static int headless_failed = 0;
+static guint synthetic_source = 0;
+// Time-lapse, a burst every timelapse_interval ms on a fixed schedule. The
+// stream is stopped between shots and started again early enough for the
+// first frame to be there on time, the sensor and buffers stay configured.
+#define TIMELAPSE_MARGIN_MS 50
+#define TIMELAPSE_MIN_IDLE_MS 200
+static int timelapse_interval = 0;
+static uint64_t timelapse_next;
+static guint timelapse_timer = 0;
+static int timelapse_waiting = 0;
+static int timelapse_resumed = 0;
+// Set while a frame is processed and acted on by timelapse_poll() once its
+// buffer is back in the queue, the stream can't be stopped or switched
+// while the frame is held
+static int timelapse_due = 0;
+static int timelapse_done = 0;
+// The burst was started, its first frame measures the drift
+static int timelapse_shooting = 0;
+static double timelapse_lead_ms = 0;
+static int timelapse_shots = 0;
+static int timelapse_missed = 0;
+static double timelapse_drift_total = 0;
+static double timelapse_drift_max = 0;
+static int timelapse_resumes = 0;
+static double timelapse_startup_total = 0;
+static double timelapse_startup_max = 0;
+static uint64_t timelapse_start;
+static uint64_t timelapse_stream_start;
+static uint64_t timelapse_streaming_ns = 0;
+// Headless burst measured for a lens shading calibration instead of saved
+static const char *calibrate_shading = NULL;
+static struct shading_grid *shading_calibration;
+// Headless burst of dark frames searched for defective pixels
+static const char *calibrate_badpixels = NULL;
+static struct badpixels_calibration *badpixel_calibration;
+
+// How captured DNGs are written, see output.h
+static enum output_backend output_writer = OUTPUT_IO_URING;
+static int output_direct_io = 0;
+
+// Burst frames are appended to the capture journal while the burst runs and
+// a separate thread makes the DNG files from it, so the next shot doesn't
+// wait for them
+struct dng_job {
+	char dir[512];
+	char target[255];
+	uint64_t start;
+	uint64_t end;
+	uint64_t first_frame;
+	struct region crop;
+	int id;
+	int complete;
+};
+
+static int use_journal = 1;
+static int journal_opened = 0;
+static struct journal journal;
+static uint64_t burst_journal_start;
+static int burst_journal_frames = 0;
+static GAsyncQueue *dng_queue;
+static GAsyncQueue *dng_done;
+static GThread *dng_thread;
+static struct dng_job dng_stop;
+
+// Width of the preview shared over the control socket without a window
+#define HEADLESS_PREVIEW_WIDTH 640
 
 // Widgets
 GtkWidget *preview;
@@ -99,6 +326,32 @@ GtkWidget *error_box;
 GtkWidget *error_message;
 GtkWidget *main_stack;
 GtkWidget *thumb_last;
+GtkWidget *gallery_view;
+GtkWidget *gallery_scroll;
+GtkWidget *zoom_button;
+GtkWidget *low_light_button;
+
+static double
+ms_between(const struct timespec *start, const struct timespec *end)
+{
+	return (end->tv_sec - start->tv_sec) * 1000.0 +
+		(end->tv_nsec - start->tv_nsec) / 1000000.0;
+}
+
+static double
+ms_since(const struct timespec *start)
+{
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	return ms_between(start, &now);
+}
+
+static int modes_equal(const struct camera_mode *a, const struct camera_mode *b);
+static void switch_mode(const struct camera_mode *mode);
+static void update_power();
+static void suspend_stream();
+static int resume_stream();
+static gboolean get_synthetic_frame();
 
 static int
 xioctl(int fd, int request, void *arg)
@@ -120,6 +373,10 @@ errno_exit(const char *s)
 static void
 show_error(const char *s)
 {
+	if (headless) {
+		g_printerr("%s\n", s);
+		return;
+	}
 	gtk_label_set_text(GTK_LABEL(error_message), s);
 	gtk_widget_show(error_box);
 }
@@ -136,6 +393,12 @@ start_capturing(int fd)
 			.index = i,
 		};
 
+		if (current.io == IO_METHOD_USERPTR) {
+			buf.memory = V4L2_MEMORY_USERPTR;
+			buf.m.userptr = (unsigned long)buffers[i].start;
+			buf.length = buffers[i].length;
+		}
+
 		if (xioctl(fd, VIDIOC_QBUF, &buf) == -1) {
 			errno_exit("VIDIOC_QBUF");
 		}
@@ -152,7 +415,6 @@ start_capturing(int fd)
 static void
 stop_capturing(int fd)
 {
-	int i;
 	ready = 0;
 	printf("Stopping capture\n");
 
@@ -160,18 +422,42 @@ stop_capturing(int fd)
 	if (xioctl(fd, VIDIOC_STREAMOFF, &type) == -1) {
 		errno_exit("VIDIOC_STREAMOFF");
 	}
+}
+
+// Only needed when the format changes, a stopped stream can be started
+// again with the same buffers
+static void
+release_buffers(int fd)
+{
+	int i;
 
-	for (i = 0; i < n_buffers; ++i) {
-		munmap(buffers[i].start, buffers[i].length);
+	if (current.io == IO_METHOD_USERPTR) {
+		// The pool itself is kept for the next format if it's big enough
+		for (i = 0; i < n_buffers; ++i) {
+			buffer_pool_release(&pool, buffers[i].start);
+		}
+	} else {
+		for (i = 0; i < n_buffers; ++i) {
+			munmap(buffers[i].start, buffers[i].length);
+		}
 	}
+	memset(&device_mode, 0, sizeof(device_mode));
+	free(buffers);
+	buffers = NULL;
 
+	// Release the buffers in the driver as well, the format can't be
+	// changed while they exist
+	struct v4l2_requestbuffers req = {0};
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = current.io == IO_METHOD_USERPTR ? V4L2_MEMORY_USERPTR : V4L2_MEMORY_MMAP;
+	xioctl(fd, VIDIOC_REQBUFS, &req);
 }
 
 static void
 init_mmap(int fd)
 {
 	struct v4l2_requestbuffers req = {0};
-	req.count = 4;
+	req.count = current.buffers;
 	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
 	req.memory = V4L2_MEMORY_MMAP;
 
@@ -222,6 +508,48 @@ init_mmap(int fd)
 	}
 }
 
+static void
+init_userptr(int fd, unsigned int buffer_size)
+{
+	struct v4l2_requestbuffers req = {0};
+	req.count = current.buffers;
+	req.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	req.memory = V4L2_MEMORY_USERPTR;
+
+	if (xioctl(fd, VIDIOC_REQBUFS, &req) == -1) {
+		if (errno == EINVAL) {
+			fprintf(stderr, "%s does not support user pointer i/o\n",
+				dev_name);
+			exit(EXIT_FAILURE);
+		} else {
+			errno_exit("VIDIOC_REQBUFS");
+		}
+	}
+
+	// The extra buffers are spares that replace burst frames taken out of
+	// the queue, so those never have to be copied out of driver memory
+	int count = req.count + burst_length;
+	if (pool.free && (pool.size < buffer_size || pool.count != count)) {
+		buffer_pool_destroy(&pool);
+	}
+	if (!pool.free && buffer_pool_init(&pool, count, buffer_size, current.hugepages) == -1) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	buffers = calloc(req.count, sizeof(buffers[0]));
+
+	if (!buffers) {
+		fprintf(stderr, "Out of memory\n");
+		exit(EXIT_FAILURE);
+	}
+
+	for (n_buffers = 0; n_buffers < req.count; ++n_buffers) {
+		buffers[n_buffers].length = buffer_size;
+		buffers[n_buffers].start = buffer_pool_take(&pool);
+	}
+}
+
 static int
 v4l2_ctrl_set(int fd, uint32_t id, int val)
 {
@@ -236,13 +564,10 @@ v4l2_ctrl_set(int fd, uint32_t id, int val)
 	return 0;
 }
 
-static void
-init_sensor(char *fn, int width, int height, int mbus, int rate)
+static int
+set_frame_interval(int fd, int rate)
 {
-	int fd;
-	struct v4l2_subdev_frame_interval interval;
-	struct v4l2_subdev_format fmt;
-	fd = open(fn, O_RDWR);
+	struct v4l2_subdev_frame_interval interval = {0};
 
 	g_printerr("Setting sensor rate to %d\n", rate);
 	interval.pad = 0;
@@ -250,11 +575,22 @@ init_sensor(char *fn, int width, int height, int mbus, int rate)
 	interval.interval.denominator = rate;
 
 	if (xioctl(fd, VIDIOC_SUBDEV_S_FRAME_INTERVAL, &interval) == -1) {
-		errno_exit("VIDIOC_SUBDEV_S_FRAME_INTERVAL");
+		return -1;
 	}
 
 	g_printerr("Driver returned %d/%d frameinterval\n",
 		interval.interval.numerator, interval.interval.denominator);
+	return 0;
+}
+
+static void
+init_sensor(int fd, int width, int height, int mbus, int rate)
+{
+	struct v4l2_subdev_format fmt;
+
+	if (set_frame_interval(fd, rate) < 0) {
+		errno_exit("VIDIOC_SUBDEV_S_FRAME_INTERVAL");
+	}
 
 	g_printerr("Setting sensor to %dx%d fmt %d\n",
 		width, height, mbus);
@@ -285,12 +621,10 @@ init_sensor(char *fn, int width, int height, int mbus, int rate)
 		v4l2_ctrl_set(fd, V4L2_CID_AUTOGAIN, 0);
 		v4l2_ctrl_set(fd, V4L2_CID_GAIN, 0);
 	}
-	close(current.fd);
-	current.fd = fd;
 }
 
-static int
-init_device(int fd)
+static void
+check_device(int fd)
 {
 	struct v4l2_capability cap;
 	if (xioctl(fd, VIDIOC_QUERYCAP, &cap) == -1) {
@@ -338,22 +672,32 @@ init_device(int fd)
 	} else {
 		/* Errors ignored. */
 	}
+}
+
+static int
+init_device(int fd)
+{
+	// The video node stays open when switching cameras, so the capability
+	// checks and crop reset only have to be done once
+	if (!device_checked) {
+		check_device(fd);
+		device_checked = 1;
+	}
 
 
 	struct v4l2_format fmt = {
 		.type = V4L2_BUF_TYPE_VIDEO_CAPTURE,
 	};
-	if (current.width > 0) {
+	if (current.mode.width > 0) {
 		g_printerr("Setting camera to %dx%d fmt %d\n",
-			current.width, current.height, current.fmt);
-		fmt.fmt.pix.width = current.width;
-		fmt.fmt.pix.height = current.height;
-		fmt.fmt.pix.pixelformat = current.fmt;
+			current.mode.width, current.mode.height, current.mode.fmt);
+		fmt.fmt.pix.width = current.mode.width;
+		fmt.fmt.pix.height = current.mode.height;
+		fmt.fmt.pix.pixelformat = current.mode.fmt;
 		fmt.fmt.pix.field = V4L2_FIELD_ANY;
 
 		if (xioctl(fd, VIDIOC_S_FMT, &fmt) == -1) {
 			g_printerr("VIDIOC_S_FMT failed");
-			show_error("Could not set camera mode");
 			return -1;
 		}
 		
@@ -372,13 +716,13 @@ init_device(int fd)
 		g_printerr("Driver returned %dx%d fmt %d\n",
 			fmt.fmt.pix.width, fmt.fmt.pix.height,
 			fmt.fmt.pix.pixelformat);
-		current.width = fmt.fmt.pix.width;
-		current.height = fmt.fmt.pix.height;
+		current.mode.width = fmt.fmt.pix.width;
+		current.mode.height = fmt.fmt.pix.height;
 	}
-	current.fmt = fmt.fmt.pix.pixelformat;
+	current.mode.fmt = fmt.fmt.pix.pixelformat;
 
 	/* Buggy driver paranoia. */
-	unsigned int min = fmt.fmt.pix.width * 2;
+	unsigned int min = raw_bytes_per_line(current.mode.layout, fmt.fmt.pix.width);
 	if (fmt.fmt.pix.bytesperline < min) {
 		fmt.fmt.pix.bytesperline = min;
 	}
@@ -386,280 +730,1019 @@ init_device(int fd)
 	if (fmt.fmt.pix.sizeimage < min) {
 		fmt.fmt.pix.sizeimage = min;
 	}
+	current.stride = fmt.fmt.pix.bytesperline;
 
-	init_mmap(fd);
+	if (current.io == IO_METHOD_USERPTR) {
+		init_userptr(fd, fmt.fmt.pix.sizeimage);
+	} else {
+		init_mmap(fd);
+	}
+	device_mode = current.mode;
 	return 0;
 }
 
-static void
-register_custom_tiff_tags(TIFF *tif)
+static const char *
+cfa_pattern(enum bayer_order cfa)
 {
-	static const TIFFFieldInfo custom_fields[] = {
-		{TIFFTAG_FORWARDMATRIX1, -1, -1, TIFF_SRATIONAL, FIELD_CUSTOM, 1, 1, "ForwardMatrix1"},
-	};
-	
-	// Add missing dng fields
-	TIFFMergeFieldInfo(tif, custom_fields, sizeof(custom_fields) / sizeof(custom_fields[0]));
+	for (int i = 0; i < ARRAY_SIZE(formats); i++) {
+		if (formats[i].cfa == cfa) {
+			return formats[i].cfapattern;
+		}
+	}
+	return formats[0].cfapattern;
 }
 
-static void
-process_image(const int *p, int size)
+static GdkPixbuf *
+rotate_pixbuf(GdkPixbuf *pixbuf)
 {
-	time_t rawtime;
-	char datetime[20] = {0};
-	struct tm tim;
-	uint8_t *pixels;
-	char fname[255];
-	char fname_target[255];
-	char command[1024];
-	char timestamp[30];
-	char uniquecameramodel[255];
-	GdkPixbuf *pixbuf;
 	GdkPixbuf *pixbufrot;
-	GdkPixbuf *thumb;
-	GError *error = NULL;
-	double scale;
-	cairo_t *cr;
-	TIFF *tif;
-	int skip = 2;
-	long sub_offset = 0;
-	uint64 exif_offset = 0;
-	static const short cfapatterndim[] = {2, 2};
-	static const float neutral[] = {1.0, 1.0, 1.0};
 
-	// Only process preview frames when not capturing
-	if (capture == 0) {
-		if(current.width > 1280) {
-			skip = 3;
-		}
-		pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, current.width / (skip*2), current.height / (skip*2));
-		pixels = gdk_pixbuf_get_pixels(pixbuf);
-		quick_debayer_bggr8((const uint8_t *)p, pixels, current.width, current.height, skip);
+	if (current.rotate == 90) {
+		pixbufrot = gdk_pixbuf_rotate_simple(pixbuf, GDK_PIXBUF_ROTATE_COUNTERCLOCKWISE);
+	} else if (current.rotate == 180) {
+		pixbufrot = gdk_pixbuf_rotate_simple(pixbuf, GDK_PIXBUF_ROTATE_UPSIDEDOWN);
+	} else if (current.rotate == 270) {
+		pixbufrot = gdk_pixbuf_rotate_simple(pixbuf, GDK_PIXBUF_ROTATE_CLOCKWISE);
+	} else {
+		return pixbuf;
+	}
+	g_object_unref(pixbuf);
+	return pixbufrot;
+}
 
-		if (current.rotate == 0) {
-			pixbufrot = pixbuf;
-		} else if (current.rotate == 90) {
-			pixbufrot = gdk_pixbuf_rotate_simple(pixbuf, GDK_PIXBUF_ROTATE_COUNTERCLOCKWISE);
-		} else if (current.rotate == 180) {
-			pixbufrot = gdk_pixbuf_rotate_simple(pixbuf, GDK_PIXBUF_ROTATE_UPSIDEDOWN);
-		} else if (current.rotate == 270) {
-			pixbufrot = gdk_pixbuf_rotate_simple(pixbuf, GDK_PIXBUF_ROTATE_CLOCKWISE);
-		}
+// The centered part of a frame the zoom shows. It starts on a bayer quad and
+// on a whole group of packed samples, so it can be read in place.
+static void
+zoom_region(const struct camera_mode *mode, struct region *region)
+{
+	region->width = MAX(4, (int) (mode->width / zoom)) & ~3;
+	region->height = MAX(2, (int) (mode->height / zoom)) & ~1;
+	region->x = (mode->width - region->width) / 2 & ~3;
+	region->y = (mode->height - region->height) / 2 & ~1;
+}
 
-		scale = (double) preview_width / gdk_pixbuf_get_width(pixbufrot);
-		cr = cairo_create(surface);
-		cairo_set_source_rgb(cr, 0, 0, 0);
-		cairo_paint(cr);
-		cairo_scale(cr, scale, scale);
-		gdk_cairo_set_source_pixbuf(cr, pixbufrot, 0, 0);
-		cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_NONE);
-		cairo_paint(cr);
-		gtk_widget_queue_draw_area(preview, 0, 0, preview_width, preview_height);
+// Maps the analyzer luma plane, half the sensor resolution in sensor
+// orientation, onto the rotated and zoomed preview image of image_width x
+// image_height
+static void
+overlay_transform(cairo_t *cr, int image_width, int image_height)
+{
+	struct region roi;
+	zoom_region(&current.mode, &roi);
+	double luma_width = roi.width / 2;
+	double luma_height = roi.height / 2;
+
+	if (current.rotate == 90) {
+		cairo_translate(cr, 0, image_height);
+		cairo_rotate(cr, -G_PI / 2);
+		cairo_scale(cr, image_height / luma_width, image_width / luma_height);
+	} else if (current.rotate == 180) {
+		cairo_translate(cr, image_width, image_height);
+		cairo_rotate(cr, G_PI);
+		cairo_scale(cr, image_width / luma_width, image_height / luma_height);
+	} else if (current.rotate == 270) {
+		cairo_translate(cr, image_width, 0);
+		cairo_rotate(cr, G_PI / 2);
+		cairo_scale(cr, image_height / luma_width, image_width / luma_height);
 	} else {
-		capture--;
-		time(&rawtime);
-		tim = *(localtime(&rawtime));
-		strftime(timestamp, 30, "%Y%m%d%H%M%S", &tim);
-		strftime(datetime, 20, "%Y:%m:%d %H:%M:%S", &tim);
+		cairo_scale(cr, image_width / luma_width, image_height / luma_height);
+	}
+	cairo_translate(cr, -roi.x / 2.0, -roi.y / 2.0);
+}
 
-		sprintf(fname_target, "%s/Pictures/IMG%s", getenv("HOME"), timestamp);
-		sprintf(fname, "%s/%d.dng", burst_dir, burst_length - capture);
-
-		if(!(tif = TIFFOpen(fname, "w"))) {
-			printf("Could not open tiff\n");
-		}
-
-		// Define TIFF thumbnail
-		TIFFSetField(tif, TIFFTAG_SUBFILETYPE, 1);
-		TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, current.width >> 4);
-		TIFFSetField(tif, TIFFTAG_IMAGELENGTH, current.height >> 4);
-		TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
-		TIFFSetField(tif, TIFFTAG_COMPRESSION, COMPRESSION_NONE);
-		TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_RGB);
-		TIFFSetField(tif, TIFFTAG_MAKE, exif_make);
-		TIFFSetField(tif, TIFFTAG_MODEL, exif_model);
-		TIFFSetField(tif, TIFFTAG_ORIENTATION, ORIENTATION_TOPLEFT);
-		TIFFSetField(tif, TIFFTAG_DATETIME, datetime);
-		TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 3);
-		TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-		TIFFSetField(tif, TIFFTAG_SOFTWARE, "Megapixels");
-		TIFFSetField(tif, TIFFTAG_SUBIFD, 1, &sub_offset);
-		TIFFSetField(tif, TIFFTAG_DNGVERSION, "\001\001\0\0");
-		TIFFSetField(tif, TIFFTAG_DNGBACKWARDVERSION, "\001\0\0\0");
-		sprintf(uniquecameramodel, "%s %s", exif_make, exif_model);
-		TIFFSetField(tif, TIFFTAG_UNIQUECAMERAMODEL, uniquecameramodel);
-		if(current.colormatrix[0]) {
-			TIFFSetField(tif, TIFFTAG_COLORMATRIX1, 9, current.colormatrix);
-		} else {
-			TIFFSetField(tif, TIFFTAG_COLORMATRIX1, 9, colormatrix_srgb);
-		}
-		if(current.forwardmatrix[0]) {
-			TIFFSetField(tif, TIFFTAG_FORWARDMATRIX1, 9, current.forwardmatrix);
-		}
-		TIFFSetField(tif, TIFFTAG_ASSHOTNEUTRAL, 3, neutral);
-		TIFFSetField(tif, TIFFTAG_CALIBRATIONILLUMINANT1, 21);
-		// Write black thumbnail, only windows uses this
-		{
-			unsigned char *buf = (unsigned char *)calloc(1, (int)current.width >> 4);
-			for (int row = 0; row < current.height>>4; row++) {
-				TIFFWriteScanline(tif, buf, row, 0);
-			}
-			free(buf);
-		}
-		TIFFWriteDirectory(tif);
+// Lens shading for the preview of roi at the size it's debayered to, the
+// gains are rebuilt when the camera, the zoom or the size changes
+static void
+update_preview_shading(int width, int height, const struct region *roi)
+{
+	static uint16_t *table = NULL;
+	static const struct shading_grid *table_grid = NULL;
+	static int table_width, table_height;
+	static struct region table_roi;
+
+	if (!current.shading) {
+		preview_color.shading = NULL;
+		return;
+	}
+	if (table_grid != current.shading || table_width != width || table_height != height ||
+			memcmp(&table_roi, roi, sizeof(struct region)) != 0) {
+		float frame_width = current.mode.width, frame_height = current.mode.height;
+		free(table);
+		table = shading_preview_table(current.shading, width, height,
+			roi->x / frame_width, roi->y / frame_height,
+			(roi->x + roi->width) / frame_width, (roi->y + roi->height) / frame_height);
+		table_grid = current.shading;
+		table_width = width;
+		table_height = height;
+		table_roi = *roi;
+	}
+	preview_color.shading = table;
+	preview_color.shading_width = width;
+	preview_color.shading_height = height;
+}
+
+// The low light average only holds for one camera, zoom and size, it starts
+// over when any of them changes
+static void
+update_preview_accumulator(int width, int height, const struct region *roi)
+{
+	static struct region accumulator_roi;
+	static int accumulator_camera = -1;
+
+	if (!lowlight_accumulator || lowlight_accumulator->width != width ||
+			lowlight_accumulator->height != height || accumulator_camera != active_camera ||
+			memcmp(&accumulator_roi, roi, sizeof(struct region)) != 0) {
+		preview_accumulator_free(lowlight_accumulator);
+		lowlight_accumulator = preview_accumulator_new(width, height);
+		accumulator_camera = active_camera;
+		accumulator_roi = *roi;
+	}
+	lowlight_color.shading = preview_color.shading;
+	lowlight_color.shading_width = preview_color.shading_width;
+	lowlight_color.shading_height = preview_color.shading_height;
+	lowlight_color.accumulator = lowlight_accumulator;
+}
+
+// Debayer the zoomed part of a frame straight to the size it will be shown at
+// after rotation, so cairo doesn't have to resample it again. Nothing outside
+// of it is read. Live preview frames go through the low light average when
+// it's on. Falls back to the skipping debayer when the preview size isn't
+// known yet.
+static GdkPixbuf *
+debayer_to_width(const uint8_t *raw, int display_width, int live)
+{
+	GdkPixbuf *pixbuf;
+	const struct preview_color *color = &preview_color;
+	struct region roi;
+	int width, height;
+	int skip = 2;
+	double scale;
 
+	zoom_region(&current.mode, &roi);
+	raw += (size_t) roi.y * current.stride + raw_bytes_per_line(current.mode.layout, roi.x);
+	int quads_x = roi.width / 2;
+	int quads_y = roi.height / 2;
 
-		// Define main photo
-		TIFFSetField(tif, TIFFTAG_SUBFILETYPE, 0);
-		TIFFSetField(tif, TIFFTAG_IMAGEWIDTH, current.width);
-		TIFFSetField(tif, TIFFTAG_IMAGELENGTH, current.height);
-		TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, 8);
-		TIFFSetField(tif, TIFFTAG_PHOTOMETRIC, PHOTOMETRIC_CFA);
-		TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, 1);
-		TIFFSetField(tif, TIFFTAG_PLANARCONFIG, PLANARCONFIG_CONTIG);
-		TIFFSetField(tif, TIFFTAG_CFAREPEATPATTERNDIM, cfapatterndim);
-		TIFFSetField(tif, TIFFTAG_CFAPATTERN, "\002\001\001\000"); // BGGR
-		if(current.whitelevel) {
-			TIFFSetField(tif, TIFFTAG_WHITELEVEL, 1, &current.whitelevel);
+	if (display_width > 0) {
+		if (current.rotate == 90 || current.rotate == 270) {
+			scale = (double) display_width / quads_y;
+		} else {
+			scale = (double) display_width / quads_x;
 		}
-		if(current.blacklevel) {
-			TIFFSetField(tif, TIFFTAG_BLACKLEVEL, 1, &current.blacklevel);
+		width = MIN(quads_x, MAX(1, (int) (quads_x * scale)));
+		height = MIN(quads_y, MAX(1, (int) (quads_y * scale)));
+		update_preview_shading(width, height, &roi);
+		if (live && low_light) {
+			update_preview_accumulator(width, height, &roi);
+			color = &lowlight_color;
 		}
-		TIFFCheckpointDirectory(tif);
-		printf("Writing frame to %s\n", fname);
-		
-		unsigned char *pLine = (unsigned char*)malloc(current.width);
-		for(int row = 0; row < current.height; row++){
-			TIFFWriteScanline(tif, ((uint8_t *)p)+(row*current.width), row, 0);
-		}
-		free(pLine);
-		TIFFWriteDirectory(tif);
-
-		// Add an EXIF block to the tiff
-		TIFFCreateEXIFDirectory(tif);
-		// 1 = manual, 2 = full auto, 3 = aperture priority, 4 = shutter priority
-		TIFFSetField(tif, EXIFTAG_EXPOSUREPROGRAM, 2);
-		TIFFSetField(tif, EXIFTAG_DATETIMEORIGINAL, datetime);
-		TIFFSetField(tif, EXIFTAG_DATETIMEDIGITIZED, datetime);
-		if(current.fnumber) {
-			TIFFSetField(tif, EXIFTAG_FNUMBER, current.fnumber);
-		}
-		if(current.focallength) {
-			TIFFSetField(tif, EXIFTAG_FOCALLENGTH, current.focallength);
-		}
-		if(current.focallength && current.cropfactor) {
-			TIFFSetField(tif, EXIFTAG_FOCALLENGTHIN35MMFILM, (short)(current.focallength * current.cropfactor));
-		}
-		TIFFWriteCustomDirectory(tif, &exif_offset);
-		TIFFFreeDirectory(tif);
-
-		// Update exif pointer
-		TIFFSetDirectory(tif, 0);
-		TIFFSetField(tif, TIFFTAG_EXIFIFD, exif_offset);
-		TIFFRewriteDirectory(tif);
-
-		TIFFClose(tif);
-
-
-		if (capture == 0) {
-			// Update the thumbnail if this is the last frame
-			pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, current.width / (skip*2), current.height / (skip*2));
-			pixels = gdk_pixbuf_get_pixels(pixbuf);
-			quick_debayer_bggr8((const uint8_t *)p, pixels, current.width, current.height, skip);
-
-			if (current.rotate == 0) {
-				pixbufrot = pixbuf;
-			} else if (current.rotate == 90) {
-				pixbufrot = gdk_pixbuf_rotate_simple(pixbuf, GDK_PIXBUF_ROTATE_COUNTERCLOCKWISE);
-			} else if (current.rotate == 180) {
-				pixbufrot = gdk_pixbuf_rotate_simple(pixbuf, GDK_PIXBUF_ROTATE_UPSIDEDOWN);
-			} else if (current.rotate == 270) {
-				pixbufrot = gdk_pixbuf_rotate_simple(pixbuf, GDK_PIXBUF_ROTATE_CLOCKWISE);
-			}
-			thumb = gdk_pixbuf_scale_simple(pixbufrot, 24, 24, GDK_INTERP_BILINEAR);
-			gtk_image_set_from_pixbuf(GTK_IMAGE(thumb_last), thumb);
-			last_path = strdup(fname);
-			if (error != NULL) {
-				g_printerr("%s\n", error->message);
-				g_clear_error(&error);
-			}
-
-			// Start post-processing the captured burst
-			g_printerr("Post process %s to %s.ext\n", burst_dir, fname_target);
-			sprintf(command, "%s %s %s &", processing_script, burst_dir, fname_target);
-			system(command);
 
+		pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, width, height);
+		if (debayer->binned(raw, gdk_pixbuf_get_pixels(pixbuf),
+				roi.width, roi.height, current.stride, width, height,
+				gdk_pixbuf_get_rowstride(pixbuf), color) == 0) {
+			return rotate_pixbuf(pixbuf);
 		}
-	} 
+		g_object_unref(pixbuf);
+	}
+
+	if (roi.width > 1280) {
+		skip = 3;
+	}
+	pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, MAX(1, roi.width / (skip*2)), MAX(1, roi.height / (skip*2)));
+	debayer->quick(raw, gdk_pixbuf_get_pixels(pixbuf), roi.width, roi.height,
+		current.stride, gdk_pixbuf_get_rowstride(pixbuf), skip);
+	return rotate_pixbuf(pixbuf);
 }
 
-static gboolean
-preview_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
+// Writes one raw frame as DNG, cam holds the mode the frame was taken in and
+// crop the part of it that was zoomed in on
+static void
+write_dng(const char *fname, const uint8_t *raw, const struct camerainfo *cam, time_t taken,
+	const struct region *crop)
 {
-	cairo_set_source_surface(cr, surface, 0, 0);
-	cairo_paint(cr);
-	return FALSE;
+	TIFF *tif;
+	struct dng_info info = {
+		.width = cam->mode.width,
+		.height = cam->mode.height,
+		.stride = cam->stride,
+		.layout = cam->mode.layout,
+		.cfapattern = cfa_pattern(cam->mode.cfa),
+		.make = exif_make,
+		.model = exif_model,
+		.colormatrix = cam->colormatrix[0] ? cam->colormatrix : colormatrix_srgb,
+		.forwardmatrix = cam->forwardmatrix[0] ? cam->forwardmatrix : NULL,
+		.neutral = neutral,
+		.blacklevel = cam->blacklevel,
+		.whitelevel = cam->whitelevel,
+		.shading_grid = cam->shading,
+		.focallength = cam->focallength,
+		.cropfactor = cam->cropfactor,
+		.fnumber = cam->fnumber,
+		.time = taken,
+	};
+
+	// The gains only fit frames in the capture mode, anything else gets the
+	// opcodes instead
+	if (cam->shading_table && cam->mode.width == cam->capture_mode.width &&
+			cam->mode.height == cam->capture_mode.height &&
+			cam->mode.cfa == cam->capture_mode.cfa) {
+		info.shading_table = cam->shading_table;
+	}
+	if (cam->badpixels && cam->mode.width == cam->badpixels->width &&
+			cam->mode.height == cam->badpixels->height) {
+		info.badpixels = cam->badpixels;
+		info.badpixel_opcodes = cam->badpixel_opcodes;
+	}
+	if (crop->width < cam->mode.width || crop->height < cam->mode.height) {
+		info.crop_x = crop->x;
+		info.crop_y = crop->y;
+		info.crop_width = crop->width;
+		info.crop_height = crop->height;
+	}
+
+	if(!(tif = output_tiff_open(fname))) {
+		printf("Could not open tiff\n");
+		return;
+	}
+	printf("Writing frame to %s\n", fname);
+	dng_write(tif, raw, &info);
+	TIFFClose(tif);
 }
 
-static gboolean
-preview_configure(GtkWidget *widget, GdkEventConfigure *event)
+// Writes a screen sized JPEG of the last burst frame where the post processed
+// photo will end up, so it can be looked at right away. The post processing
+// script replaces it with the full JPEG in one rename once that's done.
+static GdkPixbuf *
+write_proxy_jpeg(const uint8_t *raw, const char *target)
 {
-	cairo_t *cr;
+	char path[300];
+	char tmp[310];
+	GError *error = NULL;
+	struct timespec start;
+
+	clock_gettime(CLOCK_MONOTONIC, &start);
+	GdkPixbuf *image = debayer_to_width(raw, preview_width * gtk_widget_get_scale_factor(preview), 0);
+
+	snprintf(path, sizeof(path), "%s.jpg", target);
+	snprintf(tmp, sizeof(tmp), "%s.jpg.part", target);
+	char *dir = g_path_get_dirname(target);
+	g_mkdir_with_parents(dir, 0755);
+	g_free(dir);
+
+	if (!gdk_pixbuf_save(image, tmp, "jpeg", &error, "quality", "90", NULL)) {
+		g_printerr("Could not write %s: %s\n", tmp, error->message);
+		g_clear_error(&error);
+		unlink(tmp);
+		return image;
+	}
+	if (rename(tmp, path) < 0) {
+		g_printerr("Could not write %s: %s\n", path, strerror(errno));
+		unlink(tmp);
+		return image;
+	}
 
-	if (surface)
-		cairo_surface_destroy(surface);
+	free(last_path);
+	last_path = strdup(path);
+	printf("Proxy %s written in %.1f ms\n", path, ms_since(&start));
+
+	// The gallery thumbnail is made here once, it never decodes the file
+	int width = gdk_pixbuf_get_width(image);
+	int height = gdk_pixbuf_get_height(image);
+	double scale = (double)GALLERY_THUMB_SIZE / MAX(width, height);
+	GdkPixbuf *thumb = gdk_pixbuf_scale_simple(image, MAX(1, (int)(width * scale)),
+		MAX(1, (int)(height * scale)), GDK_INTERP_BILINEAR);
+	gallery_add(path, time(NULL), gdk_pixbuf_get_pixels(thumb), gdk_pixbuf_get_width(thumb),
+		gdk_pixbuf_get_height(thumb), gdk_pixbuf_get_rowstride(thumb));
+	g_object_unref(thumb);
+	return image;
+}
 
-	surface = gdk_window_create_similar_surface(gtk_widget_get_window(widget),
-		CAIRO_CONTENT_COLOR,
-		gtk_widget_get_allocated_width(widget),
-		gtk_widget_get_allocated_height(widget));
+// Called on the main thread once all DNGs of a burst are on disk, or not
+// all of them could be written. The zoom is passed to the post processing
+// as MEGAPIXELS_CROP, crop->width is 0 when the burst wasn't zoomed.
+static void
+finish_burst(int id, const char *dir, const char *target, uint64_t first_frame,
+	const struct region *crop, int complete)
+{
+	char command[1024];
+	char environment[64] = "";
 
-	preview_width = gtk_widget_get_allocated_width(widget);
-	preview_height = gtk_widget_get_allocated_height(widget);
+	burst_count++;
+	control_burst_done(id, dir, first_frame, complete);
 
-	cr = cairo_create(surface);
-	cairo_set_source_rgb(cr, 0, 0, 0);
-	cairo_paint(cr);
-	cairo_destroy(cr);
-	return TRUE;
+	if (!complete) {
+		g_printerr("Burst %s is incomplete, not post processing it\n", dir);
+		return;
+	}
+	// Headless bursts are left as DNG files
+	if (headless) {
+		return;
+	}
+	// Start post-processing the captured burst
+	if (crop->width > 0) {
+		snprintf(environment, sizeof(environment), "MEGAPIXELS_CROP=%dx%d+%d+%d ",
+			crop->width, crop->height, crop->x, crop->y);
+	}
+	g_printerr("Post process %s to %s.ext\n", dir, target);
+	snprintf(command, sizeof(command), "%s%s %s %s &", environment, processing_script, dir, target);
+	system(command);
 }
 
 static int
-read_frame(int fd)
+sensor_control(int fd, uint32_t id)
 {
-	struct v4l2_buffer buf = {0};
+	struct v4l2_control ctrl = {0};
 
-	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
-	buf.memory = V4L2_MEMORY_MMAP;
-	if (xioctl(fd, VIDIOC_DQBUF, &buf) == -1) {
-		switch (errno) {
-			case EAGAIN:
-				return 0;
-			case EIO:
-				/* Could ignore EIO, see spec. */
-				/* fallthrough */
-			default:
-				errno_exit("VIDIOC_DQBUF");
-				break;
-		}
+	ctrl.id = id;
+	if (xioctl(fd, VIDIOC_G_CTRL, &ctrl) == -1) {
+		return -1;
 	}
+	return ctrl.value;
+}
 
-	//assert(buf.index < n_buffers);
-
-	process_image(buffers[buf.index].start, buf.bytesused);
+static int
+write_journal_dngs(const char *dir, uint64_t start, uint64_t end)
+{
+	char fname[640];
+	uint64_t offset = start;
+
+	while (offset < end) {
+		uint64_t next;
+		const struct journal_frame *frame = journal_map(&journal, offset, &next);
+		if (!frame || frame->camera >= ARRAY_SIZE(cameras)) {
+			g_printerr("Capture journal is damaged at %llu\n", (unsigned long long)offset);
+			if (frame) {
+				journal_unmap(frame);
+			}
+			return -1;
+		}
 
-	if (xioctl(fd, VIDIOC_QBUF, &buf) == -1) {
-		errno_exit("VIDIOC_QBUF");
+		// The config of the camera with the mode the frame was taken in
+		struct camerainfo cam = cameras[frame->camera];
+		cam.mode.width = frame->width;
+		cam.mode.height = frame->height;
+		cam.mode.fmt = frame->pixelformat;
+		cam.mode.layout = frame->layout;
+		cam.mode.cfa = frame->cfa;
+		cam.stride = frame->stride;
+		struct region crop = {frame->crop_x, frame->crop_y, frame->crop_width, frame->crop_height};
+
+		snprintf(fname, sizeof(fname), "%s/%d.dng", dir, frame->index);
+		write_dng(fname, (const uint8_t *)frame + JOURNAL_ALIGN, &cam, frame->time, &crop);
+		journal_unmap(frame);
+		offset = next;
 	}
-
-	return 1;
+	return 0;
+}
+
+static gboolean
+dng_finished(gpointer data)
+{
+	struct dng_job *job;
+
+	while ((job = g_async_queue_try_pop(dng_done))) {
+		finish_burst(job->id, job->dir, job->target, job->first_frame, &job->crop, job->complete);
+		free(job);
+	}
+	return FALSE;
+}
+
+static gpointer
+dng_writer(gpointer data)
+{
+	struct dng_job *job;
+
+	while ((job = g_async_queue_pop(dng_queue)) != &dng_stop) {
+		uint64_t start = control_timestamp();
+
+		job->complete = write_journal_dngs(job->dir, job->start, job->end) == 0;
+		if (output_flush() > 0) {
+			g_printerr("Not all frames of %s could be written\n", job->dir);
+			job->complete = 0;
+		}
+		journal_release(&journal, job->start, job->end);
+
+		uint64_t done = control_timestamp();
+		printf("Burst %s written from the journal in %.1f ms, %.1f ms after the first frame (%s)\n",
+			job->dir, (done - start) / 1e6, (done - job->first_frame) / 1e6,
+			output_backend_name());
+
+		g_async_queue_push(dng_done, job);
+		g_idle_add(dng_finished, NULL);
+	}
+	return NULL;
+}
+
+// Waits for the DNGs of all journaled bursts
+static void
+stop_dng_writer()
+{
+	if (!dng_thread) {
+		return;
+	}
+	g_async_queue_push(dng_queue, &dng_stop);
+	g_thread_join(dng_thread);
+	dng_thread = NULL;
+	dng_finished(NULL);
+}
+
+static void
+stop_journal()
+{
+	stop_dng_writer();
+	if (journal_opened) {
+		journal_close(&journal);
+		journal_opened = 0;
+	}
+}
+
+static int
+open_journal()
+{
+	char path[PATH_MAX];
+
+	// On disk rather than in /tmp, which is often in memory
+	snprintf(path, sizeof(path), "%s/megapixels", g_get_user_cache_dir());
+	g_mkdir_with_parents(path, 0755);
+	snprintf(path, sizeof(path), "%s/megapixels/journal-%d.raw", g_get_user_cache_dir(), getpid());
+	if (journal_open(&journal, path) < 0) {
+		g_printerr("Could not create capture journal %s: %s\n", path, strerror(errno));
+		return -1;
+	}
+	journal_opened = 1;
+
+	dng_queue = g_async_queue_new();
+	dng_done = g_async_queue_new();
+	dng_thread = g_thread_new("dng", dng_writer, NULL);
+	return 0;
+}
+
+// Appends a burst frame to the journal. When that fails the journal is
+// turned off and the frames of the burst so far are written out directly.
+static int
+journal_add_frame(const uint8_t *raw, time_t taken, const struct region *crop)
+{
+	struct journal_frame frame = {0};
+	uint64_t offset;
+
+	if (!journal_opened && open_journal() < 0) {
+		use_journal = 0;
+		return -1;
+	}
+
+	frame.burst = burst_id;
+	frame.index = burst_frames - capture;
+	frame.camera = active_camera;
+	frame.width = current.mode.width;
+	frame.height = current.mode.height;
+	frame.stride = current.stride;
+	frame.pixelformat = current.mode.fmt;
+	frame.layout = current.mode.layout;
+	frame.cfa = current.mode.cfa;
+	frame.exposure = sensor_control(cameras[active_camera].fd, V4L2_CID_EXPOSURE);
+	frame.gain = sensor_control(cameras[active_camera].fd, V4L2_CID_GAIN);
+	frame.sequence = frame_sequence;
+	frame.timestamp = frame_timestamp;
+	frame.time = taken;
+	frame.crop_x = crop->x;
+	frame.crop_y = crop->y;
+	frame.crop_width = crop->width;
+	frame.crop_height = crop->height;
+	frame.size = (uint64_t)current.stride * current.mode.height;
+
+	if (journal_append(&journal, &frame, raw, &offset) < 0) {
+		g_printerr("Could not write to the capture journal: %s\n", strerror(errno));
+		use_journal = 0;
+		stop_dng_writer();
+		if (burst_journal_frames > 0) {
+			write_journal_dngs(burst_dir, burst_journal_start, journal.end);
+			burst_journal_frames = 0;
+		}
+		return -1;
+	}
+	if (burst_journal_frames++ == 0) {
+		burst_journal_start = offset;
+	}
+	return 0;
+}
+
+// Turns the measured burst into a calibration file for the shading key
+static void
+finish_shading_calibration()
+{
+	if (shading_finish(shading_calibration) < 0) {
+		g_printerr("The calibration frames are black, point the camera at an evenly lit white surface\n");
+		exit(EXIT_FAILURE);
+	}
+	if (shading_save(calibrate_shading, shading_calibration) < 0) {
+		g_printerr("Could not write %s\n", calibrate_shading);
+		exit(EXIT_FAILURE);
+	}
+	printf("Lens shading of %d frames written to %s\n", burst_frames, calibrate_shading);
+}
+
+// Turns the dark burst into a list for the badpixels key
+static void
+finish_badpixel_calibration()
+{
+	struct badpixels *map = badpixels_finish(badpixel_calibration);
+	if (!map) {
+		g_printerr("Too many pixels stand out of the calibration frames, cover the lens completely\n");
+		exit(EXIT_FAILURE);
+	}
+	if (badpixels_save(calibrate_badpixels, map) < 0) {
+		g_printerr("Could not write %s\n", calibrate_badpixels);
+		exit(EXIT_FAILURE);
+	}
+	printf("%d defective pixels in %d frames written to %s\n", map->count, burst_frames,
+		calibrate_badpixels);
+	badpixels_free(map);
+}
+
+static void
+process_image(const int *p, int size)
+{
+	time_t rawtime;
+	struct tm tim;
+	char fname[255];
+	char fname_target[255];
+	char timestamp[30];
+	GdkPixbuf *pixbufrot;
+	GdkPixbuf *thumb;
+	double scale;
+	cairo_t *cr;
+
+	frame_count++;
+
+	// Every frame goes to the recording, it never waits for the disk. Frames
+	// from another mode, like during a burst, don't fit in it.
+	if (recording && (uint64_t)current.stride * current.mode.height == recorder.header.frame_size) {
+		raw_video_push(&recorder, (const uint8_t *)p, frame_timestamp, frame_sequence);
+	}
+
+	if (capture == 0 && power_state == POWER_THROTTLED && frame_count % rate_skip) {
+		return;
+	}
+
+	if (capture == 0 && power_state == POWER_ACTIVE && analyzers_active()) {
+		analyzers_offer((const uint8_t *)p, current.mode.width, current.mode.height,
+			current.stride, current.mode.layout);
+	}
+
+	// There is nothing to show a preview on, or nobody is looking at it
+	if (capture == 0 && (headless || power_state != POWER_ACTIVE) && !control_preview_wanted()) {
+		return;
+	}
+
+	// Only process preview frames when not capturing
+	if (capture == 0 && headless) {
+		pixbufrot = debayer_to_width((const uint8_t *)p, HEADLESS_PREVIEW_WIDTH, 1);
+		control_publish_preview(gdk_pixbuf_get_pixels(pixbufrot), gdk_pixbuf_get_width(pixbufrot),
+			gdk_pixbuf_get_height(pixbufrot), gdk_pixbuf_get_rowstride(pixbufrot));
+		g_object_unref(pixbufrot);
+	} else if (capture == 0) {
+		pixbufrot = debayer_to_width((const uint8_t *)p, preview_width, 1);
+		control_publish_preview(gdk_pixbuf_get_pixels(pixbufrot), gdk_pixbuf_get_width(pixbufrot),
+			gdk_pixbuf_get_height(pixbufrot), gdk_pixbuf_get_rowstride(pixbufrot));
+
+		scale = (double) preview_width / gdk_pixbuf_get_width(pixbufrot);
+		cr = cairo_create(surface);
+		cairo_set_source_rgb(cr, 0, 0, 0);
+		cairo_paint(cr);
+		cairo_scale(cr, scale, scale);
+		gdk_cairo_set_source_pixbuf(cr, pixbufrot, 0, 0);
+		cairo_pattern_set_extend(cairo_get_source(cr), CAIRO_EXTEND_NONE);
+		cairo_paint(cr);
+		if (analyzers_active()) {
+			overlay_transform(cr, gdk_pixbuf_get_width(pixbufrot), gdk_pixbuf_get_height(pixbufrot));
+			analyzers_overlay(cr);
+		}
+		cairo_destroy(cr);
+		g_object_unref(pixbufrot);
+		gtk_widget_queue_draw_area(preview, 0, 0, preview_width, preview_height);
+	} else {
+		if (capture == burst_frames) {
+			burst_first_frame = control_timestamp();
+		}
+		capture--;
+		time(&rawtime);
+		tim = *(localtime(&rawtime));
+		strftime(timestamp, 30, "%Y%m%d%H%M%S", &tim);
+
+		if (calibrate_shading) {
+			shading_measure(shading_calibration, (const uint8_t *)p, current.mode.layout,
+				current.mode.cfa, current.mode.width, current.mode.height, current.stride,
+				current.blacklevel);
+			if (capture == 0) {
+				finish_shading_calibration();
+			}
+			return;
+		}
+		if (calibrate_badpixels) {
+			if (!badpixel_calibration) {
+				badpixel_calibration = badpixels_calibration_new(current.mode.width,
+					current.mode.height, current.mode.layout);
+			}
+			badpixels_measure(badpixel_calibration, (const uint8_t *)p, current.mode.layout,
+				current.stride);
+			if (capture == 0) {
+				finish_badpixel_calibration();
+			}
+			return;
+		}
+
+		sprintf(fname_target, "%s/Pictures/IMG%s", getenv("HOME"), timestamp);
+		sprintf(fname, "%s/%d.dng", burst_dir, burst_frames - capture);
+
+		struct region crop;
+		zoom_region(&current.mode, &crop);
+		// Post processing crops like the proxy of the last frame
+		burst_crop = crop;
+		if (crop.width == current.mode.width && crop.height == current.mode.height) {
+			burst_crop.width = 0;
+		}
+		if (!use_journal || journal_add_frame((const uint8_t *)p, rawtime, &crop) < 0) {
+			write_dng(fname, (const uint8_t *)p, &current, rawtime, &crop);
+		}
+
+		if (capture == 0 && !headless) {
+			// Update the thumbnail if this is the last frame, before post
+			// processing can replace the proxy
+			pixbufrot = write_proxy_jpeg((const uint8_t *)p, fname_target);
+			thumb = gdk_pixbuf_scale_simple(pixbufrot, 24, 24, GDK_INTERP_BILINEAR);
+			gtk_image_set_from_pixbuf(GTK_IMAGE(thumb_last), thumb);
+			g_object_unref(thumb);
+			g_object_unref(pixbufrot);
+		}
+
+		if (capture == 0 && burst_journal_frames > 0) {
+			struct dng_job *job = calloc(1, sizeof(struct dng_job));
+			strcpy(job->dir, burst_dir);
+			strcpy(job->target, fname_target);
+			job->start = burst_journal_start;
+			job->end = journal.end;
+			job->first_frame = burst_first_frame;
+			job->crop = burst_crop;
+			job->id = burst_id;
+			g_async_queue_push(dng_queue, job);
+			burst_journal_frames = 0;
+		} else if (capture == 0) {
+			// The burst is only handed on once every file is on disk
+			uint64_t flush_start = control_timestamp();
+			int complete = 1;
+			if (output_flush() > 0) {
+				g_printerr("Not all frames of %s could be written\n", burst_dir);
+				complete = 0;
+			}
+			uint64_t flushed = control_timestamp();
+			printf("Burst %s flushed in %.1f ms, %.1f ms after the first frame (%s)\n",
+				burst_dir, (flushed - flush_start) / 1e6, (flushed - burst_first_frame) / 1e6,
+				output_backend_name());
+
+			finish_burst(burst_id, burst_dir, fname_target, burst_first_frame, &burst_crop, complete);
+		}
+
+	} 
+}
+
+static gboolean
+preview_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
+{
+	cairo_set_source_surface(cr, surface, 0, 0);
+	cairo_paint(cr);
+	return FALSE;
+}
+
+static gboolean
+preview_configure(GtkWidget *widget, GdkEventConfigure *event)
+{
+	cairo_t *cr;
+
+	if (surface)
+		cairo_surface_destroy(surface);
+
+	surface = gdk_window_create_similar_surface(gtk_widget_get_window(widget),
+		CAIRO_CONTENT_COLOR,
+		gtk_widget_get_allocated_width(widget),
+		gtk_widget_get_allocated_height(widget));
+
+	preview_width = gtk_widget_get_allocated_width(widget);
+	preview_height = gtk_widget_get_allocated_height(widget);
+
+	cr = cairo_create(surface);
+	cairo_set_source_rgb(cr, 0, 0, 0);
+	cairo_paint(cr);
+	cairo_destroy(cr);
+	return TRUE;
+}
+
+static void
+start_burst(const char *dir, int length)
+{
+	strcpy(burst_dir, dir);
+
+	burst_id++;
+	burst_frames = length;
+	capture = length;
+	update_power();
+
+	if (ready && !modes_equal(&current.mode, &current.capture_mode)) {
+		switch_mode(&current.capture_mode);
+	}
+}
+
+static gboolean
+headless_burst(gpointer data)
+{
+	char dir[512];
+
+	snprintf(dir, sizeof(dir), "%s/burst%d", headless_output, ++headless_started);
+	if (!calibrate_shading && !calibrate_badpixels && g_mkdir_with_parents(dir, 0755) < 0) {
+		g_printerr("Could not make capture directory %s\n", dir);
+		exit(EXIT_FAILURE);
+	}
+	printf("Starting burst %d in %s\n", headless_started, dir);
+	start_burst(dir, burst_length);
+	return FALSE;
+}
+
+static uint64_t
+timespec_ns(const struct timespec *ts)
+{
+	return ts->tv_sec * 1000000000ull + ts->tv_nsec;
+}
+
+// Prints the time from resume_stream() to the first frame
+static void
+report_resume(const struct timespec *dequeued)
+{
+	if (!resume_pending) {
+		return;
+	}
+	resume_ms = ms_between(&resume_start, dequeued);
+	printf("First frame after resume in %.1f ms%s\n", resume_ms,
+		resume_ms > RESUME_TARGET_MS ? ", over target" : "");
+	if (resume_ms > RESUME_TARGET_MS) {
+		suspend_allowed = 0;
+	}
+	resume_pending = 0;
+}
+
+static gboolean
+timelapse_resume(gpointer data)
+{
+	timelapse_timer = 0;
+	timelapse_stream_start = control_timestamp();
+	if (resume_stream() < 0) {
+		g_printerr("Could not start the stream again\n");
+		g_main_loop_quit(main_loop);
+	}
+	timelapse_resumed = 1;
+	timelapse_waiting = 1;
+	return FALSE;
+}
+
+// Plans the next shot after a burst, slots that already passed are missed.
+// The stream is only stopped when it's idle for long enough to be worth it.
+static void
+timelapse_schedule()
+{
+	uint64_t now = control_timestamp();
+	uint64_t interval = timelapse_interval * 1000000ull;
+
+	timelapse_next += interval;
+	while (timelapse_next <= now) {
+		printf("Missed the shot at %.1f s\n", (timelapse_next - timelapse_start) / 1e9);
+		timelapse_missed++;
+		timelapse_next += interval;
+	}
+
+	double idle_ms = (timelapse_next - now) / 1e6 - timelapse_lead_ms - TIMELAPSE_MARGIN_MS;
+	if (idle_ms < TIMELAPSE_MIN_IDLE_MS) {
+		timelapse_waiting = 1;
+		return;
+	}
+	suspend_stream();
+	timelapse_streaming_ns += now - timelapse_stream_start;
+	timelapse_timer = g_timeout_add((guint)idle_ms, timelapse_resume, NULL);
+}
+
+static void
+timelapse_begin()
+{
+	timelapse_start = control_timestamp();
+	timelapse_stream_start = timelapse_start;
+	timelapse_next = timelapse_start;
+	timelapse_waiting = 1;
+}
+
+// Called for every frame before it's processed. Frames that come in before
+// the shot is due give the exposure time to settle and are dropped. The
+// burst starts after the last frame before the shot, so its first frame is
+// the one on time.
+static void
+timelapse_frame(const struct timespec *dequeued)
+{
+	uint64_t now = timespec_ns(dequeued);
+	uint64_t frame_ns = 1000000000ull / MAX(current.mode.rate, 1);
+
+	if (timelapse_resumed) {
+		// Start early enough for the slowest recent resume
+		timelapse_lead_ms = MAX(resume_ms, timelapse_lead_ms * 0.875 + resume_ms * 0.125);
+		timelapse_resumes++;
+		timelapse_startup_total += resume_ms;
+		timelapse_startup_max = MAX(timelapse_startup_max, resume_ms);
+		timelapse_resumed = 0;
+	}
+	if (timelapse_shooting && capture > 0) {
+		// Early by up to a frame when the rate isn't what the mode says
+		double drift = ((int64_t)now - (int64_t)timelapse_next) / 1e6;
+		timelapse_shooting = 0;
+		timelapse_shots++;
+		timelapse_drift_total += fabs(drift);
+		timelapse_drift_max = MAX(timelapse_drift_max, fabs(drift));
+		printf("Shot %d at %.1f s, %.1f ms late\n", timelapse_shots,
+			(timelapse_next - timelapse_start) / 1e9, drift);
+		return;
+	}
+	if (timelapse_waiting && now + frame_ns >= timelapse_next) {
+		timelapse_waiting = 0;
+		timelapse_due = 1;
+	}
+}
+
+// Starts the burst of a shot that is due and plans the next one after a
+// burst, called once the frame's buffer is queued again
+static void
+timelapse_poll()
+{
+	if (timelapse_due) {
+		timelapse_due = 0;
+		timelapse_shooting = 1;
+		headless_burst(NULL);
+	}
+	if (timelapse_done) {
+		timelapse_done = 0;
+		timelapse_schedule();
+	}
+}
+
+// Frames streamed are what costs power, the time the sensor spent streaming
+// and the frames it delivered stand in for it
+static void
+timelapse_report()
+{
+	uint64_t now = control_timestamp();
+	double total = (now - timelapse_start) / 1e9;
+	double streaming = (timelapse_streaming_ns + now - timelapse_stream_start) / 1e9;
+
+	printf("Time-lapse of %d shots in %.1f s: %d missed intervals, drift %.1f ms average %.1f ms max, "
+		"resume %.1f ms average %.1f ms max, streaming %.1f s (%.0f%%), %lu frames\n",
+		timelapse_shots, total, timelapse_missed,
+		timelapse_shots ? timelapse_drift_total / timelapse_shots : 0.0, timelapse_drift_max,
+		timelapse_resumes ? timelapse_startup_total / timelapse_resumes : 0.0,
+		timelapse_startup_max, streaming, total > 0 ? streaming * 100 / total : 0.0, frame_count);
+}
+
+// Per frame timing of headless runs, the interval is between dequeuing
+// frames and the processing time is what the frame took after that
+static void
+headless_frame_done(const struct timespec *dequeued, int burst_frame)
+{
+	static struct timespec previous;
+	double interval = previous.tv_sec ? ms_between(&previous, dequeued) : 0;
+	double processing = ms_since(dequeued);
+
+	previous = *dequeued;
+	if (!burst_frame) {
+		return;
+	}
+
+	headless_frames++;
+	headless_total_ms += processing;
+	headless_max_ms = MAX(headless_max_ms, processing);
+	printf("Burst %d frame %d: interval %.1f ms, processing %.1f ms\n",
+		headless_started, burst_frames - capture, interval, processing);
+
+	if (capture > 0) {
+		return;
+	}
+	headless_done++;
+	if (timelapse_interval && (headless_bursts == 0 || headless_started < headless_bursts)) {
+		timelapse_done = 1;
+		return;
+	}
+	if (timelapse_interval) {
+		timelapse_report();
+	}
+	if (headless_started < headless_bursts) {
+		g_timeout_add(headless_interval, headless_burst, NULL);
+		return;
+	}
+	// Without a burst count only the control socket takes pictures
+	if (headless_bursts == 0 || headless_done < headless_bursts) {
+		return;
+	}
+
+	printf("Captured %d frames in %d bursts, processing %.1f ms average, %.1f ms max\n",
+		headless_frames, headless_done, headless_total_ms / headless_frames,
+		headless_max_ms);
+	g_main_loop_quit(main_loop);
+}
+
+static int
+read_frame(int fd)
+{
+	struct v4l2_buffer buf = {0};
+	struct timespec dequeued;
+	int burst_frame;
+	void *frame;
+	void *detached = NULL;
+
+	buf.type = V4L2_BUF_TYPE_VIDEO_CAPTURE;
+	buf.memory = V4L2_MEMORY_MMAP;
+	if (current.io == IO_METHOD_USERPTR) {
+		buf.memory = V4L2_MEMORY_USERPTR;
+	}
+	if (xioctl(fd, VIDIOC_DQBUF, &buf) == -1) {
+		switch (errno) {
+			case EAGAIN:
+				return 0;
+			case EIO:
+				/* Could ignore EIO, see spec. */
+				/* fallthrough */
+			default:
+				errno_exit("VIDIOC_DQBUF");
+				break;
+		}
+	}
+
+	//assert(buf.index < n_buffers);
+
+	clock_gettime(CLOCK_MONOTONIC, &dequeued);
+	report_resume(&dequeued);
+	timelapse_frame(&dequeued);
+	burst_frame = capture > 0;
+	frame_timestamp = buf.timestamp.tv_sec * 1000000000ull + buf.timestamp.tv_usec * 1000ull;
+	frame_sequence = buf.sequence;
+
+	if (switch_pending) {
+		double elapsed = ms_since(&switch_start);
+		printf("First frame after switch in %.1f ms%s\n", elapsed,
+			elapsed > SWITCH_TARGET_MS ? ", over target" : "");
+		switch_pending = 0;
+	}
+
+	frame = buffers[buf.index].start;
+
+	// Take burst frames out of the queue and put a spare in their place
+	// right away, so the driver isn't short a buffer while the DNG is written
+	if (current.io == IO_METHOD_USERPTR && capture) {
+		void *spare = buffer_pool_take(&pool);
+		if (spare) {
+			detached = frame;
+			buffers[buf.index].start = spare;
+			buf.m.userptr = (unsigned long)spare;
+			if (xioctl(fd, VIDIOC_QBUF, &buf) == -1) {
+				errno_exit("VIDIOC_QBUF");
+			}
+		}
+	}
+
+	process_image(frame, buf.bytesused);
+	if (headless) {
+		headless_frame_done(&dequeued, burst_frame);
+	}
+
+	if (!startup_reported) {
+		printf("Startup: config %.1f ms, hardware %.1f ms, ui %.1f ms, "
+			"ready %.1f ms, first frame %.1f ms\n",
+			startup_config_ms, startup_hardware_ms, startup_ui_ms,
+			startup_ready_ms, ms_since(&startup_start));
+		startup_reported = 1;
+	}
+
+	if (detached) {
+		buffer_pool_release(&pool, detached);
+	} else if (xioctl(fd, VIDIOC_QBUF, &buf) == -1) {
+		errno_exit("VIDIOC_QBUF");
+	}
+
+	return 1;
 }
 
 gboolean
 get_frame()
 {
-	if (ready == 0)
+	if (ready == 0) {
+		// Added again when the stream is resumed
+		if (power_state == POWER_SUSPENDED) {
+			frame_source = 0;
+			return FALSE;
+		}
 		return TRUE;
+	}
 	while (1) {
 		fd_set fds;
 		struct timeval tv;
@@ -689,6 +1772,17 @@ get_frame()
 		}
 		/* EAGAIN - continue select loop. */
 	}
+	timelapse_poll();
+
+	// Go back to the preview mode once the burst is done
+	if (capture == 0 && !modes_equal(&current.mode, &current.preview_mode)) {
+		switch_mode(&current.preview_mode);
+	}
+	// Bursts, recordings and preview clients can end while the preview
+	// is hidden
+	if (capture == 0) {
+		update_power();
+	}
 	return TRUE;
 }
 
@@ -700,37 +1794,80 @@ strtoint(const char *nptr, char **endptr, int base)
 	return (int) x;
 }
 
+// Files named in the config are relative to it, free with g_free()
+static char *
+config_relative_path(const char *conffile, const char *value)
+{
+	if (g_path_is_absolute(value)) {
+		return g_strdup(value);
+	}
+	char *dir = g_path_get_dirname(conffile);
+	char *path = g_build_filename(dir, value, NULL);
+	g_free(dir);
+	return path;
+}
+
 static int
 config_ini_handler(void *user, const char *section, const char *name,
 	const char *value)
 {
+	const char *conffile = user;
 	struct camerainfo *cc;
+	struct camera_mode *mode;
+	const char *key;
 	if (atoi(section) < ARRAY_SIZE(cameras) && atoi(section) >= 0) {
 		cc = &cameras[atoi(section)];
+		if (!cc->valid) {
+			cc->io = IO_METHOD_MMAP;
+			cc->buffers = 4;
+		}
 		cc->valid = 1;
 
-		if (strcmp(name, "width") == 0) {
-			cc->width = strtoint(value, NULL, 10);
-		} else if (strcmp(name, "height") == 0) {
-			cc->height = strtoint(value, NULL, 10);
-		} else if (strcmp(name, "rate") == 0) {
-			cc->rate = strtoint(value, NULL, 10);
+		// Without the preview- prefix the mode keys set the mode used to
+		// capture, which is also used for the preview unless overridden
+		mode = &cc->capture_mode;
+		key = name;
+		if (strncmp(name, "preview-", 8) == 0) {
+			mode = &cc->preview_mode;
+			key = name + 8;
+		}
+
+		if (strcmp(key, "width") == 0) {
+			mode->width = strtoint(value, NULL, 10);
+		} else if (strcmp(key, "height") == 0) {
+			mode->height = strtoint(value, NULL, 10);
+		} else if (strcmp(key, "rate") == 0) {
+			mode->rate = strtoint(value, NULL, 10);
+		} else if (strcmp(key, "fmt") == 0) {
+			int i;
+			for (i = 0; i < ARRAY_SIZE(formats); i++) {
+				if (strcmp(value, formats[i].name) == 0) {
+					break;
+				}
+			}
+			if (i == ARRAY_SIZE(formats)) {
+				g_printerr("Unsupported pixelformat %s\n", value);
+				exit(1);
+			}
+			mode->fmt = formats[i].fmt;
+			mode->mbus = formats[i].mbus;
+			mode->cfa = formats[i].cfa;
+			mode->layout = formats[i].layout;
 		} else if (strcmp(name, "rotate") == 0) {
 			cc->rotate = strtoint(value, NULL, 10);
-		} else if (strcmp(name, "fmt") == 0) {
-			if (strcmp(value, "RGGB8") == 0) {
-				cc->fmt = V4L2_PIX_FMT_SRGGB8;
-			} else if (strcmp(value, "BGGR8") == 0) {
-				cc->fmt = V4L2_PIX_FMT_SBGGR8;
-				cc->mbus = MEDIA_BUS_FMT_SBGGR8_1X8;
-			} else if (strcmp(value, "GRBG8") == 0) {
-				cc->fmt = V4L2_PIX_FMT_SGRBG8;
-			} else if (strcmp(value, "GBRG8") == 0) {
-				cc->fmt = V4L2_PIX_FMT_SGBRG8;
+		} else if (strcmp(name, "io") == 0) {
+			if (strcmp(value, "mmap") == 0) {
+				cc->io = IO_METHOD_MMAP;
+			} else if (strcmp(value, "userptr") == 0) {
+				cc->io = IO_METHOD_USERPTR;
 			} else {
-				g_printerr("Unsupported pixelformat %s\n", value);
+				g_printerr("Unsupported io method %s\n", value);
 				exit(1);
 			}
+		} else if (strcmp(name, "buffers") == 0) {
+			cc->buffers = strtoint(value, NULL, 10);
+		} else if (strcmp(name, "hugepages") == 0) {
+			cc->hugepages = strtoint(value, NULL, 10);
 		} else if (strcmp(name, "driver") == 0) {
 			strcpy(cc->dev_name, value);
 		} else if (strcmp(name, "colormatrix") == 0) {
@@ -761,6 +1898,42 @@ config_ini_handler(void *user, const char *section, const char *name,
 			cc->whitelevel = strtoint(value, NULL, 10);
 		} else if (strcmp(name, "blacklevel") == 0) {
 			cc->blacklevel = strtoint(value, NULL, 10);
+		} else if (strcmp(name, "shading") == 0) {
+			char *path = config_relative_path(conffile, value);
+			shading_grid_free(cc->shading);
+			cc->shading = shading_load(path);
+			if (!cc->shading) {
+				g_printerr("Could not load lens shading from %s\n", path);
+				exit(1);
+			}
+			g_free(path);
+		} else if (strcmp(name, "shading-mode") == 0) {
+			if (strcmp(value, "raw") == 0) {
+				cc->shading_opcodes = 0;
+			} else if (strcmp(value, "dng") == 0) {
+				cc->shading_opcodes = 1;
+			} else {
+				g_printerr("Unsupported shading mode %s\n", value);
+				exit(1);
+			}
+		} else if (strcmp(name, "badpixels") == 0) {
+			char *path = config_relative_path(conffile, value);
+			badpixels_free(cc->badpixels);
+			cc->badpixels = badpixels_load(path);
+			if (!cc->badpixels) {
+				g_printerr("Could not load defective pixels from %s\n", path);
+				exit(1);
+			}
+			g_free(path);
+		} else if (strcmp(name, "badpixels-mode") == 0) {
+			if (strcmp(value, "raw") == 0) {
+				cc->badpixel_opcodes = 0;
+			} else if (strcmp(value, "dng") == 0) {
+				cc->badpixel_opcodes = 1;
+			} else {
+				g_printerr("Unsupported badpixels mode %s\n", value);
+				exit(1);
+			}
 		} else if (strcmp(name, "focallength") == 0) {
 			cc->focallength = strtof(value, NULL);
 		} else if (strcmp(name, "cropfactor") == 0) {
@@ -789,12 +1962,42 @@ config_ini_handler(void *user, const char *section, const char *name,
 	return 1;
 }
 
+// The uevent file of a device in sysfs has the name of its node in /dev,
+// which saves stat()ing everything in /dev to find it
+static int
+sysfs_dev_node(const char *uevent, char *fnbuf)
+{
+	char line[250];
+	FILE *f = fopen(uevent, "r");
+	if (!f) {
+		return -1;
+	}
+	while (fgets(line, sizeof(line), f)) {
+		if (strncmp(line, "DEVNAME=", 8) == 0) {
+			line[strcspn(line, "\n")] = '\0';
+			sprintf(fnbuf, "/dev/%s", line + 8);
+			fclose(f);
+			return 0;
+		}
+	}
+	fclose(f);
+	return -1;
+}
+
 int
 find_dev_node(int maj, int min, char *fnbuf)
 {
 	DIR *d;
 	struct dirent *dir;
 	struct stat info;
+	char uevent[64];
+
+	sprintf(uevent, "/sys/dev/char/%d:%d/uevent", maj, min);
+	if (sysfs_dev_node(uevent, fnbuf) == 0) {
+		return 0;
+	}
+
+	// No sysfs, scan /dev instead
 	d = opendir("/dev");
 	while ((dir = readdir(d)) != NULL) {
 		sprintf(fnbuf, "/dev/%s", dir->d_name);
@@ -809,24 +2012,266 @@ find_dev_node(int maj, int min, char *fnbuf)
 	return -1;
 }
 
+// Derive the camera to sRGB matrix for the preview from the DNG matrices in
+// the config, so the preview matches what the raw developer will produce
+static void
+init_preview_color()
+{
+	float matrix[9];
+	int bits = raw_bits(current.mode.layout);
+	int white = current.whitelevel > current.blacklevel ? current.whitelevel : (1 << bits) - 1;
+
+	preview_color_matrix(current.colormatrix[0] ? current.colormatrix : NULL,
+		current.forwardmatrix[0] ? current.forwardmatrix : NULL, matrix);
+	preview_color_init(&preview_color, bits, current.blacklevel,
+		current.whitelevel, matrix, neutral);
+	preview_color_init(&lowlight_color, bits, current.blacklevel,
+		current.blacklevel + MAX(1, (white - current.blacklevel) / LOWLIGHT_GAIN), matrix, neutral);
+}
+
+// Configure the sensor and the preview for current.mode
+static void
+apply_mode()
+{
+	struct camerainfo *camera = &cameras[active_camera];
+
+	debayer = debayer_kernels_get(current.mode.cfa, current.mode.layout);
+	init_preview_color();
+
+	if (!modes_equal(&camera->sensor_mode, &current.mode)) {
+		init_sensor(camera->fd, current.mode.width, current.mode.height,
+			current.mode.mbus, current.mode.rate);
+		camera->sensor_mode = current.mode;
+	}
+}
+
+// Start the stream again after stop_capturing, the buffers are only
+// reallocated when the frame format is different
+static int
+restart_capturing()
+{
+	if (device_mode.width != current.mode.width ||
+		device_mode.height != current.mode.height ||
+		device_mode.fmt != current.mode.fmt) {
+		release_buffers(video_fd);
+		if (init_device(video_fd) < 0) {
+			show_error("Could not set camera mode");
+			return -1;
+		}
+	}
+	start_capturing(video_fd);
+	return 0;
+}
+
+static int
+modes_equal(const struct camera_mode *a, const struct camera_mode *b)
+{
+	return a->width == b->width && a->height == b->height &&
+		a->rate == b->rate && a->fmt == b->fmt;
+}
+
+// Restart the stream in another sensor mode, used to go to the full
+// resolution mode for a burst and back to the preview mode afterwards
+static void
+switch_mode(const struct camera_mode *mode)
+{
+	clock_gettime(CLOCK_MONOTONIC, &switch_start);
+
+	stop_capturing(video_fd);
+	current.mode = *mode;
+	apply_mode();
+	if (restart_capturing() < 0) {
+		return;
+	}
+
+	switch_pending = 1;
+	printf("Switched to %dx%d@%d in %.1f ms\n", mode->width, mode->height,
+		mode->rate, ms_since(&switch_start));
+}
+
+// Sensors like the ov5640 don't take a new rate while streaming, so the
+// stream is stopped around it like in switch_mode(). When the rate can't be
+// changed at all the extra frames are dropped instead. Only fails when the
+// stream couldn't be started again.
+static int
+set_sensor_rate(int rate)
+{
+	struct camerainfo *camera = &cameras[active_camera];
+	int streaming = ready;
+
+	rate_skip = 1;
+	if (camera->sensor_mode.rate == rate) {
+		return 0;
+	}
+	if (streaming) {
+		stop_capturing(video_fd);
+	}
+	if (set_frame_interval(camera->fd, rate) < 0) {
+		g_printerr("Could not change the sensor rate to %d: %s\n", rate, strerror(errno));
+		rate_skip = MAX(camera->sensor_mode.rate / MAX(rate, 1), 1);
+	} else {
+		camera->sensor_mode.rate = rate;
+	}
+	if (streaming && restart_capturing() < 0) {
+		return -1;
+	}
+	return 0;
+}
+
+// Stops streaming but keeps the sensor config and the buffers, so
+// resume_stream() only has to start it again
+static void
+suspend_stream()
+{
+	if (headless_synthetic) {
+		g_source_remove(synthetic_source);
+		synthetic_source = 0;
+	} else {
+		stop_capturing(video_fd);
+	}
+	power_state = POWER_SUSPENDED;
+}
+
+// The time until the first frame is reported by report_resume(). Stays
+// suspended when the stream can't be started.
+static int
+resume_stream()
+{
+	clock_gettime(CLOCK_MONOTONIC, &resume_start);
+	if (headless_synthetic) {
+		synthetic_source = g_timeout_add(1000 / MAX(current.mode.rate, 1),
+			(GSourceFunc)get_synthetic_frame, NULL);
+		power_state = POWER_ACTIVE;
+		resume_pending = 1;
+		return 0;
+	}
+	set_sensor_rate(current.mode.rate);
+	if (restart_capturing() < 0) {
+		return -1;
+	}
+	power_state = POWER_ACTIVE;
+	resume_pending = 1;
+	if (!frame_source) {
+		frame_source = g_idle_add((GSourceFunc)get_frame, NULL);
+	}
+	return 0;
+}
+
+static gboolean
+suspend_preview(gpointer data)
+{
+	suspend_timer = 0;
+	if (power_state != POWER_THROTTLED || !suspend_allowed) {
+		return FALSE;
+	}
+	suspend_stream();
+	printf("Preview suspended\n");
+	return FALSE;
+}
+
+// Keeps the stream running at the idle rate, from the suspended state too
+static void
+throttle_preview()
+{
+	if (set_sensor_rate(MIN(current.mode.rate, POWER_IDLE_RATE)) < 0) {
+		// Without a stream there's nothing to throttle, resuming retries
+		power_state = POWER_SUSPENDED;
+		return;
+	}
+	power_state = POWER_THROTTLED;
+	if (!suspend_timer) {
+		suspend_timer = g_timeout_add_seconds(POWER_SUSPEND_SECONDS, suspend_preview, NULL);
+	}
+	if (!frame_source) {
+		frame_source = g_idle_add((GSourceFunc)get_frame, NULL);
+	}
+}
+
+static int
+preview_needed()
+{
+	return (window_active && !window_iconified && main_page_shown) || capture > 0 ||
+		recording || control_preview_wanted();
+}
+
+// Slows the sensor down and skips the conversions when the preview can't be
+// seen, and stops streaming when that lasts. Called whenever one of the
+// things preview_needed() looks at changes.
+static void
+update_power()
+{
+	if (headless || active_camera < 0) {
+		return;
+	}
+
+	if (!preview_needed()) {
+		if (power_state == POWER_ACTIVE) {
+			throttle_preview();
+		}
+		return;
+	}
+
+	if (suspend_timer) {
+		g_source_remove(suspend_timer);
+		suspend_timer = 0;
+	}
+	if (power_state == POWER_SUSPENDED) {
+		// Tried again the next time the preview is needed
+		if (resume_stream() < 0) {
+			g_printerr("Could not resume the preview\n");
+		}
+		return;
+	}
+	if (set_sensor_rate(current.mode.rate) < 0) {
+		power_state = POWER_SUSPENDED;
+		return;
+	}
+	power_state = POWER_ACTIVE;
+}
+
+// The preview mode keys are optional, anything not set is taken from the
+// capture mode
+static void
+resolve_preview_mode(struct camerainfo *cc)
+{
+	struct camera_mode *preview = &cc->preview_mode;
+
+	if (preview->width == 0 || preview->height == 0) {
+		preview->width = cc->capture_mode.width;
+		preview->height = cc->capture_mode.height;
+	}
+	if (preview->rate == 0) {
+		preview->rate = cc->capture_mode.rate;
+	}
+	if (preview->fmt == 0) {
+		preview->fmt = cc->capture_mode.fmt;
+		preview->mbus = cc->capture_mode.mbus;
+		preview->cfa = cc->capture_mode.cfa;
+		preview->layout = cc->capture_mode.layout;
+	}
+}
+
 int
 setup_camera(int camera_id)
 {
 	struct media_link_desc link = {0};
 
+	link.source.index = 0;
+	link.sink.entity = interface_entity_id;
+	link.sink.index = 0;
+
+	// The graph is only fully set up once, after that just the links of
+	// the old and the new camera are changed
 	for (int i = 0; i<ARRAY_SIZE(cameras); i++) {
 
 		/* Second check here. Better safe than sorry. */
 
-		if (cameras[i].valid == 0) {
+		if (cameras[i].valid == 0 || i == camera_id) {
 			/* fall through */
-		} else {
+		} else if (active_camera == -1 || i == active_camera) {
 			// Disable the interface<->camera link
 			link.flags = 0;
-			link.source.entity = cameras[camera_id].entity_id;
-			link.source.index = 0;
-			link.sink.entity = interface_entity_id;
-			link.sink.index = 0;
+			link.source.entity = cameras[i].entity_id;
 
 			if (xioctl(media_fd, MEDIA_IOC_SETUP_LINK, &link) < 0) {
 				g_printerr("Could not disable camera%i link\n", i);
@@ -835,9 +2280,19 @@ setup_camera(int camera_id)
 		}
 	}
 
+	if (active_camera != camera_id) {
+		link.flags = MEDIA_LNK_FL_ENABLED;
+		link.source.entity = cameras[camera_id].entity_id;
+		if (xioctl(media_fd, MEDIA_IOC_SETUP_LINK, &link) < 0) {
+			g_printerr("Could not enable camera%i link\n", camera_id);
+			return -1;
+		}
+	}
+
+	active_camera = camera_id;
 	current = cameras[camera_id];
-	// Find camera node
-	init_sensor(current.dev, current.width, current.height, current.mbus, current.rate);
+	current.mode = current.preview_mode;
+	apply_mode();
 	return 0;
 }
 
@@ -855,7 +2310,7 @@ find_cameras()
 			break;
 		}
 		printf("At node %s, (0x%x)\n", entity.name, entity.type);
-		for (int i; i<ARRAY_SIZE(cameras); i++) {
+		for (int i = 0; i<ARRAY_SIZE(cameras); i++) {
 			if (cameras[i].valid == 0) {
 				/* fallthrough */
 			} else {
@@ -863,6 +2318,8 @@ find_cameras()
 					cameras[i].entity_id = entity.id;
 					find_dev_node(entity.dev.major, entity.dev.minor, cameras[i].dev);
 					printf("Found camera%i, is %s at %s\n", i, entity.name, cameras[i].dev);
+					// Kept open so switching cameras doesn't reopen it
+					cameras[i].fd = open(cameras[i].dev, O_RDWR);
 					found++;
 				}
 			}
@@ -887,7 +2344,46 @@ find_media_fd()
 	struct dirent *dir;
 	int fd;
 	char fnbuf[261];
+	char path[PATH_MAX];
+	char driver[PATH_MAX];
+	ssize_t len;
 	struct media_device_info mdi = {0};
+
+	// Pick the node by the driver link in sysfs so only that one is opened
+	d = opendir("/sys/bus/media/devices");
+	while (d && (dir = readdir(d)) != NULL) {
+		if (strncmp(dir->d_name, "media", 5) != 0) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "/sys/bus/media/devices/%s/device/driver", dir->d_name);
+		len = readlink(path, driver, sizeof(driver) - 1);
+		if (len < 0) {
+			continue;
+		}
+		driver[len] = '\0';
+		if (strcmp(strrchr(driver, '/') ? strrchr(driver, '/') + 1 : driver, media_drv_name) != 0) {
+			continue;
+		}
+		snprintf(path, sizeof(path), "/sys/bus/media/devices/%s/uevent", dir->d_name);
+		if (sysfs_dev_node(path, fnbuf) < 0) {
+			continue;
+		}
+		fd = open(fnbuf, O_RDWR);
+		if (fd >= 0 && xioctl(fd, MEDIA_IOC_DEVICE_INFO, &mdi) == 0 &&
+			strcmp(mdi.driver, media_drv_name) == 0) {
+			printf("Found media device %s at %s\n", mdi.driver, fnbuf);
+			closedir(d);
+			media_fd = fd;
+			return 0;
+		}
+		close(fd);
+	}
+	if (d) {
+		closedir(d);
+	}
+
+	// The name of the bus driver doesn't have to match what the media
+	// device reports, so fall back to asking every node
 	d = opendir("/dev");
 	while ((dir = readdir(d)) != NULL) {
 		if (strncmp(dir->d_name, "media", 5) == 0) {
@@ -903,7 +2399,7 @@ find_media_fd()
 			close(fd);
 		}
 	}
-	return 1;
+	return -1;
 }
 
 void
@@ -944,9 +2440,7 @@ on_shutter_clicked(GtkWidget *widget, gpointer user_data)
 		exit (EXIT_FAILURE);
 	}
 
-	strcpy(burst_dir, tempdir);
-
-	capture = burst_length;
+	start_burst(tempdir, burst_length);
 }
 
 void
@@ -958,8 +2452,8 @@ on_error_close_clicked(GtkWidget *widget, gpointer user_data)
 void
 on_camera_switch_clicked(GtkWidget *widget, gpointer user_data)
 {
+	clock_gettime(CLOCK_MONOTONIC, &switch_start);
 	stop_capturing(video_fd);
-	close(current.fd);
 
 retry:
 	if (current_camera < ARRAY_SIZE(cameras)) {
@@ -977,14 +2471,156 @@ retry:
 		current_camera = 0;
 	}
 
-	close(video_fd);
-	video_fd = open(dev_name, O_RDWR);
-	if (video_fd == -1) {
-		g_printerr("Error opening video device: %s\n", dev_name);
+	// All cameras share the interface node, so it stays open
+	if (restart_capturing() < 0) {
 		return;
 	}
-	init_device(video_fd);
-	start_capturing(video_fd);
+
+	switch_pending = 1;
+	printf("Switched to camera %d in %.1f ms\n", active_camera, ms_since(&switch_start));
+
+	// Switched from the control socket while nobody looks, the new camera
+	// idles too
+	if (power_state != POWER_ACTIVE) {
+		throttle_preview();
+	}
+}
+
+// Takes effect with the next preview frame and burst
+static void
+set_zoom(double factor)
+{
+	char label[16];
+
+	zoom = CLAMP(factor, 1.0, ZOOM_MAX);
+	if (zoom_button) {
+		snprintf(label, sizeof(label), "%gx", round(zoom * 10) / 10);
+		gtk_button_set_label(GTK_BUTTON(zoom_button), label);
+	}
+}
+
+static void
+set_low_light(int on)
+{
+	low_light = on;
+	if (!low_light) {
+		preview_accumulator_free(lowlight_accumulator);
+		lowlight_accumulator = NULL;
+	}
+	if (low_light_button && gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(low_light_button)) != on) {
+		gtk_toggle_button_set_active(GTK_TOGGLE_BUTTON(low_light_button), on);
+	}
+}
+
+void
+on_low_light_toggled(GtkWidget *widget, gpointer user_data)
+{
+	set_low_light(gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(widget)));
+}
+
+void
+on_zoom_clicked(GtkWidget *widget, gpointer user_data)
+{
+	set_zoom(zoom < 2 ? 2 : zoom < ZOOM_MAX ? ZOOM_MAX : 1);
+}
+
+static void
+zoom_gesture_begin(GtkGesture *gesture, GdkEventSequence *sequence, gpointer data)
+{
+	zoom_gesture_start = zoom;
+}
+
+static void
+zoom_gesture_scale(GtkGestureZoom *gesture, gdouble scale, gpointer data)
+{
+	set_zoom(zoom_gesture_start * scale);
+}
+
+static gboolean
+preview_scroll(GtkWidget *widget, GdkEventScroll *event, gpointer data)
+{
+	if (event->direction == GDK_SCROLL_UP) {
+		set_zoom(zoom * 1.25);
+	} else if (event->direction == GDK_SCROLL_DOWN) {
+		set_zoom(zoom / 1.25);
+	}
+	return TRUE;
+}
+
+// Grid of recent captures, straight from the thumbnail atlas. Only the
+// rows that are visible get drawn so it stays fast with thousands of them.
+#define GALLERY_CELL (GALLERY_THUMB_SIZE + 4)
+
+static int
+gallery_columns()
+{
+	return MAX(1, gtk_widget_get_allocated_width(gallery_view) / GALLERY_CELL);
+}
+
+static void
+gallery_layout()
+{
+	int columns = MAX(1, gtk_widget_get_allocated_width(gallery_scroll) / GALLERY_CELL);
+	int rows = (gallery_count() + columns - 1) / columns;
+	gtk_widget_set_size_request(gallery_view, -1, rows * GALLERY_CELL);
+}
+
+static gboolean
+gallery_draw(GtkWidget *widget, cairo_t *cr, gpointer data)
+{
+	double x1, y1, x2, y2;
+	int columns = gallery_columns();
+	int count = gallery_count();
+
+	cairo_clip_extents(cr, &x1, &y1, &x2, &y2);
+	int first = MAX(0, (int)(y1 / GALLERY_CELL)) * columns;
+	int last = MIN(count, ((int)(y2 / GALLERY_CELL) + 1) * columns);
+
+	for (int i = first; i < last; i++) {
+		const struct gallery_entry *entry = gallery_get(i);
+		cairo_surface_t *thumb = cairo_image_surface_create_for_data(gallery_pixels(i),
+			CAIRO_FORMAT_RGB24, entry->width, entry->height, GALLERY_THUMB_SIZE * 4);
+		double x = (i % columns) * GALLERY_CELL + (GALLERY_CELL - entry->width) / 2;
+		double y = (i / columns) * GALLERY_CELL + (GALLERY_CELL - entry->height) / 2;
+
+		cairo_set_source_surface(cr, thumb, x, y);
+		cairo_paint(cr);
+		cairo_surface_destroy(thumb);
+	}
+	return FALSE;
+}
+
+static gboolean
+gallery_press(GtkWidget *widget, GdkEventButton *event, gpointer data)
+{
+	char uri[270];
+	GError *error = NULL;
+	int column = event->x / GALLERY_CELL;
+	int index = (int)(event->y / GALLERY_CELL) * gallery_columns() + column;
+
+	if (column >= gallery_columns() || index >= gallery_count()) {
+		return FALSE;
+	}
+	sprintf(uri, "file://%s", gallery_get(index)->path);
+	if(!g_app_info_launch_default_for_uri(uri, NULL, &error)){
+		g_printerr("Could not launch image viewer: %s\n", error->message);
+		g_clear_error(&error);
+	}
+	return TRUE;
+}
+
+static void
+gallery_scroll_allocate(GtkWidget *widget, GdkRectangle *allocation, gpointer data)
+{
+	gallery_layout();
+}
+
+void
+on_gallery_btn_clicked(GtkWidget *widget, gpointer user_data)
+{
+	gallery_layout();
+	gtk_widget_queue_draw(gallery_view);
+	gtk_stack_set_visible_child_name(GTK_STACK(main_stack), "gallery");
 }
 
 void
@@ -999,6 +2635,31 @@ on_back_clicked(GtkWidget *widget, gpointer user_data)
 	gtk_stack_set_visible_child_name(GTK_STACK(main_stack), "main");
 }
 
+// The preview is only seen on the main page of a focused window that isn't
+// minimized
+static void
+main_stack_changed(GObject *stack, GParamSpec *pspec, gpointer data)
+{
+	const char *name = gtk_stack_get_visible_child_name(GTK_STACK(stack));
+	main_page_shown = name && strcmp(name, "main") == 0;
+	update_power();
+}
+
+static void
+window_active_changed(GObject *window, GParamSpec *pspec, gpointer data)
+{
+	window_active = gtk_window_is_active(GTK_WINDOW(window));
+	update_power();
+}
+
+static gboolean
+window_state_changed(GtkWidget *widget, GdkEventWindowState *event, gpointer data)
+{
+	window_iconified = (event->new_window_state & GDK_WINDOW_STATE_ICONIFIED) != 0;
+	update_power();
+	return FALSE;
+}
+
 int
 find_config(char *conffile)
 {
@@ -1109,24 +2770,641 @@ find_processor(char *script)
 	return -1;
 }
 
+// The media graph found by find_media_fd() and find_cameras() is the same
+// on every start for a given device and kernel, so it's cached
+struct topology {
+	char compatible[256];
+	char kernel[256];
+	char media[261];
+	char interface[260];
+	unsigned int interface_entity;
+	struct {
+		char driver[260];
+		unsigned int entity;
+		char dev[260];
+	} cameras[ARRAY_SIZE(cameras)];
+};
+
+static void
+topology_key(char *compatible, char *kernel)
+{
+	struct utsname uts;
+	FILE *fp;
+
+	strcpy(compatible, "unknown");
+	fp = fopen("/proc/device-tree/compatible", "r");
+	if (fp) {
+		fgets(compatible, 256, fp);
+		fclose(fp);
+	}
+
+	uname(&uts);
+	snprintf(kernel, 256, "%s %s", uts.release, uts.version);
+}
+
+static void
+topology_path(const char *compatible, char *path)
+{
+	char *xdg_cache_home;
+	wordexp_t exp_result;
+
+	if ((xdg_cache_home = getenv("XDG_CACHE_HOME")) == NULL) {
+		xdg_cache_home = "~/.cache";
+	}
+	wordexp(xdg_cache_home, &exp_result, 0);
+	sprintf(path, "%s/megapixels/topology-%s.ini", exp_result.we_wordv[0], compatible);
+	wordfree(&exp_result);
+}
+
+static int
+topology_ini_handler(void *user, const char *section, const char *name,
+	const char *value)
+{
+	struct topology *topology = user;
+
+	if (strcmp(section, "topology") == 0) {
+		if (strcmp(name, "compatible") == 0) {
+			snprintf(topology->compatible, sizeof(topology->compatible), "%s", value);
+		} else if (strcmp(name, "kernel") == 0) {
+			snprintf(topology->kernel, sizeof(topology->kernel), "%s", value);
+		} else if (strcmp(name, "media") == 0) {
+			snprintf(topology->media, sizeof(topology->media), "%s", value);
+		} else if (strcmp(name, "interface") == 0) {
+			snprintf(topology->interface, sizeof(topology->interface), "%s", value);
+		} else if (strcmp(name, "interface_entity") == 0) {
+			topology->interface_entity = strtoint(value, NULL, 10);
+		}
+	} else if (atoi(section) >= 0 && atoi(section) < ARRAY_SIZE(cameras)) {
+		int i = atoi(section);
+		if (strcmp(name, "driver") == 0) {
+			snprintf(topology->cameras[i].driver, sizeof(topology->cameras[i].driver), "%s", value);
+		} else if (strcmp(name, "entity") == 0) {
+			topology->cameras[i].entity = strtoint(value, NULL, 10);
+		} else if (strcmp(name, "dev") == 0) {
+			snprintf(topology->cameras[i].dev, sizeof(topology->cameras[i].dev), "%s", value);
+		}
+	}
+	return 1;
+}
+
+// Checks a cached entity with one ioctl and a stat() of its node instead of
+// walking the whole graph
+static int
+topology_entity_valid(unsigned int id, const char *name, const char *dev)
+{
+	struct media_entity_desc entity = {0};
+	struct stat info;
+
+	entity.id = id;
+	if (xioctl(media_fd, MEDIA_IOC_ENUM_ENTITIES, &entity) < 0) {
+		return 0;
+	}
+	if (name && strncmp(entity.name, name, strlen(name)) != 0) {
+		return 0;
+	}
+	if (!name && entity.type != MEDIA_ENT_F_IO_V4L) {
+		return 0;
+	}
+	if (stat(dev, &info) < 0 || !S_ISCHR(info.st_mode)) {
+		return 0;
+	}
+	return major(info.st_rdev) == entity.dev.major && minor(info.st_rdev) == entity.dev.minor;
+}
+
+// Replaces find_media_fd() and find_cameras() when the cache is still valid
+static int
+load_topology()
+{
+	struct topology topology = {0};
+	struct media_device_info mdi = {0};
+	char compatible[256];
+	char kernel[256];
+	char path[PATH_MAX];
+
+	topology_key(compatible, kernel);
+	topology_path(compatible, path);
+	if (ini_parse(path, topology_ini_handler, &topology) != 0) {
+		return -1;
+	}
+	if (strcmp(topology.compatible, compatible) != 0 || strcmp(topology.kernel, kernel) != 0) {
+		printf("Topology cache is for another device or kernel\n");
+		return -1;
+	}
+
+	media_fd = open(topology.media, O_RDWR);
+	if (media_fd < 0) {
+		return -1;
+	}
+	if (xioctl(media_fd, MEDIA_IOC_DEVICE_INFO, &mdi) < 0 ||
+		strcmp(mdi.driver, media_drv_name) != 0 ||
+		!topology_entity_valid(topology.interface_entity, NULL, topology.interface)) {
+		goto invalid;
+	}
+	for (int i = 0; i < ARRAY_SIZE(cameras); i++) {
+		if (cameras[i].valid == 0) {
+			continue;
+		}
+		if (strcmp(topology.cameras[i].driver, cameras[i].dev_name) != 0 ||
+			!topology_entity_valid(topology.cameras[i].entity,
+				cameras[i].dev_name, topology.cameras[i].dev)) {
+			goto invalid;
+		}
+	}
+
+	interface_entity_id = topology.interface_entity;
+	strcpy(dev_name, topology.interface);
+	for (int i = 0; i < ARRAY_SIZE(cameras); i++) {
+		if (cameras[i].valid == 0) {
+			continue;
+		}
+		cameras[i].entity_id = topology.cameras[i].entity;
+		strcpy(cameras[i].dev, topology.cameras[i].dev);
+		cameras[i].fd = open(cameras[i].dev, O_RDWR);
+	}
+	printf("Using cached topology from %s\n", path);
+	return 0;
+
+invalid:
+	printf("Topology cache is out of date\n");
+	close(media_fd);
+	return -1;
+}
+
+static void
+save_topology()
+{
+	struct media_device_info mdi = {0};
+	char compatible[256];
+	char kernel[256];
+	char path[PATH_MAX];
+	char tmp[PATH_MAX + 4];
+	char fnbuf[261];
+	FILE *fp;
+
+	// The media node path isn't kept by find_media_fd(), look it up again
+	// from the open fd
+	snprintf(path, sizeof(path), "/proc/self/fd/%d", media_fd);
+	ssize_t len = readlink(path, fnbuf, sizeof(fnbuf) - 1);
+	if (len < 0 || xioctl(media_fd, MEDIA_IOC_DEVICE_INFO, &mdi) < 0) {
+		return;
+	}
+	fnbuf[len] = '\0';
+
+	topology_key(compatible, kernel);
+	topology_path(compatible, path);
+	char *dir = g_path_get_dirname(path);
+	g_mkdir_with_parents(dir, 0755);
+	g_free(dir);
+
+	// Written next to the cache and renamed so a crash never leaves half a
+	// file behind
+	sprintf(tmp, "%s.tmp", path);
+	fp = fopen(tmp, "w");
+	if (!fp) {
+		return;
+	}
+	fprintf(fp, "[topology]\n");
+	fprintf(fp, "compatible=%s\n", compatible);
+	fprintf(fp, "kernel=%s\n", kernel);
+	fprintf(fp, "media=%s\n", fnbuf);
+	fprintf(fp, "interface=%s\n", dev_name);
+	fprintf(fp, "interface_entity=%u\n", interface_entity_id);
+	for (int i = 0; i < ARRAY_SIZE(cameras); i++) {
+		if (cameras[i].valid == 0 || cameras[i].dev[0] == '\0') {
+			continue;
+		}
+		fprintf(fp, "\n[%d]\n", i);
+		fprintf(fp, "driver=%s\n", cameras[i].dev_name);
+		fprintf(fp, "entity=%u\n", cameras[i].entity_id);
+		fprintf(fp, "dev=%s\n", cameras[i].dev);
+	}
+	if (fclose(fp) == 0) {
+		rename(tmp, path);
+	} else {
+		unlink(tmp);
+	}
+}
+
+// Probes the hardware and starts the stream while the main thread builds
+// the UI, so nothing in here may touch GTK. Returns an error message.
+static gpointer
+init_hardware(gpointer data)
+{
+	const char *error = NULL;
+
+	if (load_topology() == 0) {
+		/* Nothing to discover */
+	} else if (find_media_fd() == -1) {
+		error = "Could not find the media node";
+	} else if (find_cameras() == -1) {
+		error = "Could not find the cameras";
+	} else {
+		save_topology();
+	}
+
+	if (!error) {
+		setup_camera(0); /* Treat 0 as the default camera */
+
+		video_fd = open(dev_name, O_RDWR);
+		if (video_fd == -1) {
+			g_printerr("Error opening video device: %s\n", dev_name);
+			error = "Error opening the video device";
+		} else if (init_device(video_fd) < 0) {
+			error = "Could not set camera mode";
+		} else {
+			start_capturing(video_fd);
+		}
+	}
+
+	startup_hardware_ms = ms_since(&startup_start);
+	return (gpointer)error;
+}
+
+static int
+start_recording(const char *path)
+{
+	struct raw_video_header header = {0};
+
+	if (recording) {
+		return -1;
+	}
+	header.width = current.mode.width;
+	header.height = current.mode.height;
+	header.stride = current.stride;
+	header.pixelformat = current.mode.fmt;
+	header.layout = current.mode.layout;
+	header.cfa = current.mode.cfa;
+	header.rate = current.mode.rate;
+	header.frame_size = (uint64_t)current.stride * current.mode.height;
+	if (raw_video_open(&recorder, path, &header, RECORD_BUFFERS) < 0) {
+		g_printerr("Could not start recording to %s\n", path);
+		return -1;
+	}
+	recording = 1;
+	return 0;
+}
+
+static int
+stop_recording()
+{
+	if (!recording) {
+		return -1;
+	}
+	recording = 0;
+	return raw_video_close(&recorder);
+}
+
+static gboolean
+headless_record_done(gpointer data)
+{
+	int ret = stop_recording();
+	uint64_t lost = recorder.dropped + recorder.skipped;
+	if (ret < 0 || lost > 0 || recorder.frames == 0 ||
+		raw_video_check(headless_record_path) != (int64_t)recorder.frames) {
+		g_printerr("Recording to %s failed, %llu frames lost\n", headless_record_path,
+			(unsigned long long)lost);
+		headless_failed = 1;
+	}
+	g_main_loop_quit(main_loop);
+	return FALSE;
+}
+
+static int
+control_record(const char *path)
+{
+	if (!path) {
+		return stop_recording();
+	}
+	if (start_recording(path) < 0) {
+		return -1;
+	}
+	update_power();
+	return 0;
+}
+
+// Stands in for the sensor when running the pipeline without a camera,
+// a noise frame in the capture mode of the first camera
+static void
+init_synthetic()
+{
+	static const struct camera_mode fallback = {
+		2592, 1944, 15, V4L2_PIX_FMT_SBGGR8, MEDIA_BUS_FMT_SBGGR8_1X8, BAYER_BGGR, RAW_8
+	};
+	uint32_t state = 0x12345678;
+	size_t size;
+
+	if (cameras[0].valid) {
+		current = cameras[0];
+	} else {
+		current.capture_mode = fallback;
+	}
+	if (!exif_make) {
+		exif_make = strdup("Megapixels");
+		exif_model = strdup("Synthetic");
+	}
+	current.mode = current.capture_mode;
+	if (synthetic_rate > 0) {
+		current.mode.rate = synthetic_rate;
+	}
+	current.stride = raw_bytes_per_line(current.mode.layout, current.mode.width);
+	debayer = debayer_kernels_get(current.mode.cfa, current.mode.layout);
+	init_preview_color();
+
+	size = (size_t)current.stride * current.mode.height;
+	synthetic_frame = malloc(size);
+	for (size_t i = 0; i < size; i++) {
+		state ^= state << 13;
+		state ^= state >> 17;
+		state ^= state << 5;
+		synthetic_frame[i] = state;
+		// Keep unpacked samples within their bit depth
+		if ((current.mode.layout == RAW_10 || current.mode.layout == RAW_12) && (i & 1)) {
+			synthetic_frame[i] &= (1 << (raw_bits(current.mode.layout) - 8)) - 1;
+		}
+	}
+	printf("Synthetic %dx%d frames\n", current.mode.width, current.mode.height);
+}
+
+static gboolean
+get_synthetic_frame()
+{
+	struct timespec dequeued;
+	int burst_frame;
+
+	clock_gettime(CLOCK_MONOTONIC, &dequeued);
+	report_resume(&dequeued);
+	timelapse_frame(&dequeued);
+	burst_frame = capture > 0;
+	frame_timestamp = control_timestamp();
+	frame_sequence++;
+	process_image((const int *)synthetic_frame, current.stride * current.mode.height);
+	headless_frame_done(&dequeued, burst_frame);
+	timelapse_poll();
+	return TRUE;
+}
+
+static int
+run_headless()
+{
+	const char *error;
+
+	if (headless_synthetic) {
+		init_synthetic();
+		synthetic_source = g_timeout_add(1000 / MAX(current.mode.rate, 1),
+			(GSourceFunc)get_synthetic_frame, NULL);
+	} else {
+		// Stay in the capture mode, there is no preview to switch back to
+		for (int i = 0; i < ARRAY_SIZE(cameras); i++) {
+			cameras[i].preview_mode = cameras[i].capture_mode;
+		}
+		error = init_hardware(NULL);
+		if (error) {
+			g_printerr("%s\n", error);
+			return 1;
+		}
+		frame_source = g_idle_add((GSourceFunc)get_frame, NULL);
+	}
+
+	main_loop = g_main_loop_new(NULL, FALSE);
+	if (headless_record) {
+		snprintf(headless_record_path, sizeof(headless_record_path), "%s/recording.raw", headless_output);
+		g_mkdir_with_parents(headless_output, 0755);
+		if (start_recording(headless_record_path) < 0) {
+			return 1;
+		}
+		g_timeout_add_seconds(headless_record, headless_record_done, NULL);
+	} else if (timelapse_interval) {
+		timelapse_begin();
+	} else if (headless_bursts > 0) {
+		g_idle_add(headless_burst, NULL);
+	}
+	g_main_loop_run(main_loop);
+	stop_recording();
+	analyzers_stop();
+	stop_journal();
+	return headless_failed ? 1 : 0;
+}
+
+static int
+control_burst(int length)
+{
+	char template[] = "/tmp/megapixels.XXXXXX";
+	char dir[512];
+
+	if (capture > 0) {
+		return -1;
+	}
+
+	if (headless) {
+		snprintf(dir, sizeof(dir), "%s/burst%d", headless_output, ++headless_started);
+		if (g_mkdir_with_parents(dir, 0755) < 0) {
+			return -1;
+		}
+	} else {
+		if (mkdtemp(template) == NULL) {
+			return -1;
+		}
+		strcpy(dir, template);
+	}
+
+	start_burst(dir, length > 0 ? length : burst_length);
+	return burst_id;
+}
+
+static int
+control_switch()
+{
+	if (headless_synthetic || capture > 0) {
+		return -1;
+	}
+	on_camera_switch_clicked(NULL, NULL);
+	return active_camera;
+}
+
+static void
+control_stats(char *buf, size_t size)
+{
+	snprintf(buf, size, "camera=%d width=%d height=%d rate=%d frames=%lu bursts=%d "
+		"capturing=%d analyzer_drops=%lu recording=%d record_mbps=%.1f record_dropped=%llu "
+		"zoom=%.2f low_light=%d power=%s resume_ms=%.1f uptime_ms=%.0f",
+		active_camera, current.mode.width, current.mode.height, current.mode.rate,
+		frame_count, burst_count, capture, analyzers_dropped(), recording,
+		recording ? raw_video_rate(&recorder) : 0.0,
+		recording ? (unsigned long long)(recorder.dropped + recorder.skipped) : 0ull,
+		zoom, low_light, power_state_names[power_state], resume_ms, ms_since(&startup_start));
+}
+
+static int
+control_low_light(int on)
+{
+	set_low_light(on);
+	return 0;
+}
+
+static double
+control_zoom(double factor)
+{
+	set_zoom(factor);
+	return zoom;
+}
+
+static const struct control_handlers control_handlers = {
+	.burst = control_burst,
+	.switch_camera = control_switch,
+	.stats = control_stats,
+	.record = control_record,
+	.zoom = control_zoom,
+	.low_light = control_low_light,
+};
+
+static void
+usage(const char *name)
+{
+	printf("Usage: %s [--analyzer NAME] [--control [PATH]] [--writer io_uring|threads|libtiff] [--direct] [--no-journal] [--calibrate-shading FILE] [--calibrate-badpixels FILE] [--headless [--bursts N] [--interval MS] [--frames N] [--timelapse SECONDS] [--record SECONDS] [--output DIR] [--synthetic [--rate FPS]]]\n", name);
+}
+
 int
 main(int argc, char *argv[])
 {
 	int ret;
 	char conffile[512];
+	const char *error;
+
+	const char *control_path = NULL;
+	char default_control_path[PATH_MAX];
+
+	clock_gettime(CLOCK_MONOTONIC, &startup_start);
+
+	// Anything else is left for gtk_init
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--headless") == 0) {
+			headless = 1;
+		} else if (strcmp(argv[i], "--synthetic") == 0) {
+			headless_synthetic = 1;
+		} else if (strcmp(argv[i], "--bursts") == 0 && i + 1 < argc) {
+			headless_bursts = MAX(strtoint(argv[++i], NULL, 10), 0);
+		} else if (strcmp(argv[i], "--interval") == 0 && i + 1 < argc) {
+			headless_interval = MAX(strtoint(argv[++i], NULL, 10), 0);
+		} else if (strcmp(argv[i], "--frames") == 0 && i + 1 < argc) {
+			burst_length = MAX(strtoint(argv[++i], NULL, 10), 1);
+		} else if (strcmp(argv[i], "--timelapse") == 0 && i + 1 < argc) {
+			timelapse_interval = MAX(strtoint(argv[++i], NULL, 10), 1) * 1000;
+			headless = 1;
+		} else if (strcmp(argv[i], "--record") == 0 && i + 1 < argc) {
+			headless_record = MAX(strtoint(argv[++i], NULL, 10), 1);
+		} else if (strcmp(argv[i], "--rate") == 0 && i + 1 < argc) {
+			synthetic_rate = MAX(strtoint(argv[++i], NULL, 10), 1);
+		} else if (strcmp(argv[i], "--output") == 0 && i + 1 < argc) {
+			headless_output = argv[++i];
+		} else if (strcmp(argv[i], "--analyzer") == 0 && i + 1 < argc) {
+			if (analyzer_start(argv[++i]) < 0) {
+				g_printerr("Unknown analyzer %s\n", argv[i]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--writer") == 0 && i + 1 < argc) {
+			i++;
+			if (strcmp(argv[i], "io_uring") == 0) {
+				output_writer = OUTPUT_IO_URING;
+			} else if (strcmp(argv[i], "threads") == 0) {
+				output_writer = OUTPUT_THREADS;
+			} else if (strcmp(argv[i], "libtiff") == 0) {
+				output_writer = OUTPUT_LIBTIFF;
+			} else {
+				usage(argv[0]);
+				return 1;
+			}
+		} else if (strcmp(argv[i], "--direct") == 0) {
+			output_direct_io = 1;
+		} else if (strcmp(argv[i], "--no-journal") == 0) {
+			use_journal = 0;
+		} else if (strcmp(argv[i], "--calibrate-shading") == 0 && i + 1 < argc) {
+			calibrate_shading = argv[++i];
+			headless = 1;
+			headless_bursts = 1;
+		} else if (strcmp(argv[i], "--calibrate-badpixels") == 0 && i + 1 < argc) {
+			calibrate_badpixels = argv[++i];
+			headless = 1;
+			headless_bursts = 1;
+		} else if (strcmp(argv[i], "--control") == 0) {
+			control_path = "";
+			if (i + 1 < argc && argv[i + 1][0] != '-') {
+				control_path = argv[++i];
+			}
+		} else if (strcmp(argv[i], "--help") == 0) {
+			usage(argv[0]);
+			return 0;
+		}
+	}
+	// A flat field and a dark frame can't be the same burst
+	if ((headless_synthetic && !headless) || (calibrate_shading && calibrate_badpixels)) {
+		usage(argv[0]);
+		return 1;
+	}
+	if (calibrate_shading) {
+		shading_calibration = shading_grid_new(SHADING_CALIBRATION_COLS, SHADING_CALIBRATION_ROWS);
+	}
+	output_init(output_writer, output_direct_io);
+
+	// Journals of sessions that crashed keep their reserved space
+	char journal_dir[PATH_MAX];
+	snprintf(journal_dir, sizeof(journal_dir), "%s/megapixels", g_get_user_cache_dir());
+	journal_remove_stale(journal_dir);
 
 	ret = find_config(conffile);
-	if (ret) {
+	if (ret && !headless_synthetic) {
 		g_printerr("Could not find any config file\n");
 		return ret;
 	}
-	ret = find_processor(processing_script);
-	if (ret) {
+	// Headless bursts are left as DNG files
+	if (find_processor(processing_script) && !headless) {
 		g_printerr("Could not find any post-process script\n");
-		return ret;
+		return 1;
+	}
+
+	dng_init();
+
+	int result = ret ? 0 : ini_parse(conffile, config_ini_handler, conffile);
+	if (result == -1) {
+		g_printerr("Config file not found\n");
+		return 1;
+	} else if (result == -2) {
+		g_printerr("Could not allocate memory to parse config file\n");
+		return 1;
+	} else if (result != 0) {
+		g_printerr("Could not parse config file\n");
+		return 1;
+	}
+	for (int i = 0; i < ARRAY_SIZE(cameras); i++) {
+		if (cameras[i].valid) {
+			resolve_preview_mode(&cameras[i]);
+		}
+		// Expanded once for the capture mode, every burst frame uses it
+		if (cameras[i].valid && cameras[i].shading && !cameras[i].shading_opcodes) {
+			cameras[i].shading_table = shading_table(cameras[i].shading,
+				cameras[i].capture_mode.cfa, cameras[i].capture_mode.width,
+				cameras[i].capture_mode.height);
+		}
+	}
+	startup_config_ms = ms_since(&startup_start);
+
+	if (control_path) {
+		if (control_path[0] == '\0') {
+			// Default to the per user runtime dir
+			snprintf(default_control_path, sizeof(default_control_path),
+				"%s/megapixels.sock", g_get_user_runtime_dir());
+			control_path = default_control_path;
+		}
+		if (control_init(control_path, &control_handlers) < 0) {
+			g_printerr("Could not create control socket %s\n", control_path);
+			return 1;
+		}
+	}
+
+	if (headless) {
+		return run_headless();
 	}
 
-	TIFFSetTagExtender(register_custom_tiff_tags);
+	GThread *hardware = g_thread_new("init", init_hardware, NULL);
 
 	gtk_init(&argc, &argv);
 	g_object_set(gtk_settings_get_default(), "gtk-application-prefer-dark-theme", TRUE, NULL);
@@ -1141,21 +3419,43 @@ main(int argc, char *argv[])
 	GtkWidget *error_close = GTK_WIDGET(gtk_builder_get_object(builder, "error_close"));
 	GtkWidget *open_last = GTK_WIDGET(gtk_builder_get_object(builder, "open_last"));
 	GtkWidget *open_directory = GTK_WIDGET(gtk_builder_get_object(builder, "open_directory"));
+	GtkWidget *gallery_back = GTK_WIDGET(gtk_builder_get_object(builder, "gallery_back"));
+	GtkWidget *gallery_open_directory = GTK_WIDGET(gtk_builder_get_object(builder, "gallery_open_directory"));
 	preview = GTK_WIDGET(gtk_builder_get_object(builder, "preview"));
 	error_box = GTK_WIDGET(gtk_builder_get_object(builder, "error_box"));
 	error_message = GTK_WIDGET(gtk_builder_get_object(builder, "error_message"));
 	main_stack = GTK_WIDGET(gtk_builder_get_object(builder, "main_stack"));
 	thumb_last = GTK_WIDGET(gtk_builder_get_object(builder, "thumb_last"));
+	gallery_view = GTK_WIDGET(gtk_builder_get_object(builder, "gallery"));
+	gallery_scroll = GTK_WIDGET(gtk_builder_get_object(builder, "gallery_scroll"));
+	zoom_button = GTK_WIDGET(gtk_builder_get_object(builder, "zoom"));
+	low_light_button = GTK_WIDGET(gtk_builder_get_object(builder, "low_light"));
 	g_signal_connect(window, "destroy", G_CALLBACK(gtk_main_quit), NULL);
+	g_signal_connect(window, "notify::is-active", G_CALLBACK(window_active_changed), NULL);
+	g_signal_connect(window, "window-state-event", G_CALLBACK(window_state_changed), NULL);
+	g_signal_connect(main_stack, "notify::visible-child-name", G_CALLBACK(main_stack_changed), NULL);
 	g_signal_connect(shutter, "clicked", G_CALLBACK(on_shutter_clicked), NULL);
 	g_signal_connect(error_close, "clicked", G_CALLBACK(on_error_close_clicked), NULL);
 	g_signal_connect(switch_btn, "clicked", G_CALLBACK(on_camera_switch_clicked), NULL);
+	g_signal_connect(zoom_button, "clicked", G_CALLBACK(on_zoom_clicked), NULL);
+	g_signal_connect(low_light_button, "toggled", G_CALLBACK(on_low_light_toggled), NULL);
 	g_signal_connect(settings_btn, "clicked", G_CALLBACK(on_settings_btn_clicked), NULL);
 	g_signal_connect(settings_back, "clicked", G_CALLBACK(on_back_clicked), NULL);
 	g_signal_connect(open_last, "clicked", G_CALLBACK(on_open_last_clicked), NULL);
-	g_signal_connect(open_directory, "clicked", G_CALLBACK(on_open_directory_clicked), NULL);
+	g_signal_connect(open_directory, "clicked", G_CALLBACK(on_gallery_btn_clicked), NULL);
+	g_signal_connect(gallery_back, "clicked", G_CALLBACK(on_back_clicked), NULL);
+	g_signal_connect(gallery_open_directory, "clicked", G_CALLBACK(on_open_directory_clicked), NULL);
+	gtk_widget_add_events(gallery_view, GDK_BUTTON_PRESS_MASK);
+	g_signal_connect(gallery_view, "draw", G_CALLBACK(gallery_draw), NULL);
+	g_signal_connect(gallery_view, "button-press-event", G_CALLBACK(gallery_press), NULL);
+	g_signal_connect(gallery_scroll, "size-allocate", G_CALLBACK(gallery_scroll_allocate), NULL);
 	g_signal_connect(preview, "draw", G_CALLBACK(preview_draw), NULL);
 	g_signal_connect(preview, "configure-event", G_CALLBACK(preview_configure), NULL);
+	gtk_widget_add_events(preview, GDK_SCROLL_MASK | GDK_TOUCH_MASK);
+	g_signal_connect(preview, "scroll-event", G_CALLBACK(preview_scroll), NULL);
+	zoom_gesture = gtk_gesture_zoom_new(preview);
+	g_signal_connect(zoom_gesture, "begin", G_CALLBACK(zoom_gesture_begin), NULL);
+	g_signal_connect(zoom_gesture, "scale-changed", G_CALLBACK(zoom_gesture_scale), NULL);
 
 	GtkCssProvider *provider = gtk_css_provider_new();
 	if (access("camera.css", F_OK) != -1) {
@@ -1172,47 +3472,30 @@ main(int argc, char *argv[])
 		GTK_STYLE_PROVIDER(provider),
 		GTK_STYLE_PROVIDER_PRIORITY_USER);
 
-	int result = ini_parse(conffile, config_ini_handler, NULL);
-	if (result == -1) {
-		g_printerr("Config file not found\n");
-		return 1;
-	} else if (result == -2) {
-		g_printerr("Could not allocate memory to parse config file\n");
-		return 1;
-	} else if (result != 0) {
-		g_printerr("Could not parse config file\n");
-		return 1;
-	}
-	if (find_media_fd() == -1) {
-		g_printerr("Could not find the media node\n");
-		show_error("Could not find the media node");
-		goto failed;
-	}
-	if (find_cameras() == -1) {
-		g_printerr("Could not find the cameras\n");
-		show_error("Could not find the cameras");
-		goto failed;
-	}
-	setup_camera(0); /* Treat 0 as the default camera */
+	startup_ui_ms = ms_since(&startup_start);
 
-	int fd = open(dev_name, O_RDWR);
-	if (fd == -1) {
-		g_printerr("Error opening video device: %s\n", dev_name);
-		show_error("Error opening the video device");
-		goto failed;
+	error = g_thread_join(hardware);
+	startup_ready_ms = ms_since(&startup_start);
+	if (error) {
+		g_printerr("%s\n", error);
+		show_error(error);
 	}
 
-	video_fd = fd;
-
-	if(init_device(fd) < 0){
-		goto failed;
+	char gallery_path[PATH_MAX];
+	snprintf(gallery_path, sizeof(gallery_path), "%s/megapixels", g_get_user_cache_dir());
+	g_mkdir_with_parents(gallery_path, 0755);
+	strncat(gallery_path, "/thumbnails.atlas", sizeof(gallery_path) - strlen(gallery_path) - 1);
+	if (gallery_open(gallery_path) < 0) {
+		g_printerr("Could not open thumbnail cache %s\n", gallery_path);
 	}
-	start_capturing(fd);
 
-failed:
 	printf("window show\n");
 	gtk_widget_show(window);
-	g_idle_add((GSourceFunc)get_frame, NULL);
+	frame_source = g_idle_add((GSourceFunc)get_frame, NULL);
 	gtk_main();
+	stop_recording();
+	analyzers_stop();
+	stop_journal();
+	gallery_close();
 	return 0;
 }
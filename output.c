@@ -0,0 +1,624 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <linux/io_uring.h>
+#include <glib.h>
+#include "output.h"
+
+// Files are built in memory in chunks of this size. The chunks are page
+// aligned and the file is padded to a whole page so it can be written with
+// O_DIRECT without another copy.
+#define CHUNK_SIZE (1024 * 1024)
+#define PAGE_ALIGN 4096
+#define WORKER_THREADS 2
+#define RING_ENTRIES 64
+
+struct membuf {
+	char path[512];
+	uint8_t **chunks;
+	int chunk_count;
+	uint64_t size;
+	uint64_t pos;
+
+	int fd;
+	int direct;
+	struct iovec *iov;
+	int iov_count;
+	uint64_t written;
+	int error;
+	struct membuf *next;
+};
+
+static enum output_backend output_backend = OUTPUT_LIBTIFF;
+static int output_direct = 0;
+
+// Files waiting for a worker, and files written but not synced yet
+static struct membuf *queue_head = NULL;
+static struct membuf *queue_tail = NULL;
+static struct membuf *written = NULL;
+static int in_flight = 0;
+static pthread_mutex_t queue_lock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t queue_work = PTHREAD_COND_INITIALIZER;
+static pthread_cond_t queue_idle = PTHREAD_COND_INITIALIZER;
+static pthread_t workers[WORKER_THREADS];
+
+struct ring {
+	int fd;
+	void *sq_ptr;
+	void *cq_ptr;
+	size_t sq_size;
+	size_t cq_size;
+	unsigned *sq_head;
+	unsigned *sq_tail;
+	unsigned *sq_mask;
+	unsigned *sq_array;
+	unsigned *cq_head;
+	unsigned *cq_tail;
+	unsigned *cq_mask;
+	struct io_uring_sqe *sqes;
+	struct io_uring_cqe *cqes;
+	unsigned queued;
+	unsigned pending;
+};
+
+static struct ring ring = {.fd = -1};
+
+static void
+membuf_free(struct membuf *buf)
+{
+	for (int i = 0; i < buf->chunk_count; i++) {
+		free(buf->chunks[i]);
+	}
+	free(buf->chunks);
+	free(buf->iov);
+	free(buf);
+}
+
+static int
+membuf_reserve(struct membuf *buf, uint64_t size)
+{
+	int needed = (size + CHUNK_SIZE - 1) / CHUNK_SIZE;
+
+	if (needed <= buf->chunk_count) {
+		return 0;
+	}
+	uint8_t **chunks = realloc(buf->chunks, needed * sizeof(*chunks));
+	if (!chunks) {
+		return -1;
+	}
+	buf->chunks = chunks;
+	while (buf->chunk_count < needed) {
+		uint8_t *chunk = aligned_alloc(PAGE_ALIGN, CHUNK_SIZE);
+		if (!chunk) {
+			return -1;
+		}
+		// libtiff seeks past the end and expects the gap to read as zeros
+		memset(chunk, 0, CHUNK_SIZE);
+		buf->chunks[buf->chunk_count++] = chunk;
+	}
+	return 0;
+}
+
+static tmsize_t
+membuf_read(thandle_t handle, void *data, tmsize_t size)
+{
+	struct membuf *buf = handle;
+	uint8_t *p = data;
+	tmsize_t done = 0;
+
+	if (buf->pos >= buf->size) {
+		return 0;
+	}
+	if ((uint64_t)size > buf->size - buf->pos) {
+		size = buf->size - buf->pos;
+	}
+	while (done < size) {
+		uint64_t offset = buf->pos % CHUNK_SIZE;
+		uint64_t count = CHUNK_SIZE - offset;
+		if (count > (uint64_t)(size - done)) {
+			count = size - done;
+		}
+		memcpy(p + done, buf->chunks[buf->pos / CHUNK_SIZE] + offset, count);
+		done += count;
+		buf->pos += count;
+	}
+	return done;
+}
+
+static tmsize_t
+membuf_write(thandle_t handle, void *data, tmsize_t size)
+{
+	struct membuf *buf = handle;
+	const uint8_t *p = data;
+	tmsize_t done = 0;
+
+	if (membuf_reserve(buf, buf->pos + size) < 0) {
+		return -1;
+	}
+	while (done < size) {
+		uint64_t offset = buf->pos % CHUNK_SIZE;
+		uint64_t count = CHUNK_SIZE - offset;
+		if (count > (uint64_t)(size - done)) {
+			count = size - done;
+		}
+		memcpy(buf->chunks[buf->pos / CHUNK_SIZE] + offset, p + done, count);
+		done += count;
+		buf->pos += count;
+	}
+	if (buf->pos > buf->size) {
+		buf->size = buf->pos;
+	}
+	return done;
+}
+
+static toff_t
+membuf_seek(thandle_t handle, toff_t offset, int whence)
+{
+	struct membuf *buf = handle;
+	uint64_t pos;
+
+	switch (whence) {
+		case SEEK_SET:
+			pos = offset;
+			break;
+		case SEEK_CUR:
+			pos = buf->pos + offset;
+			break;
+		case SEEK_END:
+			pos = buf->size + offset;
+			break;
+		default:
+			return -1;
+	}
+	if (membuf_reserve(buf, pos) < 0) {
+		return -1;
+	}
+	buf->pos = pos;
+	return pos;
+}
+
+static toff_t
+membuf_size(thandle_t handle)
+{
+	struct membuf *buf = handle;
+	return buf->size;
+}
+
+static int
+membuf_map(thandle_t handle, void **base, toff_t *size)
+{
+	return 0;
+}
+
+static void
+membuf_unmap(thandle_t handle, void *base, toff_t size)
+{
+}
+
+// Opens the target file and describes the whole buffer as one iovec list
+static int
+membuf_prepare(struct membuf *buf)
+{
+	uint64_t length = buf->size;
+
+	buf->fd = -1;
+	if (output_direct) {
+		buf->fd = open(buf->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC | O_DIRECT, 0644);
+		// tmpfs and some others refuse O_DIRECT, write those normally
+		buf->direct = buf->fd >= 0;
+	}
+	if (buf->fd < 0) {
+		buf->fd = open(buf->path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	}
+	if (buf->fd < 0) {
+		g_printerr("Could not open %s: %s\n", buf->path, strerror(errno));
+		return -1;
+	}
+
+	// O_DIRECT needs whole blocks, the padding is cut off again afterwards
+	if (buf->direct) {
+		length = (length + PAGE_ALIGN - 1) / PAGE_ALIGN * PAGE_ALIGN;
+	}
+	buf->iov_count = (length + CHUNK_SIZE - 1) / CHUNK_SIZE;
+	buf->iov = calloc(buf->iov_count ? buf->iov_count : 1, sizeof(*buf->iov));
+	if (!buf->iov) {
+		return -1;
+	}
+	for (int i = 0; i < buf->iov_count; i++) {
+		buf->iov[i].iov_base = buf->chunks[i];
+		buf->iov[i].iov_len = length - (uint64_t)i * CHUNK_SIZE > CHUNK_SIZE ?
+			CHUNK_SIZE : length - (uint64_t)i * CHUNK_SIZE;
+	}
+	return 0;
+}
+
+// Writes whatever part of the iovec list hasn't been written yet
+static int
+membuf_write_rest(struct membuf *buf)
+{
+	uint64_t total = 0;
+
+	for (int i = 0; i < buf->iov_count; i++) {
+		total += buf->iov[i].iov_len;
+	}
+	while (buf->written < total) {
+		uint64_t skip = buf->written;
+		int first = 0;
+		while (skip >= buf->iov[first].iov_len) {
+			skip -= buf->iov[first++].iov_len;
+		}
+		struct iovec head = buf->iov[first];
+		buf->iov[first].iov_base = (uint8_t *)buf->iov[first].iov_base + skip;
+		buf->iov[first].iov_len -= skip;
+
+		int count = buf->iov_count - first;
+		ssize_t ret = pwritev(buf->fd, buf->iov + first, count > IOV_MAX ? IOV_MAX : count,
+			buf->written);
+		buf->iov[first] = head;
+		if (ret < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		buf->written += ret;
+	}
+	return 0;
+}
+
+static void
+membuf_finish(struct membuf *buf)
+{
+	if (!buf->error && buf->direct && ftruncate(buf->fd, buf->size) < 0) {
+		buf->error = 1;
+	}
+	if (buf->error) {
+		g_printerr("Could not write %s: %s\n", buf->path, strerror(errno));
+	}
+}
+
+static void *
+worker_run(void *data)
+{
+	pthread_mutex_lock(&queue_lock);
+	while (1) {
+		while (!queue_head) {
+			pthread_cond_wait(&queue_work, &queue_lock);
+		}
+		struct membuf *buf = queue_head;
+		queue_head = buf->next;
+		if (!queue_head) {
+			queue_tail = NULL;
+		}
+		pthread_mutex_unlock(&queue_lock);
+
+		buf->error = membuf_write_rest(buf) < 0;
+		membuf_finish(buf);
+
+		pthread_mutex_lock(&queue_lock);
+		buf->next = written;
+		written = buf;
+		if (--in_flight == 0) {
+			pthread_cond_signal(&queue_idle);
+		}
+	}
+	return NULL;
+}
+
+static int
+ring_setup()
+{
+	struct io_uring_params params = {0};
+
+	ring.fd = syscall(__NR_io_uring_setup, RING_ENTRIES, &params);
+	if (ring.fd < 0) {
+		return -1;
+	}
+
+	ring.sq_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+	ring.cq_size = params.cq_off.cqes + params.cq_entries * sizeof(struct io_uring_cqe);
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		if (ring.cq_size > ring.sq_size) {
+			ring.sq_size = ring.cq_size;
+		}
+		ring.cq_size = ring.sq_size;
+	}
+	ring.sq_ptr = mmap(NULL, ring.sq_size, PROT_READ | PROT_WRITE,
+		MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQ_RING);
+	if (ring.sq_ptr == MAP_FAILED) {
+		goto fail;
+	}
+	if (params.features & IORING_FEAT_SINGLE_MMAP) {
+		ring.cq_ptr = ring.sq_ptr;
+	} else {
+		ring.cq_ptr = mmap(NULL, ring.cq_size, PROT_READ | PROT_WRITE,
+			MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_CQ_RING);
+		if (ring.cq_ptr == MAP_FAILED) {
+			goto fail;
+		}
+	}
+	ring.sqes = mmap(NULL, params.sq_entries * sizeof(struct io_uring_sqe),
+		PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, ring.fd, IORING_OFF_SQES);
+	if (ring.sqes == MAP_FAILED) {
+		goto fail;
+	}
+
+	ring.sq_head = (unsigned *)((uint8_t *)ring.sq_ptr + params.sq_off.head);
+	ring.sq_tail = (unsigned *)((uint8_t *)ring.sq_ptr + params.sq_off.tail);
+	ring.sq_mask = (unsigned *)((uint8_t *)ring.sq_ptr + params.sq_off.ring_mask);
+	ring.sq_array = (unsigned *)((uint8_t *)ring.sq_ptr + params.sq_off.array);
+	ring.cq_head = (unsigned *)((uint8_t *)ring.cq_ptr + params.cq_off.head);
+	ring.cq_tail = (unsigned *)((uint8_t *)ring.cq_ptr + params.cq_off.tail);
+	ring.cq_mask = (unsigned *)((uint8_t *)ring.cq_ptr + params.cq_off.ring_mask);
+	ring.cqes = (struct io_uring_cqe *)((uint8_t *)ring.cq_ptr + params.cq_off.cqes);
+	return 0;
+
+fail:
+	// The process falls back to the worker threads, the mappings that did
+	// succeed go away with the ring fd
+	close(ring.fd);
+	ring.fd = -1;
+	return -1;
+}
+
+static struct io_uring_sqe *
+ring_get_sqe()
+{
+	unsigned tail = *ring.sq_tail;
+	unsigned head = __atomic_load_n(ring.sq_head, __ATOMIC_ACQUIRE);
+
+	if (tail - head >= RING_ENTRIES) {
+		return NULL;
+	}
+	unsigned index = tail & *ring.sq_mask;
+	struct io_uring_sqe *sqe = &ring.sqes[index];
+	memset(sqe, 0, sizeof(*sqe));
+	ring.sq_array[index] = index;
+	__atomic_store_n(ring.sq_tail, tail + 1, __ATOMIC_RELEASE);
+	ring.queued++;
+	return sqe;
+}
+
+// Submits everything queued and waits for at least min_complete results
+static int
+ring_enter(unsigned min_complete)
+{
+	int ret;
+
+	do {
+		ret = syscall(__NR_io_uring_enter, ring.fd, ring.queued, min_complete,
+			min_complete ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+	} while (ret < 0 && errno == EINTR);
+	if (ret >= 0) {
+		ring.pending += ret;
+		ring.queued -= ret;
+	}
+	return ret;
+}
+
+static void
+ring_reap(void (*complete)(struct membuf *buf, int res))
+{
+	unsigned head = *ring.cq_head;
+
+	while (head != __atomic_load_n(ring.cq_tail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &ring.cqes[head & *ring.cq_mask];
+		complete((struct membuf *)(uintptr_t)cqe->user_data, cqe->res);
+		head++;
+		ring.pending--;
+	}
+	__atomic_store_n(ring.cq_head, head, __ATOMIC_RELEASE);
+}
+
+// Waits for everything in the ring to complete
+static void
+ring_wait(void (*complete)(struct membuf *buf, int res))
+{
+	while (ring.pending > 0 || ring.queued > 0) {
+		if (ring_enter(1) < 0) {
+			g_printerr("io_uring_enter failed: %s\n", strerror(errno));
+			return;
+		}
+		ring_reap(complete);
+	}
+}
+
+static void
+ring_write_done(struct membuf *buf, int res)
+{
+	if (res < 0) {
+		errno = -res;
+		buf->error = 1;
+	} else {
+		// Short writes are rare, finish those synchronously
+		buf->written = res;
+		buf->error = membuf_write_rest(buf) < 0;
+	}
+	membuf_finish(buf);
+	buf->next = written;
+	written = buf;
+}
+
+static void
+ring_sync_done(struct membuf *buf, int res)
+{
+	if (res < 0) {
+		g_printerr("Could not sync %s: %s\n", buf->path, strerror(-res));
+		buf->error = 1;
+	}
+}
+
+static void
+ring_submit(struct membuf *buf)
+{
+	struct io_uring_sqe *sqe;
+
+	while (!(sqe = ring_get_sqe())) {
+		ring_enter(1);
+		ring_reap(ring_write_done);
+	}
+	sqe->opcode = IORING_OP_WRITEV;
+	sqe->fd = buf->fd;
+	sqe->addr = (uintptr_t)buf->iov;
+	sqe->len = buf->iov_count > IOV_MAX ? IOV_MAX : buf->iov_count;
+	sqe->off = 0;
+	sqe->user_data = (uintptr_t)buf;
+
+	// Hand it to the kernel right away so the write overlaps with
+	// building the next frame
+	ring_enter(0);
+	ring_reap(ring_write_done);
+}
+
+static int
+membuf_close(thandle_t handle)
+{
+	struct membuf *buf = handle;
+
+	if (membuf_prepare(buf) < 0) {
+		if (buf->fd >= 0) {
+			close(buf->fd);
+		}
+		membuf_free(buf);
+		return -1;
+	}
+
+	if (output_backend == OUTPUT_IO_URING) {
+		ring_submit(buf);
+		return 0;
+	}
+
+	pthread_mutex_lock(&queue_lock);
+	buf->next = NULL;
+	if (queue_tail) {
+		queue_tail->next = buf;
+	} else {
+		queue_head = buf;
+	}
+	queue_tail = buf;
+	in_flight++;
+	pthread_cond_signal(&queue_work);
+	pthread_mutex_unlock(&queue_lock);
+	return 0;
+}
+
+enum output_backend
+output_init(enum output_backend backend, int direct)
+{
+	output_direct = direct;
+
+	if (backend == OUTPUT_IO_URING && ring_setup() < 0) {
+		g_printerr("io_uring not available, writing with threads\n");
+		backend = OUTPUT_THREADS;
+	}
+	if (backend == OUTPUT_THREADS) {
+		for (int i = 0; i < WORKER_THREADS; i++) {
+			pthread_create(&workers[i], NULL, worker_run, NULL);
+		}
+	}
+	output_backend = backend;
+	return backend;
+}
+
+const char *
+output_backend_name()
+{
+	switch (output_backend) {
+		case OUTPUT_THREADS:
+			return "threads";
+		case OUTPUT_IO_URING:
+			return "io_uring";
+		default:
+			return "libtiff";
+	}
+}
+
+TIFF *
+output_tiff_open(const char *path)
+{
+	if (output_backend == OUTPUT_LIBTIFF) {
+		return TIFFOpen(path, "w");
+	}
+
+	struct membuf *buf = calloc(1, sizeof(struct membuf));
+	if (!buf) {
+		return NULL;
+	}
+	snprintf(buf->path, sizeof(buf->path), "%s", path);
+	buf->fd = -1;
+
+	TIFF *tif = TIFFClientOpen(path, "w", buf, membuf_read, membuf_write, membuf_seek,
+		membuf_close, membuf_size, membuf_map, membuf_unmap);
+	if (!tif) {
+		membuf_free(buf);
+	}
+	return tif;
+}
+
+int
+output_flush()
+{
+	struct membuf *done;
+	int failed = 0;
+
+	if (output_backend == OUTPUT_LIBTIFF) {
+		return 0;
+	}
+
+	if (output_backend == OUTPUT_IO_URING) {
+		ring_wait(ring_write_done);
+		done = written;
+		written = NULL;
+
+		// One datasync per file, but all submitted in one go so the
+		// filesystem can commit them together
+		for (struct membuf *buf = done; buf; buf = buf->next) {
+			if (buf->error) {
+				continue;
+			}
+			struct io_uring_sqe *sqe;
+			while (!(sqe = ring_get_sqe())) {
+				ring_enter(1);
+				ring_reap(ring_sync_done);
+			}
+			sqe->opcode = IORING_OP_FSYNC;
+			sqe->fd = buf->fd;
+			sqe->fsync_flags = IORING_FSYNC_DATASYNC;
+			sqe->user_data = (uintptr_t)buf;
+		}
+		ring_wait(ring_sync_done);
+	} else {
+		pthread_mutex_lock(&queue_lock);
+		while (in_flight > 0) {
+			pthread_cond_wait(&queue_idle, &queue_lock);
+		}
+		done = written;
+		written = NULL;
+		pthread_mutex_unlock(&queue_lock);
+
+		for (struct membuf *buf = done; buf; buf = buf->next) {
+			if (!buf->error && fdatasync(buf->fd) < 0) {
+				g_printerr("Could not sync %s: %s\n", buf->path, strerror(errno));
+				buf->error = 1;
+			}
+		}
+	}
+
+	while (done) {
+		struct membuf *next = done->next;
+		failed += done->error;
+		close(done->fd);
+		membuf_free(done);
+		done = next;
+	}
+	return failed;
+}
@@ -0,0 +1,29 @@
+#ifndef OUTPUT_H
+#define OUTPUT_H
+
+#include <tiffio.h>
+
+// How finished DNG files get to the disk
+enum output_backend {
+	// libtiff writes straight to the file with buffered write() calls
+	OUTPUT_LIBTIFF,
+	// DNGs are built in memory and written with pwritev by worker threads
+	OUTPUT_THREADS,
+	// DNGs are built in memory and written through io_uring
+	OUTPUT_IO_URING,
+};
+
+// Falls back to OUTPUT_THREADS when io_uring isn't available. With direct
+// the files are opened with O_DIRECT where the filesystem allows it.
+enum output_backend output_init(enum output_backend backend, int direct);
+const char *output_backend_name();
+
+// Drop-in for TIFFOpen(path, "w"), the file is queued for writing when
+// TIFFClose is called on it
+TIFF *output_tiff_open(const char *path);
+
+// Waits until every queued file is written and synced to disk, the syncs
+// are batched instead of done per file. Returns the number of failed files.
+int output_flush();
+
+#endif
@@ -10,6 +10,15 @@
 #
 # The post-processing script is responsible for cleaning up
 # temporary directory for the burst.
+#
+# Megapixels already wrote a quick preview to the target name with a .jpg
+# extension. Replace it in one step with mv so it's never missing or half
+# written.
+#
+# When the picture was zoomed MEGAPIXELS_CROP is the part of the frame that
+# was shown, as WIDTHxHEIGHT+X+Y in sensor pixels. The DNG only records it
+# as DefaultCrop, which dcraw ignores, so the converted picture is cropped
+# here to match the preview.
 
 if [ "$#" -ne 2 ]; then
 	echo "Usage: $0 [burst-dir] [target-name]"
@@ -44,7 +53,12 @@ if [ -n "$DCRAW" ]; then
 
 	if command -v convert &> /dev/null
 	then
-		convert "$BURST_DIR"/1.dng.tiff "$TARGET_NAME.jpg"
+		CROP=""
+		if [ -n "$MEGAPIXELS_CROP" ]; then
+			CROP="-crop $MEGAPIXELS_CROP +repage"
+		fi
+		convert "$BURST_DIR"/1.dng.tiff $CROP "$TARGET_NAME.tmp.jpg"
+		mv "$TARGET_NAME.tmp.jpg" "$TARGET_NAME.jpg"
 	else
 		cp "$BURST_DIR"/1.dng.tiff "$TARGET_NAME.tiff"
 	fi
@@ -1,31 +1,686 @@
+#include <stdlib.h>
+#include <string.h>
+#include <math.h>
 #include "quickdebayer.h"
 
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+// The kernels are generated for every CFA order and raw layout from the
+// generic versions below. The positions of the colors in the 2x2 quad and the
+// layout are compile-time constants, so each variant ends up with its loads
+// fixed and no branching on the format inside the loops. Packed formats are
+// read in place, only the top 8 bits of every sample are used.
+//
+// Quad positions: 0 1
+//                 2 3
+
+// Top 8 bits of the sample in column x of a raw line
+static inline __attribute__((always_inline)) uint8_t
+raw_sample8(const uint8_t *line, int x, const enum raw_layout layout)
+{
+	switch (layout) {
+		case RAW_10:
+			return ((const uint16_t *)line)[x] >> 2;
+		case RAW_12:
+			return ((const uint16_t *)line)[x] >> 4;
+		case RAW_10P:
+			return line[x / 4 * 5 + x % 4];
+		case RAW_12P:
+			return line[x / 2 * 3 + x % 2];
+		default:
+			return line[x];
+	}
+}
+
 // Fast but bad debayer method that scales and rotates by skipping source pixels and
 // doesn't interpolate any values at all
 
-void
-quick_debayer_bggr8(const uint8_t *source, uint8_t *destination, int width, int height, int skip)
+static inline __attribute__((always_inline)) void
+quick_debayer(const uint8_t *source, uint8_t *destination, int width, int height,
+	int stride, int dst_stride, int skip, const enum raw_layout layout,
+	const int pos_r, const int pos_g, const int pos_b)
 {
 	int byteskip = 2 * skip;
-	int input_size = width * height;
-	int output_size = (width/byteskip) * (height/byteskip);
-	int i;
-	int j=0;
-	int row_left = width;
-
-	// B G
-	// G R
-	for(i=0;i<input_size;) {
-		destination[j++] = source[i+width+1];
-		destination[j++] = source[i+1];
-		destination[j++] = source[i];
-		i = i + byteskip;
-		row_left = row_left - byteskip;
-		if(row_left < byteskip){
-			i = i + row_left;
-			row_left = width;
-			i = i + width;
-			i = i + (width * 2 * (skip-1));
+
+	for (int y = 0; y < height / byteskip; y++) {
+		const uint8_t *quad_row = source + y * byteskip * stride;
+		const uint8_t *lines[2] = { quad_row, quad_row + stride };
+		uint8_t *out = destination + y * dst_stride;
+
+		for (int x = 0; x < width / byteskip; x++) {
+			int col = x * byteskip;
+			*out++ = raw_sample8(lines[pos_r >> 1], col + (pos_r & 1), layout);
+			*out++ = raw_sample8(lines[pos_g >> 1], col + (pos_g & 1), layout);
+			*out++ = raw_sample8(lines[pos_b >> 1], col + (pos_b & 1), layout);
+		}
+	}
+}
+
+#ifdef __ARM_NEON
+// Load the top 8 bits of 16 quads worth of a raw line, split in the even and
+// odd columns. Returns 0 when the layout can't be loaded this way or the
+// load would read past the end of the line.
+static inline __attribute__((always_inline)) int
+load_quads(const uint8_t *line, int x, int quads, const enum raw_layout layout,
+	uint8x16_t *even, uint8x16_t *odd)
+{
+	if (layout == RAW_8) {
+		uint8x16x2_t v = vld2q_u8(line + 2 * x);
+		*even = v.val[0];
+		*odd = v.val[1];
+		return 1;
+	}
+
+	if (layout == RAW_10 || layout == RAW_12) {
+		const uint16_t *words = (const uint16_t *)line + 2 * x;
+		uint16x8x2_t a = vld2q_u16(words);
+		uint16x8x2_t b = vld2q_u16(words + 16);
+		if (layout == RAW_10) {
+			*even = vcombine_u8(vshrn_n_u16(a.val[0], 2), vshrn_n_u16(b.val[0], 2));
+			*odd = vcombine_u8(vshrn_n_u16(a.val[1], 2), vshrn_n_u16(b.val[1], 2));
+		} else {
+			*even = vcombine_u8(vshrn_n_u16(a.val[0], 4), vshrn_n_u16(b.val[0], 4));
+			*odd = vcombine_u8(vshrn_n_u16(a.val[1], 4), vshrn_n_u16(b.val[1], 4));
+		}
+		return 1;
+	}
+
+	if (layout == RAW_12P) {
+		uint8x16x3_t v = vld3q_u8(line + 3 * x);
+		*even = v.val[0];
+		*odd = v.val[1];
+		return 1;
+	}
+
+#ifdef __aarch64__
+	if (layout == RAW_10P) {
+		// 32 samples are 8 groups of 5 bytes, pick the high bytes out of
+		// the 48 bytes loaded with a table lookup
+		static const uint8_t even_index[16] = {
+			0, 2, 5, 7, 10, 12, 15, 17, 20, 22, 25, 27, 30, 32, 35, 37
+		};
+		static const uint8_t odd_index[16] = {
+			1, 3, 6, 8, 11, 13, 16, 18, 21, 23, 26, 28, 31, 33, 36, 38
+		};
+		const uint8_t *s = line + x / 2 * 5;
+		uint8x16x3_t v;
+
+		if (x / 2 * 5 + 48 > quads / 2 * 5) {
+			return 0;
+		}
+		v.val[0] = vld1q_u8(s);
+		v.val[1] = vld1q_u8(s + 16);
+		v.val[2] = vld1q_u8(s + 32);
+		*even = vqtbl3q_u8(v, vld1q_u8(even_index));
+		*odd = vqtbl3q_u8(v, vld1q_u8(odd_index));
+		return 1;
+	}
+#endif
+
+	return 0;
+}
+#endif
+
+// Add one row of 2x2 quads to the per-column channel sums. The green sum holds
+// both greens of the quad so it's twice the range of the others.
+static inline __attribute__((always_inline)) void
+accumulate_quads(const uint8_t *top, const uint8_t *bottom, uint16_t *sum_b,
+	uint16_t *sum_g, uint16_t *sum_r, int quads, const enum raw_layout layout,
+	const int pos_r, const int pos_g1, const int pos_g2, const int pos_b)
+{
+	const uint8_t *lines[2] = { top, bottom };
+	int x = 0;
+
+#ifdef __ARM_NEON
+	// The loads split the lines into the even and odd columns, the widening
+	// adds then accumulate 16 quads per iteration in 16 bits
+	for (; x + 16 <= quads; x += 16) {
+		uint8x16_t v[4];
+
+		if (!load_quads(top, x, quads, layout, &v[0], &v[1])) {
+			break;
+		}
+		load_quads(bottom, x, quads, layout, &v[2], &v[3]);
+
+		uint16x8_t g_lo = vaddl_u8(vget_low_u8(v[pos_g1]), vget_low_u8(v[pos_g2]));
+		uint16x8_t g_hi = vaddl_u8(vget_high_u8(v[pos_g1]), vget_high_u8(v[pos_g2]));
+
+		vst1q_u16(sum_b + x, vaddw_u8(vld1q_u16(sum_b + x), vget_low_u8(v[pos_b])));
+		vst1q_u16(sum_b + x + 8, vaddw_u8(vld1q_u16(sum_b + x + 8), vget_high_u8(v[pos_b])));
+		vst1q_u16(sum_g + x, vaddq_u16(vld1q_u16(sum_g + x), g_lo));
+		vst1q_u16(sum_g + x + 8, vaddq_u16(vld1q_u16(sum_g + x + 8), g_hi));
+		vst1q_u16(sum_r + x, vaddw_u8(vld1q_u16(sum_r + x), vget_low_u8(v[pos_r])));
+		vst1q_u16(sum_r + x + 8, vaddw_u8(vld1q_u16(sum_r + x + 8), vget_high_u8(v[pos_r])));
+	}
+#endif
+
+	for (; x < quads; x++) {
+		sum_b[x] += raw_sample8(lines[pos_b >> 1], 2 * x + (pos_b & 1), layout);
+		sum_g[x] += raw_sample8(lines[pos_g1 >> 1], 2 * x + (pos_g1 & 1), layout)
+			+ raw_sample8(lines[pos_g2 >> 1], 2 * x + (pos_g2 & 1), layout);
+		sum_r[x] += raw_sample8(lines[pos_r >> 1], 2 * x + (pos_r & 1), layout);
+	}
+}
+
+typedef void (*accumulate_quads_fn)(const uint8_t *top, const uint8_t *bottom,
+	uint16_t *sum_b, uint16_t *sum_g, uint16_t *sum_r, int quads);
+
+static int binned_debayer(const uint8_t *source, uint8_t *destination, int width, int height,
+	int stride, int dst_width, int dst_height, int dst_stride,
+	const struct preview_color *color, accumulate_quads_fn accumulate);
+
+#define BAYER_KERNELS(name, layout, pos_r, pos_g1, pos_g2, pos_b) \
+	static void \
+	accumulate_quads_##name(const uint8_t *top, const uint8_t *bottom, \
+		uint16_t *sum_b, uint16_t *sum_g, uint16_t *sum_r, int quads) \
+	{ \
+		accumulate_quads(top, bottom, sum_b, sum_g, sum_r, quads, layout, \
+			pos_r, pos_g1, pos_g2, pos_b); \
+	} \
+	\
+	static void \
+	quick_debayer_##name(const uint8_t *source, uint8_t *destination, \
+		int width, int height, int stride, int dst_stride, int skip) \
+	{ \
+		quick_debayer(source, destination, width, height, stride, dst_stride, \
+			skip, layout, pos_r, pos_g1, pos_b); \
+	} \
+	\
+	static int \
+	quick_debayer_binned_##name(const uint8_t *source, uint8_t *destination, \
+		int width, int height, int stride, int dst_width, int dst_height, \
+		int dst_stride, const struct preview_color *color) \
+	{ \
+		return binned_debayer(source, destination, width, height, stride, \
+			dst_width, dst_height, dst_stride, color, accumulate_quads_##name); \
+	}
+
+#define BAYER_ORDER_KERNELS(order, pos_r, pos_g1, pos_g2, pos_b) \
+	BAYER_KERNELS(order##8, RAW_8, pos_r, pos_g1, pos_g2, pos_b) \
+	BAYER_KERNELS(order##10, RAW_10, pos_r, pos_g1, pos_g2, pos_b) \
+	BAYER_KERNELS(order##12, RAW_12, pos_r, pos_g1, pos_g2, pos_b) \
+	BAYER_KERNELS(order##10p, RAW_10P, pos_r, pos_g1, pos_g2, pos_b) \
+	BAYER_KERNELS(order##12p, RAW_12P, pos_r, pos_g1, pos_g2, pos_b)
+
+// B G    G B    G R    R G
+// G R    R G    B G    G B
+BAYER_ORDER_KERNELS(bggr, 3, 1, 2, 0)
+BAYER_ORDER_KERNELS(gbrg, 2, 0, 3, 1)
+BAYER_ORDER_KERNELS(grbg, 1, 0, 3, 2)
+BAYER_ORDER_KERNELS(rggb, 0, 1, 2, 3)
+
+#define KERNEL_ENTRY(name) { quick_debayer_##name, quick_debayer_binned_##name }
+#define KERNEL_ROW(order) { \
+		[RAW_8] = KERNEL_ENTRY(order##8), \
+		[RAW_10] = KERNEL_ENTRY(order##10), \
+		[RAW_12] = KERNEL_ENTRY(order##12), \
+		[RAW_10P] = KERNEL_ENTRY(order##10p), \
+		[RAW_12P] = KERNEL_ENTRY(order##12p), \
+	}
+
+static const struct debayer_kernels kernels[][RAW_12P + 1] = {
+	[BAYER_BGGR] = KERNEL_ROW(bggr),
+	[BAYER_GBRG] = KERNEL_ROW(gbrg),
+	[BAYER_GRBG] = KERNEL_ROW(grbg),
+	[BAYER_RGGB] = KERNEL_ROW(rggb),
+};
+
+const struct debayer_kernels *
+debayer_kernels_get(enum bayer_order order, enum raw_layout layout)
+{
+	return &kernels[order][layout];
+}
+
+static inline __attribute__((always_inline)) void
+quad_luma(const uint8_t *source, uint8_t *destination, int width, int height,
+	int stride, int dst_stride, const enum raw_layout layout)
+{
+	for (int y = 0; y < height / 2; y++) {
+		const uint8_t *top = source + 2 * y * stride;
+		const uint8_t *bottom = top + stride;
+		uint8_t *out = destination + y * dst_stride;
+		int x = 0;
+
+#ifdef __ARM_NEON
+		if (layout == RAW_8) {
+			for (; x + 8 <= width / 2; x += 8) {
+				uint16x8_t sum = vaddq_u16(vpaddlq_u8(vld1q_u8(top + 2 * x)),
+					vpaddlq_u8(vld1q_u8(bottom + 2 * x)));
+				vst1_u8(out + x, vrshrn_n_u16(sum, 2));
+			}
+		}
+#endif
+
+		for (; x < width / 2; x++) {
+			out[x] = (raw_sample8(top, 2 * x, layout) + raw_sample8(top, 2 * x + 1, layout) +
+				raw_sample8(bottom, 2 * x, layout) + raw_sample8(bottom, 2 * x + 1, layout) + 2) >> 2;
+		}
+	}
+}
+
+// Half resolution luma from the average of every 2x2 quad. Every bayer order
+// has one red, two green and one blue sample in a quad, so the CFA doesn't
+// matter here.
+void
+quick_luma(const uint8_t *source, uint8_t *destination, int width, int height,
+	int stride, int dst_stride, enum raw_layout layout)
+{
+	switch (layout) {
+		case RAW_10:
+			quad_luma(source, destination, width, height, stride, dst_stride, RAW_10);
+			break;
+		case RAW_12:
+			quad_luma(source, destination, width, height, stride, dst_stride, RAW_12);
+			break;
+		case RAW_10P:
+			quad_luma(source, destination, width, height, stride, dst_stride, RAW_10P);
+			break;
+		case RAW_12P:
+			quad_luma(source, destination, width, height, stride, dst_stride, RAW_12P);
+			break;
+		default:
+			quad_luma(source, destination, width, height, stride, dst_stride, RAW_8);
+			break;
+	}
+}
+
+// Build the fixed-point color stage for the preview. The averages coming out
+// of the binned debayer are 12 bit, the matrix maps white balanced camera RGB
+// to linear sRGB and the lut applies the sRGB transfer curve. The levels are
+// in sensor units for the given bit depth.
+void
+preview_color_init(struct preview_color *color, int bits, int blacklevel, int whitelevel,
+	const float *matrix, const float *neutral)
+{
+	int range;
+
+	if (whitelevel <= blacklevel) {
+		whitelevel = (1 << bits) - 1;
+	}
+	range = (whitelevel - blacklevel) << (12 - bits);
+
+	color->shading = NULL;
+	color->accumulator = NULL;
+	color->black = blacklevel << (12 - bits);
+	color->scale = MIN(65535, (4095 * 4096 + range / 2) / range);
+
+	for (int row = 0; row < 3; row++) {
+		for (int col = 0; col < 3; col++) {
+			float c = matrix[row * 3 + col] / neutral[col] * 1024.0f;
+			color->matrix[row * 3 + col] = MAX(-32768, MIN(32767, lroundf(c)));
+		}
+	}
+
+	for (int i = 0; i < 4096; i++) {
+		float v = i / 4095.0f;
+		if (v <= 0.0031308f) {
+			v = v * 12.92f;
+		} else {
+			v = 1.055f * powf(v, 1.0f / 2.4f) - 0.055f;
+		}
+		color->gamma[i] = lroundf(v * 255.0f);
+	}
+}
+
+const float colormatrix_srgb[9] = {
+	3.2409, -1.5373, -0.4986,
+	-0.9692, 1.8759, 0.0415,
+	0.0556, -0.2039, 1.0569
+};
+
+// XYZ (D50) to linear sRGB, used with the DNG forwardmatrix which maps to D50
+static const float xyzd50_srgb[] = {
+	3.1339, -1.6169, -0.4906,
+	-0.9788, 1.9161, 0.0335,
+	0.0719, -0.2290, 1.4052
+};
+
+static void
+matrix_multiply(const float *a, const float *b, float *out)
+{
+	for (int row = 0; row < 3; row++) {
+		for (int col = 0; col < 3; col++) {
+			out[row * 3 + col] = a[row * 3] * b[col]
+				+ a[row * 3 + 1] * b[3 + col]
+				+ a[row * 3 + 2] * b[6 + col];
+		}
+	}
+}
+
+static int
+matrix_invert(const float *m, float *out)
+{
+	float det = m[0] * (m[4] * m[8] - m[5] * m[7])
+		- m[1] * (m[3] * m[8] - m[5] * m[6])
+		+ m[2] * (m[3] * m[7] - m[4] * m[6]);
+
+	if (det == 0.0f) {
+		return -1;
+	}
+
+	out[0] = (m[4] * m[8] - m[5] * m[7]) / det;
+	out[1] = (m[2] * m[7] - m[1] * m[8]) / det;
+	out[2] = (m[1] * m[5] - m[2] * m[4]) / det;
+	out[3] = (m[5] * m[6] - m[3] * m[8]) / det;
+	out[4] = (m[0] * m[8] - m[2] * m[6]) / det;
+	out[5] = (m[2] * m[3] - m[0] * m[5]) / det;
+	out[6] = (m[3] * m[7] - m[4] * m[6]) / det;
+	out[7] = (m[1] * m[6] - m[0] * m[7]) / det;
+	out[8] = (m[0] * m[4] - m[1] * m[3]) / det;
+	return 0;
+}
+
+void
+preview_color_matrix(const float *colormatrix, const float *forwardmatrix, float *matrix)
+{
+	static const float identity[9] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+	float inverse[9];
+
+	memcpy(matrix, identity, sizeof(identity));
+	if (forwardmatrix) {
+		matrix_multiply(xyzd50_srgb, forwardmatrix, matrix);
+	} else if (colormatrix && matrix_invert(colormatrix, inverse) == 0) {
+		matrix_multiply(colormatrix_srgb, inverse, matrix);
+	}
+
+	// Scale the rows so a neutral camera value stays neutral
+	for (int row = 0; row < 3; row++) {
+		float sum = matrix[row * 3] + matrix[row * 3 + 1] + matrix[row * 3 + 2];
+		if (sum > 0.0f) {
+			for (int col = 0; col < 3; col++) {
+				matrix[row * 3 + col] /= sum;
+			}
+		}
+	}
+}
+
+static void
+finish_row_raw(const uint16_t *avg_r, const uint16_t *avg_g, const uint16_t *avg_b,
+	uint8_t *out, int count)
+{
+	for (int x = 0; x < count; x++) {
+		*out++ = (avg_r[x] + 8) >> 4;
+		*out++ = (avg_g[x] + 8) >> 4;
+		*out++ = (avg_b[x] + 8) >> 4;
+	}
+}
+
+static inline uint16_t
+linearize(const struct preview_color *color, uint16_t v)
+{
+	uint32_t l = v > color->black ? v - color->black : 0;
+	return MIN(4095, (l * color->scale) >> 12);
+}
+
+static inline uint16_t
+shade(uint16_t v, uint16_t gain)
+{
+	return MIN(4095, ((uint32_t)v * gain) >> 12);
+}
+
+static inline uint16_t
+apply_matrix_row(const int16_t *m, int r, int g, int b)
+{
+	int32_t v = (m[0] * r + m[1] * g + m[2] * b + 512) >> 10;
+	return MAX(0, MIN(4095, v));
+}
+
+// Black level, white level, lens shading, color matrix and gamma for one row
+// of averages. Runs at output resolution so it adds very little on top of the
+// binning. The shading gains are a row of red, green and blue gains or NULL.
+static void
+finish_row_color(const uint16_t *avg_r, const uint16_t *avg_g, const uint16_t *avg_b,
+	uint8_t *out, int count, const struct preview_color *color, const uint16_t *shading)
+{
+	int x = 0;
+
+#ifdef __ARM_NEON
+	const uint16x8_t black = vdupq_n_u16(color->black);
+	const uint16x4_t scale = vdup_n_u16(color->scale);
+	const uint16x8_t max = vdupq_n_u16(4095);
+	const int16_t *m = color->matrix;
+	uint16_t res[3][8];
+
+	for (; x + 8 <= count; x += 8) {
+		uint16x8_t in[3] = { vld1q_u16(avg_r + x), vld1q_u16(avg_g + x), vld1q_u16(avg_b + x) };
+		int16x8_t lin[3];
+
+		for (int c = 0; c < 3; c++) {
+			uint16x8_t v = vqsubq_u16(in[c], black);
+			uint32x4_t lo = vmull_u16(vget_low_u16(v), scale);
+			uint32x4_t hi = vmull_u16(vget_high_u16(v), scale);
+			v = vminq_u16(vcombine_u16(vqshrn_n_u32(lo, 12), vqshrn_n_u32(hi, 12)), max);
+			if (shading) {
+				uint16x8_t gain = vld1q_u16(shading + c * count + x);
+				lo = vmull_u16(vget_low_u16(v), vget_low_u16(gain));
+				hi = vmull_u16(vget_high_u16(v), vget_high_u16(gain));
+				v = vminq_u16(vcombine_u16(vqshrn_n_u32(lo, 12), vqshrn_n_u32(hi, 12)), max);
+			}
+			lin[c] = vreinterpretq_s16_u16(v);
+		}
+
+		for (int c = 0; c < 3; c++) {
+			int32x4_t lo = vmull_n_s16(vget_low_s16(lin[0]), m[c * 3]);
+			int32x4_t hi = vmull_n_s16(vget_high_s16(lin[0]), m[c * 3]);
+			lo = vmlal_n_s16(lo, vget_low_s16(lin[1]), m[c * 3 + 1]);
+			hi = vmlal_n_s16(hi, vget_high_s16(lin[1]), m[c * 3 + 1]);
+			lo = vmlal_n_s16(lo, vget_low_s16(lin[2]), m[c * 3 + 2]);
+			hi = vmlal_n_s16(hi, vget_high_s16(lin[2]), m[c * 3 + 2]);
+			uint16x8_t v = vcombine_u16(vqrshrun_n_s32(lo, 10), vqrshrun_n_s32(hi, 10));
+			vst1q_u16(res[c], vminq_u16(v, max));
+		}
+
+		// There's no gather for a 4096 entry table, the lut stays scalar
+		for (int i = 0; i < 8; i++) {
+			*out++ = color->gamma[res[0][i]];
+			*out++ = color->gamma[res[1][i]];
+			*out++ = color->gamma[res[2][i]];
+		}
+	}
+#endif
+
+	for (; x < count; x++) {
+		int r = linearize(color, avg_r[x]);
+		int g = linearize(color, avg_g[x]);
+		int b = linearize(color, avg_b[x]);
+
+		if (shading) {
+			r = shade(r, shading[x]);
+			g = shade(g, shading[count + x]);
+			b = shade(b, shading[2 * count + x]);
+		}
+
+		*out++ = color->gamma[apply_matrix_row(color->matrix, r, g, b)];
+		*out++ = color->gamma[apply_matrix_row(color->matrix + 3, r, g, b)];
+		*out++ = color->gamma[apply_matrix_row(color->matrix + 6, r, g, b)];
+	}
+}
+
+struct preview_accumulator *
+preview_accumulator_new(int width, int height)
+{
+	struct preview_accumulator *accumulator = calloc(1, sizeof(struct preview_accumulator));
+	accumulator->width = width;
+	accumulator->height = height;
+	accumulator->values = malloc((size_t)width * height * 3 * sizeof(uint16_t));
+	if (!accumulator->values) {
+		free(accumulator);
+		return NULL;
+	}
+	return accumulator;
+}
+
+void
+preview_accumulator_free(struct preview_accumulator *accumulator)
+{
+	if (!accumulator) {
+		return;
+	}
+	free(accumulator->values);
+	free(accumulator);
+}
+
+// Blends a row of averages into the low light average and replaces them with
+// the result, so the color stage after it doesn't know the difference
+static void
+accumulate_row(uint16_t *values, uint16_t *avg_r, uint16_t *avg_g, uint16_t *avg_b, int count,
+	int reset)
+{
+	uint16_t *acc_r = values;
+	uint16_t *acc_g = values + count;
+	uint16_t *acc_b = values + 2 * count;
+	int x = 0;
+
+#ifdef __ARM_NEON
+	const uint16x8_t motion = vdupq_n_u16(LOWLIGHT_MOTION << 3);
+	const uint16x8_t all = vdupq_n_u16(reset ? 0xffff : 0);
+	uint16_t *acc[3] = {acc_r, acc_g, acc_b};
+	uint16_t *avg[3] = {avg_r, avg_g, avg_b};
+
+	for (; x + 8 <= count; x += 8) {
+		uint16x8_t g = vshlq_n_u16(vld1q_u16(avg_g + x), 3);
+		uint16x8_t ag = vld1q_u16(acc_g + x);
+		uint16x8_t moving = vorrq_u16(all, vcgtq_u16(vabdq_u16(g, ag), vsraq_n_u16(motion, ag, 3)));
+
+		for (int c = 0; c < 3; c++) {
+			uint16x8_t v = vshlq_n_u16(vld1q_u16(avg[c] + x), 3);
+			int16x8_t a = vreinterpretq_s16_u16(vld1q_u16(acc[c] + x));
+			a = vrsraq_n_s16(a, vsubq_s16(vreinterpretq_s16_u16(v), a), LOWLIGHT_SHIFT);
+			uint16x8_t out = vbslq_u16(moving, v, vreinterpretq_u16_s16(a));
+			vst1q_u16(acc[c] + x, out);
+			vst1q_u16(avg[c] + x, vrshrq_n_u16(out, 3));
 		}
 	}
+#endif
+
+	// The same rounding as the vector loop, which has to match it exactly.
+	// Without branches, so compilers vectorize it where there is no NEON.
+	for (; x < count; x++) {
+		int32_t r = avg_r[x] << 3, g = avg_g[x] << 3, b = avg_b[x] << 3;
+		int32_t ar = acc_r[x], ag = acc_g[x], ab = acc_b[x];
+		int32_t diff = g > ag ? g - ag : ag - g;
+		int moving = reset | (diff > (LOWLIGHT_MOTION << 3) + (ag >> 3));
+
+		ar += (r - ar + (1 << (LOWLIGHT_SHIFT - 1))) >> LOWLIGHT_SHIFT;
+		ag += (g - ag + (1 << (LOWLIGHT_SHIFT - 1))) >> LOWLIGHT_SHIFT;
+		ab += (b - ab + (1 << (LOWLIGHT_SHIFT - 1))) >> LOWLIGHT_SHIFT;
+		r = moving ? r : ar;
+		g = moving ? g : ag;
+		b = moving ? b : ab;
+		acc_r[x] = r;
+		acc_g[x] = g;
+		acc_b[x] = b;
+		avg_r[x] = (r + 4) >> 3;
+		avg_g[x] = (g + 4) >> 3;
+		avg_b[x] = (b + 4) >> 3;
+	}
+}
+
+// Debayer by averaging every 2x2 quad that falls inside the footprint of an
+// output pixel. The output size can be anything up to half the input size,
+// so the preview can be produced at display size without another resample.
+// When a color stage is passed it's applied to each row while it's still in
+// cache, otherwise the raw sensor RGB is written out.
+
+static int
+binned_debayer(const uint8_t *source, uint8_t *destination, int width, int height,
+	int stride, int dst_width, int dst_height, int dst_stride,
+	const struct preview_color *color, accumulate_quads_fn accumulate)
+{
+	int quads_x = width / 2;
+	int quads_y = height / 2;
+	uint16_t *sums, *avg;
+	uint16_t *sum_b, *sum_g, *sum_r;
+	uint16_t *avg_b, *avg_g, *avg_r;
+	int *col_start;
+	struct preview_accumulator *accumulator = NULL;
+
+	if (dst_width < 1 || dst_height < 1 || dst_width > quads_x || dst_height > quads_y) {
+		return -1;
+	}
+
+	// The green sums of a single column overflow 16 bits past 128 quad rows
+	if ((quads_y + dst_height - 1) / dst_height > BINNED_MAX_ROWS) {
+		return -1;
+	}
+
+	sums = calloc(3 * quads_x, sizeof(uint16_t));
+	avg = malloc(3 * dst_width * sizeof(uint16_t));
+	col_start = malloc((dst_width + 1) * sizeof(int));
+	if (!sums || !avg || !col_start) {
+		free(sums);
+		free(avg);
+		free(col_start);
+		return -1;
+	}
+	sum_b = sums;
+	sum_g = sums + quads_x;
+	sum_r = sums + 2 * quads_x;
+	avg_b = avg;
+	avg_g = avg + dst_width;
+	avg_r = avg + 2 * dst_width;
+
+	for (int x = 0; x <= dst_width; x++) {
+		col_start[x] = x * quads_x / dst_width;
+	}
+	if (color && color->accumulator && color->accumulator->width == dst_width &&
+			color->accumulator->height == dst_height) {
+		accumulator = color->accumulator;
+	}
+
+	for (int y = 0; y < dst_height; y++) {
+		int row_start = y * quads_y / dst_height;
+		int row_end = (y + 1) * quads_y / dst_height;
+		int rows = row_end - row_start;
+		uint8_t *out = destination + y * dst_stride;
+
+		for (int row = row_start; row < row_end; row++) {
+			const uint8_t *top = source + (2 * row) * stride;
+			accumulate(top, top + stride, sum_b, sum_g, sum_r, quads_x);
+		}
+
+		// Averages are kept at 12 bits for the color stage
+		for (int x = 0; x < dst_width; x++) {
+			uint32_t b = 0, g = 0, r = 0;
+			uint32_t count = (col_start[x + 1] - col_start[x]) * rows;
+
+			for (int col = col_start[x]; col < col_start[x + 1]; col++) {
+				b += sum_b[col];
+				g += sum_g[col];
+				r += sum_r[col];
+			}
+
+			avg_r[x] = (r * 16 + count / 2) / count;
+			avg_g[x] = (g * 8 + count / 2) / count;
+			avg_b[x] = (b * 16 + count / 2) / count;
+		}
+
+		if (accumulator) {
+			accumulate_row(accumulator->values + (size_t)y * dst_width * 3, avg_r, avg_g, avg_b,
+				dst_width, accumulator->frames == 0);
+		}
+
+		if (color) {
+			const uint16_t *shading = NULL;
+			if (color->shading && color->shading_width == dst_width &&
+					color->shading_height == dst_height) {
+				shading = color->shading + (size_t)y * dst_width * 3;
+			}
+			finish_row_color(avg_r, avg_g, avg_b, out, dst_width, color, shading);
+		} else {
+			finish_row_raw(avg_r, avg_g, avg_b, out, dst_width);
+		}
+
+		memset(sums, 0, 3 * quads_x * sizeof(uint16_t));
+	}
+	if (accumulator) {
+		accumulator->frames++;
+	}
+
+	free(sums);
+	free(avg);
+	free(col_start);
+	return 0;
 }
@@ -1,4 +1,86 @@
+#ifndef QUICKDEBAYER_H
+#define QUICKDEBAYER_H
+
 #include <stdint.h>
+#include "rawformat.h"
+
+#ifndef MIN
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#endif
+#ifndef MAX
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+#endif
+
+// Max number of quad rows summed into one output row by the binned debayer
+#define BINNED_MAX_ROWS 128
+
+// Low light preview, a running average of the binned frames. A new frame is
+// weighted 1/2^LOWLIGHT_SHIFT, and pixels whose green changed by more than
+// LOWLIGHT_MOTION (12 bit units) plus an eighth start over from the new frame
+// so moving things don't smear.
+#define LOWLIGHT_SHIFT 2
+#define LOWLIGHT_MOTION 32
+
+// The average of every output pixel in 12.3 bits fixed point, each row is
+// width red values followed by the green and blue ones. frames is 0 until
+// the first frame is in.
+struct preview_accumulator {
+	int width;
+	int height;
+	unsigned int frames;
+	uint16_t *values;
+};
+
+struct preview_accumulator *preview_accumulator_new(int width, int height);
+void preview_accumulator_free(struct preview_accumulator *accumulator);
+
+// Fixed-point color stage for the preview, see preview_color_init()
+struct preview_color {
+	uint16_t black;
+	uint16_t scale;
+	int16_t matrix[9];
+	uint8_t gamma[4096];
+	// Optional lens shading, Q4.12 gains for every output pixel as made by
+	// shading_preview_table(). Only used when the output has the same size.
+	const uint16_t *shading;
+	int shading_width;
+	int shading_height;
+	// Optional low light average, every frame is blended into it before the
+	// color stage. Only used when it has the size of the output.
+	struct preview_accumulator *accumulator;
+};
+
+void preview_color_init(struct preview_color *color, int bits, int blacklevel, int whitelevel,
+	const float *matrix, const float *neutral);
+
+// DNG ColorMatrix1 of a camera that sees sRGB, XYZ to linear sRGB
+extern const float colormatrix_srgb[9];
+
+// Camera RGB to linear sRGB for preview_color_init() from the DNG matrices,
+// either may be NULL. Neutral camera values stay neutral.
+void preview_color_matrix(const float *colormatrix, const float *forwardmatrix, float *matrix);
+
+enum bayer_order {
+	BAYER_BGGR,
+	BAYER_GBRG,
+	BAYER_GRBG,
+	BAYER_RGGB,
+};
+
+typedef void (*quick_debayer_fn)(const uint8_t *source, uint8_t *destination,
+	int width, int height, int stride, int dst_stride, int skip);
+typedef int (*binned_debayer_fn)(const uint8_t *source, uint8_t *destination,
+	int width, int height, int stride, int dst_width, int dst_height, int dst_stride,
+	const struct preview_color *color);
+
+struct debayer_kernels {
+	quick_debayer_fn quick;
+	binned_debayer_fn binned;
+};
+
+const struct debayer_kernels *debayer_kernels_get(enum bayer_order order, enum raw_layout layout);
 
-void quick_debayer_bggr8(const uint8_t *source, uint8_t *destination, int width, int height, int skip);
+void quick_luma(const uint8_t *source, uint8_t *destination, int width, int height,
+	int stride, int dst_stride, enum raw_layout layout);
 
+#endif
@@ -0,0 +1,149 @@
+#include <string.h>
+#include "rawformat.h"
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+int
+raw_bits(enum raw_layout layout)
+{
+	switch (layout) {
+		case RAW_10:
+		case RAW_10P:
+			return 10;
+		case RAW_12:
+		case RAW_12P:
+			return 12;
+		default:
+			return 8;
+	}
+}
+
+// Minimum line length for a layout, drivers are free to pad beyond this
+int
+raw_bytes_per_line(enum raw_layout layout, int width)
+{
+	switch (layout) {
+		case RAW_10:
+		case RAW_12:
+			return width * 2;
+		case RAW_10P:
+			return width * 5 / 4;
+		case RAW_12P:
+			return width * 3 / 2;
+		default:
+			return width;
+	}
+}
+
+static void
+unpack_row_10p(const uint8_t *source, uint16_t *destination, int width)
+{
+	int x = 0;
+
+#ifdef __aarch64__
+	// Gather 16 samples from 4 groups with a table lookup, the two low bits
+	// of every sample come from the fifth byte of its group
+	static const uint8_t msb_index[16] = {
+		0, 1, 2, 3, 5, 6, 7, 8, 10, 11, 12, 13, 15, 16, 17, 18
+	};
+	static const uint8_t lsb_index[16] = {
+		4, 4, 4, 4, 9, 9, 9, 9, 14, 14, 14, 14, 19, 19, 19, 19
+	};
+	static const int16_t lsb_shift[8] = { 0, -2, -4, -6, 0, -2, -4, -6 };
+	const uint8x16_t msb_tbl = vld1q_u8(msb_index);
+	const uint8x16_t lsb_tbl = vld1q_u8(lsb_index);
+	const int16x8_t shift = vld1q_s16(lsb_shift);
+	const uint16x8_t mask = vdupq_n_u16(3);
+	int bytes = raw_bytes_per_line(RAW_10P, width);
+
+	for (; x + 16 <= width && x / 4 * 5 + 32 <= bytes; x += 16) {
+		const uint8_t *s = source + x / 4 * 5;
+		uint8x16x2_t in = { { vld1q_u8(s), vld1q_u8(s + 16) } };
+		uint8x16_t msb = vqtbl2q_u8(in, msb_tbl);
+		uint8x16_t lsb = vqtbl2q_u8(in, lsb_tbl);
+
+		uint16x8_t lo = vshll_n_u8(vget_low_u8(msb), 2);
+		uint16x8_t hi = vshll_n_u8(vget_high_u8(msb), 2);
+		lo = vorrq_u16(lo, vandq_u16(vshlq_u16(vmovl_u8(vget_low_u8(lsb)), shift), mask));
+		hi = vorrq_u16(hi, vandq_u16(vshlq_u16(vmovl_u8(vget_high_u8(lsb)), shift), mask));
+
+		vst1q_u16(destination + x, lo);
+		vst1q_u16(destination + x + 8, hi);
+	}
+#endif
+
+	for (; x < width; x++) {
+		const uint8_t *group = source + x / 4 * 5;
+		int i = x % 4;
+		destination[x] = (group[i] << 2) | ((group[4] >> (2 * i)) & 3);
+	}
+}
+
+static void
+unpack_row_12p(const uint8_t *source, uint16_t *destination, int width)
+{
+	int x = 0;
+
+#ifdef __ARM_NEON
+	// vld3 splits the 3 byte groups into the two high bytes and the shared
+	// byte holding both low nibbles
+	const uint8x8_t nibble = vdup_n_u8(0x0f);
+
+	for (; x + 16 <= width; x += 16) {
+		uint8x8x3_t in = vld3_u8(source + x / 2 * 3);
+		uint16x8x2_t out;
+
+		out.val[0] = vorrq_u16(vshll_n_u8(in.val[0], 4), vmovl_u8(vand_u8(in.val[2], nibble)));
+		out.val[1] = vorrq_u16(vshll_n_u8(in.val[1], 4), vmovl_u8(vshr_n_u8(in.val[2], 4)));
+		vst2q_u16(destination + x, out);
+	}
+#endif
+
+	for (; x + 1 < width; x += 2) {
+		const uint8_t *group = source + x / 2 * 3;
+		destination[x] = (group[0] << 4) | (group[2] & 0x0f);
+		destination[x + 1] = (group[1] << 4) | (group[2] >> 4);
+	}
+}
+
+static void
+unpack_row_8(const uint8_t *source, uint16_t *destination, int width)
+{
+	int x = 0;
+
+#ifdef __ARM_NEON
+	for (; x + 16 <= width; x += 16) {
+		uint8x16_t in = vld1q_u8(source + x);
+		vst1q_u16(destination + x, vmovl_u8(vget_low_u8(in)));
+		vst1q_u16(destination + x + 8, vmovl_u8(vget_high_u8(in)));
+	}
+#endif
+
+	for (; x < width; x++) {
+		destination[x] = source[x];
+	}
+}
+
+// Expand one line of raw samples to one 16 bit word per sample, right
+// aligned, for writing out as a 16 bit DNG
+void
+raw_unpack_row(enum raw_layout layout, const uint8_t *source, uint16_t *destination, int width)
+{
+	switch (layout) {
+		case RAW_10:
+		case RAW_12:
+			memcpy(destination, source, width * sizeof(uint16_t));
+			break;
+		case RAW_10P:
+			unpack_row_10p(source, destination, width);
+			break;
+		case RAW_12P:
+			unpack_row_12p(source, destination, width);
+			break;
+		default:
+			unpack_row_8(source, destination, width);
+			break;
+	}
+}
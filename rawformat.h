@@ -0,0 +1,20 @@
+#ifndef RAWFORMAT_H
+#define RAWFORMAT_H
+
+#include <stdint.h>
+
+// How the samples of a raw bayer frame are stored in memory
+enum raw_layout {
+	RAW_8,   // one byte per sample
+	RAW_10,  // 10 bits in the low end of a little endian 16 bit word
+	RAW_12,  // 12 bits in the low end of a little endian 16 bit word
+	RAW_10P, // MIPI packed, 4 samples in 5 bytes
+	RAW_12P, // MIPI packed, 2 samples in 3 bytes
+};
+
+int raw_bits(enum raw_layout layout);
+int raw_bytes_per_line(enum raw_layout layout, int width);
+
+void raw_unpack_row(enum raw_layout layout, const uint8_t *source, uint16_t *destination, int width);
+
+#endif
@@ -0,0 +1,300 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <unistd.h>
+#include "rawvideo.h"
+
+// Disk space is reserved this many frames ahead of the writer, so the
+// filesystem doesn't have to find free blocks for every write
+#define PREALLOCATE_FRAMES 32
+
+static uint64_t
+align_up(uint64_t value, uint64_t alignment)
+{
+	return (value + alignment - 1) / alignment * alignment;
+}
+
+static int
+write_all(int fd, const void *data, size_t size, off_t offset)
+{
+	const uint8_t *p = data;
+
+	while (size > 0) {
+		ssize_t written = pwrite(fd, p, size, offset);
+		if (written < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+			return -1;
+		}
+		p += written;
+		size -= written;
+		offset += written;
+	}
+	return 0;
+}
+
+static void
+preallocate(struct raw_video *video, uint64_t end)
+{
+	uint64_t chunk = video->header.slot_size * PREALLOCATE_FRAMES;
+
+	if (end <= video->allocated) {
+		return;
+	}
+	// Not every filesystem supports this, the writes work either way
+	fallocate(video->fd, FALLOC_FL_KEEP_SIZE, video->allocated, chunk);
+	video->allocated += chunk;
+}
+
+static void *
+writer_run(void *data)
+{
+	struct raw_video *video = data;
+	const struct raw_video_header *header = &video->header;
+
+	pthread_mutex_lock(&video->lock);
+	while (1) {
+		while (video->count == 0 && !video->stop) {
+			pthread_cond_wait(&video->ready, &video->lock);
+		}
+		if (video->count == 0) {
+			break;
+		}
+		int slot = (video->head - video->count + video->slots) % video->slots;
+		struct raw_video_index entry = video->pending[slot];
+		uint64_t offset = header->frame_offset + video->frames * header->slot_size;
+		pthread_mutex_unlock(&video->lock);
+
+		preallocate(video, offset + header->slot_size);
+		int error = write_all(video->fd, video->buffers + (size_t)slot * header->slot_size,
+			header->frame_size, offset);
+
+		if (!error && video->frames == video->index_size) {
+			uint64_t size = video->index_size ? video->index_size * 2 : 1024;
+			struct raw_video_index *index = realloc(video->index, size * sizeof(*index));
+			if (index) {
+				video->index = index;
+				video->index_size = size;
+			} else {
+				error = 1;
+			}
+		}
+
+		pthread_mutex_lock(&video->lock);
+		if (error) {
+			video->write_error = 1;
+		} else {
+			video->index[video->frames++] = entry;
+		}
+		video->count--;
+	}
+	pthread_mutex_unlock(&video->lock);
+	return NULL;
+}
+
+int
+raw_video_open(struct raw_video *video, const char *path, const struct raw_video_header *header, int slots)
+{
+	uint8_t block[RAW_VIDEO_ALIGN] = {0};
+
+	memset(video, 0, sizeof(*video));
+	video->header = *header;
+	memcpy(video->header.magic, RAW_VIDEO_MAGIC, 8);
+	video->header.version = 1;
+	video->header.frame_offset = RAW_VIDEO_ALIGN;
+	video->header.slot_size = align_up(header->frame_size, RAW_VIDEO_ALIGN);
+	video->slots = slots;
+
+	video->buffers = aligned_alloc(RAW_VIDEO_ALIGN, video->header.slot_size * slots);
+	video->pending = calloc(slots, sizeof(*video->pending));
+	if (!video->buffers || !video->pending) {
+		goto fail;
+	}
+
+	video->fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (video->fd < 0) {
+		goto fail;
+	}
+	memcpy(block, &video->header, sizeof(video->header));
+	if (write_all(video->fd, block, sizeof(block), 0) < 0) {
+		close(video->fd);
+		goto fail;
+	}
+	video->allocated = RAW_VIDEO_ALIGN;
+	preallocate(video, RAW_VIDEO_ALIGN + 1);
+
+	pthread_mutex_init(&video->lock, NULL);
+	pthread_cond_init(&video->ready, NULL);
+	if (pthread_create(&video->thread, NULL, writer_run, video) != 0) {
+		close(video->fd);
+		goto fail;
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &video->start);
+	printf("Recording %ux%u to %s\n", header->width, header->height, path);
+	return 0;
+
+fail:
+	free(video->buffers);
+	free(video->pending);
+	video->buffers = NULL;
+	return -1;
+}
+
+// Called from the capture loop, only ever waits for the lock and the copy
+int
+raw_video_push(struct raw_video *video, const uint8_t *frame, uint64_t timestamp, uint32_t sequence)
+{
+	int slot;
+
+	pthread_mutex_lock(&video->lock);
+	// Gaps in the sequence are frames the driver dropped before we saw them
+	if (video->frames + video->count + video->dropped > 0 && sequence > video->last_sequence + 1) {
+		video->skipped += sequence - video->last_sequence - 1;
+	}
+	video->last_sequence = sequence;
+
+	if (video->write_error || video->count == video->slots) {
+		video->dropped++;
+		pthread_mutex_unlock(&video->lock);
+		return -1;
+	}
+	slot = video->head;
+	pthread_mutex_unlock(&video->lock);
+
+	// The head slot isn't visible to the writer until count is raised
+	memcpy(video->buffers + (size_t)slot * video->header.slot_size, frame, video->header.frame_size);
+
+	pthread_mutex_lock(&video->lock);
+	video->pending[slot].timestamp = timestamp;
+	video->pending[slot].sequence = sequence;
+	video->head = (video->head + 1) % video->slots;
+	video->count++;
+	pthread_cond_signal(&video->ready);
+	pthread_mutex_unlock(&video->lock);
+	return 0;
+}
+
+// Sustained write rate in MB/s since the recording started
+double
+raw_video_rate(struct raw_video *video)
+{
+	struct timespec now;
+	uint64_t frames;
+
+	pthread_mutex_lock(&video->lock);
+	frames = video->frames;
+	pthread_mutex_unlock(&video->lock);
+
+	clock_gettime(CLOCK_MONOTONIC, &now);
+	double seconds = (now.tv_sec - video->start.tv_sec) + (now.tv_nsec - video->start.tv_nsec) / 1e9;
+	return seconds > 0 ? frames * video->header.frame_size / seconds / 1e6 : 0;
+}
+
+int
+raw_video_close(struct raw_video *video)
+{
+	struct raw_video_footer footer = {0};
+	uint64_t offset;
+	double rate = raw_video_rate(video);
+	int ret = 0;
+
+	pthread_mutex_lock(&video->lock);
+	video->stop = 1;
+	pthread_cond_signal(&video->ready);
+	pthread_mutex_unlock(&video->lock);
+	pthread_join(video->thread, NULL);
+
+	offset = video->header.frame_offset + video->frames * video->header.slot_size;
+	memcpy(footer.magic, RAW_VIDEO_INDEX_MAGIC, 8);
+	footer.frames = video->frames;
+	footer.index_offset = offset;
+	if (write_all(video->fd, video->index, video->frames * sizeof(*video->index), offset) < 0 ||
+		write_all(video->fd, &footer, sizeof(footer),
+			offset + video->frames * sizeof(*video->index)) < 0) {
+		ret = -1;
+	}
+	// Give back the space that was reserved but not used
+	ftruncate(video->fd, offset + video->frames * sizeof(*video->index) + sizeof(footer));
+	if (fdatasync(video->fd) < 0 || video->write_error) {
+		ret = -1;
+	}
+	close(video->fd);
+
+	printf("Recorded %llu frames at %.1f MB/s, %llu dropped by the writer, %llu by the driver\n",
+		(unsigned long long)video->frames, rate, (unsigned long long)video->dropped,
+		(unsigned long long)video->skipped);
+
+	pthread_mutex_destroy(&video->lock);
+	pthread_cond_destroy(&video->ready);
+	free(video->buffers);
+	free(video->pending);
+	free(video->index);
+	video->buffers = NULL;
+	return ret;
+}
+
+int64_t
+raw_video_check(const char *path)
+{
+	struct raw_video_header header;
+	struct raw_video_footer footer;
+	struct raw_video_index *index = NULL;
+	struct stat st;
+	const char *problem = NULL;
+	int64_t ret = -1;
+
+	int fd = open(path, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		fprintf(stderr, "Could not open %s\n", path);
+		return -1;
+	}
+	if (fstat(fd, &st) < 0 || st.st_size < RAW_VIDEO_ALIGN + (off_t)sizeof(footer) ||
+		pread(fd, &header, sizeof(header), 0) != sizeof(header) ||
+		pread(fd, &footer, sizeof(footer), st.st_size - sizeof(footer)) != sizeof(footer)) {
+		problem = "is truncated";
+		goto out;
+	}
+	if (memcmp(header.magic, RAW_VIDEO_MAGIC, 8) != 0 || header.version != 1) {
+		problem = "has no raw video header";
+		goto out;
+	}
+	if (memcmp(footer.magic, RAW_VIDEO_INDEX_MAGIC, 8) != 0) {
+		problem = "has no index";
+		goto out;
+	}
+	if (footer.index_offset != header.frame_offset + footer.frames * header.slot_size ||
+		(uint64_t)st.st_size != footer.index_offset + footer.frames * sizeof(*index) + sizeof(footer)) {
+		problem = "has an index that doesn't match its size";
+		goto out;
+	}
+
+	size_t size = footer.frames * sizeof(*index);
+	index = malloc(size ? size : 1);
+	if (!index || pread(fd, index, size, footer.index_offset) != (ssize_t)size) {
+		problem = "has an unreadable index";
+		goto out;
+	}
+	// Frames are written in the order they were captured
+	for (uint64_t i = 1; i < footer.frames; i++) {
+		if (index[i].sequence <= index[i - 1].sequence ||
+			index[i].timestamp < index[i - 1].timestamp) {
+			problem = "has frames out of order in the index";
+			goto out;
+		}
+	}
+	ret = footer.frames;
+
+out:
+	if (problem) {
+		fprintf(stderr, "%s %s\n", path, problem);
+	}
+	free(index);
+	close(fd);
+	return ret;
+}
@@ -0,0 +1,85 @@
+#ifndef RAWVIDEO_H
+#define RAWVIDEO_H
+
+#include <stddef.h>
+#include <stdint.h>
+#include <pthread.h>
+#include <time.h>
+
+// Raw video file layout, all little endian:
+//
+//   header    struct raw_video_header, padded to frame_offset
+//   frames    frame n starts at frame_offset + n * slot_size and holds
+//             frame_size bytes exactly as the sensor delivered them
+//   index     struct raw_video_index per frame
+//   footer    struct raw_video_footer, at the very end of the file
+#define RAW_VIDEO_MAGIC "MPRAWVID"
+#define RAW_VIDEO_INDEX_MAGIC "MPRAWIDX"
+#define RAW_VIDEO_ALIGN 4096
+
+struct raw_video_header {
+	char magic[8];
+	uint32_t version;
+	uint32_t width;
+	uint32_t height;
+	uint32_t stride;
+	uint32_t pixelformat; // V4L2 fourcc
+	uint32_t layout;      // enum raw_layout
+	uint32_t cfa;         // enum bayer_order
+	uint32_t rate;
+	uint64_t frame_size;
+	uint64_t frame_offset;
+	uint64_t slot_size;
+};
+
+struct raw_video_index {
+	uint64_t timestamp; // CLOCK_MONOTONIC ns
+	uint32_t sequence;  // V4L2 frame sequence
+	uint32_t reserved;
+};
+
+struct raw_video_footer {
+	char magic[8];
+	uint64_t frames;
+	uint64_t index_offset;
+};
+
+// Frames are copied into one of a few buffers and written out by a
+// separate thread, when all buffers are still waiting for the disk the
+// frame is dropped instead of blocking the capture loop
+struct raw_video {
+	int fd;
+	struct raw_video_header header;
+	pthread_t thread;
+	pthread_mutex_t lock;
+	pthread_cond_t ready;
+	int stop;
+
+	uint8_t *buffers;
+	struct raw_video_index *pending;
+	int slots;
+	int head;
+	int count;
+
+	struct raw_video_index *index;
+	uint64_t index_size;
+	uint64_t frames;
+	uint64_t allocated;
+	int write_error;
+
+	uint32_t last_sequence;
+	uint64_t dropped;
+	uint64_t skipped;
+	struct timespec start;
+};
+
+int raw_video_open(struct raw_video *video, const char *path, const struct raw_video_header *header, int slots);
+int raw_video_push(struct raw_video *video, const uint8_t *frame, uint64_t timestamp, uint32_t sequence);
+double raw_video_rate(struct raw_video *video);
+int raw_video_close(struct raw_video *video);
+
+// Reads a closed recording back and checks that the footer and index match
+// the frames in the file, returns the number of frames or -1
+int64_t raw_video_check(const char *path);
+
+#endif
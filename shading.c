@@ -0,0 +1,362 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "shading.h"
+#include "textfile.h"
+
+#ifdef __ARM_NEON
+#include <arm_neon.h>
+#endif
+
+static const char *plane_names[] = {"r", "gr", "gb", "b"};
+
+// Plane of each position in a quad, top left, top right, bottom left,
+// bottom right
+static const enum shading_plane quad_planes[][4] = {
+	[BAYER_BGGR] = {SHADING_B, SHADING_GB, SHADING_GR, SHADING_R},
+	[BAYER_GBRG] = {SHADING_GB, SHADING_B, SHADING_R, SHADING_GR},
+	[BAYER_GRBG] = {SHADING_GR, SHADING_R, SHADING_B, SHADING_GB},
+	[BAYER_RGGB] = {SHADING_R, SHADING_GR, SHADING_GB, SHADING_B},
+};
+
+struct shading_grid *
+shading_grid_new(int cols, int rows)
+{
+	if (cols < 2 || rows < 2 || cols > SHADING_MAX_POINTS || rows > SHADING_MAX_POINTS) {
+		return NULL;
+	}
+
+	struct shading_grid *grid = calloc(1, sizeof(struct shading_grid));
+	grid->cols = cols;
+	grid->rows = rows;
+	for (int p = 0; p < 4; p++) {
+		grid->gains[p] = calloc(cols * rows, sizeof(float));
+	}
+	return grid;
+}
+
+void
+shading_grid_free(struct shading_grid *grid)
+{
+	if (!grid) {
+		return;
+	}
+	for (int p = 0; p < 4; p++) {
+		free(grid->gains[p]);
+	}
+	free(grid);
+}
+
+struct shading_grid *
+shading_load(const char *path)
+{
+	struct shading_grid *grid = NULL;
+	char word[32];
+	int loaded[4] = {0};
+	int cols, rows;
+
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		return NULL;
+	}
+
+	if (text_read_word(file, word, sizeof(word)) < 0 || strcmp(word, "size") != 0 ||
+			text_read_int(file, &cols) < 0 || text_read_int(file, &rows) < 0 ||
+			!(grid = shading_grid_new(cols, rows))) {
+		goto fail;
+	}
+
+	while (text_read_word(file, word, sizeof(word)) == 0) {
+		int p;
+		for (p = 0; p < 4; p++) {
+			if (strcmp(word, plane_names[p]) == 0) {
+				break;
+			}
+		}
+		if (p == 4 || loaded[p]) {
+			goto fail;
+		}
+		for (int i = 0; i < cols * rows; i++) {
+			if (text_read_word(file, word, sizeof(word)) < 0) {
+				goto fail;
+			}
+			char *end;
+			grid->gains[p][i] = strtof(word, &end);
+			// Beyond the fixed point range or not a gain at all
+			if (*end != '\0' || !(grid->gains[p][i] > 0.0f && grid->gains[p][i] < 16.0f)) {
+				goto fail;
+			}
+		}
+		loaded[p] = 1;
+	}
+
+	if (!loaded[0] || !loaded[1] || !loaded[2] || !loaded[3]) {
+		goto fail;
+	}
+	fclose(file);
+	return grid;
+
+fail:
+	shading_grid_free(grid);
+	fclose(file);
+	return NULL;
+}
+
+int
+shading_save(const char *path, const struct shading_grid *grid)
+{
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		return -1;
+	}
+
+	fprintf(file, "# Lens shading gains measured by Megapixels\n");
+	fprintf(file, "size %d %d\n", grid->cols, grid->rows);
+	for (int p = 0; p < 4; p++) {
+		fprintf(file, "%s\n", plane_names[p]);
+		for (int y = 0; y < grid->rows; y++) {
+			for (int x = 0; x < grid->cols; x++) {
+				fprintf(file, x ? " %.4f" : "%.4f", grid->gains[p][y * grid->cols + x]);
+			}
+			fprintf(file, "\n");
+		}
+	}
+	return fclose(file) == 0 ? 0 : -1;
+}
+
+enum shading_plane
+shading_plane_at(enum bayer_order order, int x, int y)
+{
+	return quad_planes[order][(y & 1) * 2 + (x & 1)];
+}
+
+// Grid point left of or above a position and the weight of the next one
+static inline int
+grid_position(float position, int points, float *weight)
+{
+	float p = MAX(0.0f, MIN(points - 1, position * (points - 1)));
+	int i = MIN(points - 2, (int)p);
+	*weight = p - i;
+	return i;
+}
+
+float
+shading_gain(const struct shading_grid *grid, enum shading_plane plane, float u, float v)
+{
+	float fx, fy;
+	int x = grid_position(u, grid->cols, &fx);
+	int y = grid_position(v, grid->rows, &fy);
+	const float *top = grid->gains[plane] + y * grid->cols;
+	const float *bottom = top + grid->cols;
+
+	float t = top[x] + (top[x + 1] - top[x]) * fx;
+	float b = bottom[x] + (bottom[x + 1] - bottom[x]) * fx;
+	return t + (b - t) * fy;
+}
+
+static inline uint16_t
+fixed_gain(float gain)
+{
+	return MIN(65535, lroundf(gain * (1 << SHADING_SHIFT)));
+}
+
+// Pixels sample the grid at their centers
+uint16_t *
+shading_table(const struct shading_grid *grid, enum bayer_order order, int width, int height)
+{
+	uint16_t *table = malloc((size_t)width * height * sizeof(uint16_t));
+	int *col = malloc(width * sizeof(int));
+	float *weight = malloc(width * sizeof(float));
+	float *line[4];
+
+	if (!table || !col || !weight) {
+		free(table);
+		free(col);
+		free(weight);
+		return NULL;
+	}
+	for (int p = 0; p < 4; p++) {
+		line[p] = malloc(grid->cols * sizeof(float));
+	}
+
+	for (int x = 0; x < width; x++) {
+		col[x] = grid_position((x + 0.5f) / width, grid->cols, &weight[x]);
+	}
+
+	// Interpolate between the grid rows once per row, then along the row
+	for (int y = 0; y < height; y++) {
+		float fy;
+		int row = grid_position((y + 0.5f) / height, grid->rows, &fy);
+		uint16_t *out = table + (size_t)y * width;
+
+		for (int p = 0; p < 4; p++) {
+			const float *top = grid->gains[p] + row * grid->cols;
+			const float *bottom = top + grid->cols;
+			for (int i = 0; i < grid->cols; i++) {
+				line[p][i] = top[i] + (bottom[i] - top[i]) * fy;
+			}
+		}
+
+		const float *even = line[shading_plane_at(order, 0, y)];
+		const float *odd = line[shading_plane_at(order, 1, y)];
+		for (int x = 0; x < width; x++) {
+			const float *l = (x & 1) ? odd : even;
+			int i = col[x];
+			out[x] = fixed_gain(l[i] + (l[i + 1] - l[i]) * weight[x]);
+		}
+	}
+
+	for (int p = 0; p < 4; p++) {
+		free(line[p]);
+	}
+	free(col);
+	free(weight);
+	return table;
+}
+
+uint16_t *
+shading_preview_table(const struct shading_grid *grid, int width, int height,
+	float left, float top, float right, float bottom)
+{
+	uint16_t *table = malloc((size_t)width * height * 3 * sizeof(uint16_t));
+	if (!table) {
+		return NULL;
+	}
+
+	for (int y = 0; y < height; y++) {
+		uint16_t *r = table + (size_t)y * width * 3;
+		uint16_t *g = r + width;
+		uint16_t *b = g + width;
+		float v = top + (y + 0.5f) / height * (bottom - top);
+
+		for (int x = 0; x < width; x++) {
+			float u = left + (x + 0.5f) / width * (right - left);
+			r[x] = fixed_gain(shading_gain(grid, SHADING_R, u, v));
+			g[x] = fixed_gain((shading_gain(grid, SHADING_GR, u, v) +
+				shading_gain(grid, SHADING_GB, u, v)) / 2);
+			b[x] = fixed_gain(shading_gain(grid, SHADING_B, u, v));
+		}
+	}
+	return table;
+}
+
+void
+shading_apply_row(const uint16_t *gains, uint16_t *row, int width, uint16_t black, uint16_t white)
+{
+	int x = 0;
+
+#ifdef __ARM_NEON
+	const uint16x8_t vblack = vdupq_n_u16(black);
+	const uint16x8_t vwhite = vdupq_n_u16(white);
+
+	for (; x + 8 <= width; x += 8) {
+		uint16x8_t v = vld1q_u16(row + x);
+		uint16x8_t g = vld1q_u16(gains + x);
+		uint16x8_t d = vqsubq_u16(v, vblack);
+		uint32x4_t lo = vmull_u16(vget_low_u16(d), vget_low_u16(g));
+		uint32x4_t hi = vmull_u16(vget_high_u16(d), vget_high_u16(g));
+		d = vcombine_u16(vqrshrn_n_u32(lo, SHADING_SHIFT), vqrshrn_n_u32(hi, SHADING_SHIFT));
+		d = vminq_u16(vqaddq_u16(d, vblack), vwhite);
+		vst1q_u16(row + x, vbslq_u16(vcltq_u16(v, vblack), v, d));
+	}
+#endif
+
+	// Samples below the black level are only noise, they're left alone
+	// Without branches, so compilers vectorize it where there is no NEON
+	for (; x < width; x++) {
+		uint32_t v = row[x];
+		uint32_t d = v > black ? v - black : 0;
+		d = MIN(white, black + ((d * gains[x] + (1 << (SHADING_SHIFT - 1))) >> SHADING_SHIFT));
+		row[x] = v < black ? v : d;
+	}
+}
+
+// Every sample counts toward the grid point nearest to it
+void
+shading_measure(struct shading_grid *grid, const uint8_t *raw, enum raw_layout layout,
+	enum bayer_order order, int width, int height, int stride, int blacklevel)
+{
+	int points = grid->cols * grid->rows;
+	double *sums = calloc(4 * points, sizeof(double));
+	uint32_t *counts = calloc(4 * points, sizeof(uint32_t));
+	uint16_t *line = malloc(width * sizeof(uint16_t));
+	int *col = malloc(width * sizeof(int));
+
+	for (int x = 0; x < width; x++) {
+		col[x] = lroundf((x + 0.5f) / width * (grid->cols - 1));
+	}
+
+	for (int y = 0; y < height; y++) {
+		int row = lroundf((y + 0.5f) / height * (grid->rows - 1));
+		raw_unpack_row(layout, raw + (size_t)y * stride, line, width);
+		for (int x = 0; x < width; x++) {
+			int i = shading_plane_at(order, x, y) * points + row * grid->cols + col[x];
+			sums[i] += MAX(0, line[x] - blacklevel);
+			counts[i]++;
+		}
+	}
+
+	for (int p = 0; p < 4; p++) {
+		for (int i = 0; i < points; i++) {
+			int n = p * points + i;
+			grid->gains[p][i] += counts[n] ? sums[n] / counts[n] : 0;
+		}
+	}
+	grid->frames++;
+
+	free(sums);
+	free(counts);
+	free(line);
+	free(col);
+}
+
+// The edge points only see the half of their cell inside the frame, which is
+// off by a lot where the falloff is steepest. They're extrapolated from the
+// three points next to them instead, which is exact for a quadratic falloff.
+static void
+extrapolate_edges(float *level, int count, int step)
+{
+	if (count < 5) {
+		return;
+	}
+	float *last = level + (count - 1) * step;
+	level[0] = MAX(0, 3 * level[step] - 3 * level[2 * step] + level[3 * step]);
+	last[0] = MAX(0, 3 * last[-step] - 3 * last[-2 * step] + last[-3 * step]);
+}
+
+int
+shading_finish(struct shading_grid *grid)
+{
+	int points = grid->cols * grid->rows;
+
+	if (grid->frames == 0) {
+		return -1;
+	}
+
+	for (int p = 0; p < 4; p++) {
+		for (int y = 0; y < grid->rows; y++) {
+			extrapolate_edges(grid->gains[p] + y * grid->cols, grid->cols, 1);
+		}
+		for (int x = 0; x < grid->cols; x++) {
+			extrapolate_edges(grid->gains[p] + x, grid->rows, grid->cols);
+		}
+	}
+
+	for (int p = 0; p < 4; p++) {
+		float brightest = 0;
+		for (int i = 0; i < points; i++) {
+			brightest = MAX(brightest, grid->gains[p][i]);
+		}
+		// Nothing to measure against without any light
+		if (brightest <= 0) {
+			return -1;
+		}
+		for (int i = 0; i < points; i++) {
+			float level = grid->gains[p][i];
+			grid->gains[p][i] = level > brightest / 16 ? brightest / level : 15.99f;
+		}
+	}
+	grid->frames = 0;
+	return 0;
+}
@@ -0,0 +1,75 @@
+#ifndef SHADING_H
+#define SHADING_H
+
+#include <stdint.h>
+#include "quickdebayer.h"
+
+// Lens shading calibration of a camera, a coarse grid of gains for each of
+// the four bayer colors that spans the whole frame. The gain of a point
+// brings a flat field up to the level of the brightest point of its color.
+//
+// Stored as text, whitespace separated and # starts a comment:
+//
+//   size <cols> <rows>
+//   r  <cols * rows gains, row by row>
+//   gr <...>   green next to red
+//   gb <...>   green next to blue
+//   b  <...>
+//
+// Gains are expanded to Q4.12 fixed point for the frame size they're used at.
+#define SHADING_SHIFT 12
+#define SHADING_MAX_POINTS 64
+
+// Grid size the calibration measures
+#define SHADING_CALIBRATION_COLS 17
+#define SHADING_CALIBRATION_ROWS 13
+
+enum shading_plane {
+	SHADING_R,
+	SHADING_GR,
+	SHADING_GB,
+	SHADING_B,
+};
+
+struct shading_grid {
+	int cols;
+	int rows;
+	// cols * rows gains per plane, row by row
+	float *gains[4];
+	// Number of frames measured, only while calibrating
+	int frames;
+};
+
+struct shading_grid *shading_grid_new(int cols, int rows);
+void shading_grid_free(struct shading_grid *grid);
+struct shading_grid *shading_load(const char *path);
+int shading_save(const char *path, const struct shading_grid *grid);
+
+// Plane of the sample at x, y for a bayer order
+enum shading_plane shading_plane_at(enum bayer_order order, int x, int y);
+
+// Gain of a plane at a position relative to the frame, 0 to 1 on both axes
+float shading_gain(const struct shading_grid *grid, enum shading_plane plane, float u, float v);
+
+// One gain per pixel in the same order as the samples of the frame, so the
+// table streams through the cache alongside the pixels
+uint16_t *shading_table(const struct shading_grid *grid, enum bayer_order order, int width, int height);
+
+// Red, green and blue gains for every pixel of a debayered image of the part
+// of the frame from left, top to right, bottom, relative to the frame size
+// like shading_gain(). Each row is width red gains followed by the green and
+// blue ones.
+uint16_t *shading_preview_table(const struct shading_grid *grid, int width, int height,
+	float left, float top, float right, float bottom);
+
+// Applies a row of gains to unpacked samples above the black level, clipping
+// at the white level
+void shading_apply_row(const uint16_t *gains, uint16_t *row, int width, uint16_t black, uint16_t white);
+
+// Adds the flat field in a frame to a grid made by shading_grid_new(), then
+// turns the sums into gains once all frames are in
+void shading_measure(struct shading_grid *grid, const uint8_t *raw, enum raw_layout layout,
+	enum bayer_order order, int width, int height, int stride, int blacklevel);
+int shading_finish(struct shading_grid *grid);
+
+#endif
@@ -0,0 +1,427 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+#include <gdk-pixbuf/gdk-pixbuf.h>
+#include "dng.h"
+#include "quickdebayer.h"
+#include "synthetic.h"
+
+// Throughput of every stage between the sensor and the files on the PinePhone
+// sized frames. Every stage runs until it has taken a while and the fastest
+// run counts, that is the least disturbed by the rest of the system.
+//
+// --save writes the results to a file, --baseline compares against one and
+// fails when a stage got slower than the threshold in percent allows.
+
+#define MIN_RUNS 3
+#define MIN_SECONDS 0.5
+
+struct result {
+	char name[48];
+	double ns_per_pixel;
+};
+
+static struct result *results = NULL;
+static int num_results = 0;
+static int allocated_results = 0;
+
+static double
+now()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+typedef void (*stage_fn)(void *data);
+
+// Pixels and bytes are what the stage consumes, for the raw stages that's
+// the sensor frame
+static void
+run_stage(const char *name, stage_fn fn, void *data, size_t pixels, size_t bytes)
+{
+	double best = 1e9;
+	double start = now();
+
+	for (int run = 0; run < MIN_RUNS || now() - start < MIN_SECONDS; run++) {
+		double t = now();
+		fn(data);
+		best = MIN(best, now() - t);
+	}
+
+	double ns_per_pixel = best * 1e9 / pixels;
+	printf("%-32s %8.2f ns/pixel %9.1f MB/s\n", name, ns_per_pixel, bytes / best / 1e6);
+
+	if (num_results == allocated_results) {
+		allocated_results = allocated_results ? allocated_results * 2 : 64;
+		results = realloc(results, allocated_results * sizeof(struct result));
+	}
+	snprintf(results[num_results].name, sizeof(results[0].name), "%s", name);
+	results[num_results].ns_per_pixel = ns_per_pixel;
+	num_results++;
+}
+
+struct raw_stage {
+	const struct synthetic_frame *frame;
+	const struct debayer_kernels *kernels;
+	const struct preview_color *color;
+	uint8_t *out;
+	const uint16_t *shading;
+	const struct badpixels *badpixels;
+	int width;
+	int height;
+	int skip;
+	int zoom;
+};
+
+static void
+stage_unpack(void *data)
+{
+	struct raw_stage *s = data;
+	uint16_t *row = (uint16_t *)s->out;
+	for (int y = 0; y < s->frame->height; y++) {
+		raw_unpack_row(s->frame->layout, s->frame->data + (size_t)y * s->frame->stride,
+			row, s->frame->width);
+	}
+}
+
+static void
+stage_quick(void *data)
+{
+	struct raw_stage *s = data;
+	s->kernels->quick(s->frame->data, s->out, s->frame->width, s->frame->height,
+		s->frame->stride, s->width * 3, s->skip);
+}
+
+static void
+stage_preview(void *data)
+{
+	struct raw_stage *s = data;
+	s->kernels->binned(s->frame->data, s->out, s->frame->width, s->frame->height,
+		s->frame->stride, s->width, s->height, s->width * 3, s->color);
+}
+
+// Only the middle of the frame, like the app converts the preview when it's
+// zoomed in
+static void
+stage_preview_zoom(void *data)
+{
+	struct raw_stage *s = data;
+	int width = s->frame->width / s->zoom & ~3;
+	int height = s->frame->height / s->zoom & ~1;
+	int x = (s->frame->width - width) / 2 & ~3;
+	int y = (s->frame->height - height) / 2 & ~1;
+	int dst_width = MIN(s->width, width / 2);
+	int dst_height = MIN(s->height, height / 2);
+	s->kernels->binned(s->frame->data + (size_t)y * s->frame->stride +
+		raw_bytes_per_line(s->frame->layout, x), s->out, width, height, s->frame->stride,
+		dst_width, dst_height, dst_width * 3, s->color);
+}
+
+static void
+stage_luma(void *data)
+{
+	struct raw_stage *s = data;
+	quick_luma(s->frame->data, s->out, s->frame->width, s->frame->height,
+		s->frame->stride, s->frame->width / 2, s->frame->layout);
+}
+
+// Unpacking and lens shading of every row, like the DNG writer does
+static void
+stage_shading(void *data)
+{
+	struct raw_stage *s = data;
+	uint16_t *row = (uint16_t *)s->out;
+	int white = (1 << raw_bits(s->frame->layout)) - 1;
+	for (int y = 0; y < s->frame->height; y++) {
+		raw_unpack_row(s->frame->layout, s->frame->data + (size_t)y * s->frame->stride,
+			row, s->frame->width);
+		shading_apply_row(s->shading + (size_t)y * s->frame->width, row, s->frame->width, 16, white);
+	}
+}
+
+// Only the listed samples are touched, the rows are already unpacked
+static void
+stage_badpixels(void *data)
+{
+	struct raw_stage *s = data;
+	for (int y = 0; y < s->frame->height; y++) {
+		badpixels_apply_row(s->badpixels, y, s->frame->samples + (size_t)y * s->frame->width);
+	}
+}
+
+static void
+stage_dng(void *data)
+{
+	static const float matrix[] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+	static const float neutral[] = {1, 1, 1};
+	struct raw_stage *s = data;
+	struct dng_info info = {
+		.width = s->frame->width,
+		.height = s->frame->height,
+		.stride = s->frame->stride,
+		.layout = s->frame->layout,
+		.cfapattern = "\002\001\001\000",
+		.make = "Megapixels",
+		.model = "Benchmark",
+		.colormatrix = matrix,
+		.neutral = neutral,
+		.time = 1600000000,
+	};
+
+	TIFF *tif = TIFFOpen("bench.dng", "w");
+	if (!tif) {
+		g_printerr("Could not open bench.dng\n");
+		exit(1);
+	}
+	dng_write(tif, s->frame->data, &info);
+	TIFFClose(tif);
+}
+
+static void
+stage_rotate(void *data)
+{
+	GdkPixbuf *rotated = gdk_pixbuf_rotate_simple(data, GDK_PIXBUF_ROTATE_COUNTERCLOCKWISE);
+	g_object_unref(rotated);
+}
+
+static void
+stage_jpeg(void *data)
+{
+	gchar *buffer;
+	gsize size;
+	GError *error = NULL;
+
+	if (!gdk_pixbuf_save_to_buffer(data, &buffer, &size, "jpeg", &error, "quality", "90", NULL)) {
+		g_printerr("Could not encode jpeg: %s\n", error->message);
+		exit(1);
+	}
+	g_free(buffer);
+}
+
+static const char *layout_names[] = {"8", "10", "12", "10p", "12p"};
+
+static void
+bench_frame(int width, int height)
+{
+	static const float matrix[] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+	static const float neutral[] = {1, 1, 1};
+	static const enum raw_layout layouts[] = {RAW_8, RAW_10, RAW_12, RAW_10P, RAW_12P};
+	struct synthetic_frame frame;
+	struct preview_color color;
+	char name[48];
+	size_t pixels = (size_t)width * height;
+	// Same sizes as the app on the 720 pixel wide portrait screen, the proxy
+	// jpeg is written at the preview size too
+	int preview_width = MIN(width / 2, 720 * width / height);
+	int preview_height = MIN(height / 2, preview_width * height / width);
+
+	// Room for the luma plane or the largest debayered output
+	uint8_t *out = malloc(MAX((size_t)width * height, (size_t)preview_width * preview_height * 3));
+
+	// Gains from 1 in the center to 2 in the corners
+	struct shading_grid *grid = shading_grid_new(SHADING_CALIBRATION_COLS, SHADING_CALIBRATION_ROWS);
+	for (int p = 0; p < 4; p++) {
+		for (int y = 0; y < grid->rows; y++) {
+			for (int x = 0; x < grid->cols; x++) {
+				float u = (float)x / (grid->cols - 1) - 0.5f;
+				float v = (float)y / (grid->rows - 1) - 0.5f;
+				grid->gains[p][y * grid->cols + x] = 1 + 2 * (u * u + v * v);
+			}
+		}
+	}
+	uint16_t *shading = shading_table(grid, BAYER_BGGR, width, height);
+
+	for (int i = 0; i < ARRAY_SIZE(layouts); i++) {
+		enum raw_layout layout = layouts[i];
+		int bits = raw_bits(layout);
+		synthetic_frame_init(&frame, width, height, layout);
+		preview_color_init(&color, bits, 10 << (bits - 8), 0, matrix, neutral);
+
+		struct raw_stage s = {
+			.frame = &frame,
+			.kernels = debayer_kernels_get(BAYER_BGGR, layout),
+			.color = &color,
+			.out = out,
+			.shading = shading,
+		};
+		size_t bytes = (size_t)frame.stride * height;
+
+		snprintf(name, sizeof(name), "unpack-%s-%dx%d", layout_names[layout], width, height);
+		run_stage(name, stage_unpack, &s, pixels, bytes);
+
+		// Same skip as the app, 3 above 1280 wide
+		s.skip = width > 1280 ? 3 : 2;
+		s.width = width / (s.skip * 2);
+		s.height = height / (s.skip * 2);
+		snprintf(name, sizeof(name), "quick-%s-%dx%d", layout_names[layout], width, height);
+		run_stage(name, stage_quick, &s, pixels, bytes);
+
+		s.width = preview_width;
+		s.height = preview_height;
+		snprintf(name, sizeof(name), "preview-%s-%dx%d", layout_names[layout], width, height);
+		run_stage(name, stage_preview, &s, pixels, bytes);
+
+		// With the low light average in the same pass
+		struct preview_color lowlight = color;
+		lowlight.accumulator = preview_accumulator_new(preview_width, preview_height);
+		s.color = &lowlight;
+		snprintf(name, sizeof(name), "preview-lowlight-%s-%dx%d", layout_names[layout], width, height);
+		run_stage(name, stage_preview, &s, pixels, bytes);
+		preview_accumulator_free(lowlight.accumulator);
+		s.color = &color;
+
+		// Per frame like the full preview, so the time drops with the zoom
+		for (s.zoom = 2; s.zoom <= 4; s.zoom *= 2) {
+			snprintf(name, sizeof(name), "preview-zoom%d-%s-%dx%d", s.zoom, layout_names[layout],
+				width, height);
+			run_stage(name, stage_preview_zoom, &s, pixels, bytes / (s.zoom * s.zoom));
+		}
+
+		snprintf(name, sizeof(name), "luma-%s-%dx%d", layout_names[layout], width, height);
+		run_stage(name, stage_luma, &s, pixels, bytes);
+
+		snprintf(name, sizeof(name), "shading-%s-%dx%d", layout_names[layout], width, height);
+		run_stage(name, stage_shading, &s, pixels, bytes);
+
+		snprintf(name, sizeof(name), "dng-%s-%dx%d", layout_names[layout], width, height);
+		run_stage(name, stage_dng, &s, pixels, bytes);
+		unlink("bench.dng");
+
+		synthetic_frame_free(&frame);
+	}
+
+	// The display side on the 8 bit mode, rotating the preview for the
+	// portrait screen and encoding it as the proxy jpeg
+	synthetic_frame_init(&frame, width, height, RAW_8);
+
+	// A defect every 2000 pixels is a bad sensor
+	int defects = pixels / 2000;
+	uint16_t *coords = malloc(defects * 2 * sizeof(uint16_t));
+	uint32_t state = 1;
+	for (int i = 0; i < defects; i++) {
+		coords[i * 2] = synthetic_random(&state) % width;
+		coords[i * 2 + 1] = synthetic_random(&state) % height;
+	}
+	struct badpixels *badpixels = badpixels_new(width, height, coords, defects);
+	struct raw_stage b = {
+		.frame = &frame,
+		.badpixels = badpixels,
+	};
+	snprintf(name, sizeof(name), "badpixels-%d-%dx%d", defects, width, height);
+	run_stage(name, stage_badpixels, &b, pixels, pixels * sizeof(uint16_t));
+	badpixels_free(badpixels);
+	free(coords);
+
+	preview_color_init(&color, 8, 10, 0, matrix, neutral);
+	const struct debayer_kernels *kernels = debayer_kernels_get(BAYER_BGGR, RAW_8);
+	GdkPixbuf *pixbuf = gdk_pixbuf_new(GDK_COLORSPACE_RGB, FALSE, 8, preview_width, preview_height);
+	kernels->binned(frame.data, gdk_pixbuf_get_pixels(pixbuf), width, height, frame.stride,
+		preview_width, preview_height, gdk_pixbuf_get_rowstride(pixbuf), &color);
+	size_t preview_pixels = (size_t)preview_width * preview_height;
+
+	snprintf(name, sizeof(name), "rotate-%dx%d", preview_width, preview_height);
+	run_stage(name, stage_rotate, pixbuf, preview_pixels, preview_pixels * 3);
+	snprintf(name, sizeof(name), "jpeg-%dx%d", preview_width, preview_height);
+	run_stage(name, stage_jpeg, pixbuf, preview_pixels, preview_pixels * 3);
+	g_object_unref(pixbuf);
+
+	synthetic_frame_free(&frame);
+	free(shading);
+	shading_grid_free(grid);
+	free(out);
+}
+
+static int
+save_results(const char *path)
+{
+	FILE *file = fopen(path, "w");
+	if (!file) {
+		g_printerr("Could not write %s\n", path);
+		return -1;
+	}
+	for (int i = 0; i < num_results; i++) {
+		fprintf(file, "%s %.3f\n", results[i].name, results[i].ns_per_pixel);
+	}
+	fclose(file);
+	return 0;
+}
+
+// Returns the number of stages slower than the baseline by more than the
+// threshold or missing from the results, new stages aren't in the baseline
+// yet and are skipped
+static int
+compare_results(const char *path, int threshold)
+{
+	char name[48];
+	double baseline;
+	int regressions = 0;
+
+	FILE *file = fopen(path, "r");
+	if (!file) {
+		g_printerr("Could not read %s\n", path);
+		return -1;
+	}
+	while (fscanf(file, "%47s %lf", name, &baseline) == 2) {
+		int found = 0;
+		for (int i = 0; i < num_results; i++) {
+			if (strcmp(results[i].name, name) != 0) {
+				continue;
+			}
+			found = 1;
+			double change = (results[i].ns_per_pixel / baseline - 1) * 100;
+			if (change > threshold) {
+				printf("REGRESSION %s %.2f ns/pixel, baseline %.2f (+%.0f%%)\n",
+					name, results[i].ns_per_pixel, baseline, change);
+				regressions++;
+			}
+		}
+		if (!found) {
+			printf("MISSING %s, baseline %.2f ns/pixel\n", name, baseline);
+			regressions++;
+		}
+	}
+	fclose(file);
+	return regressions;
+}
+
+int
+main(int argc, char *argv[])
+{
+	const char *save = NULL;
+	const char *baseline = NULL;
+	int threshold = 15;
+
+	for (int i = 1; i < argc; i++) {
+		if (strcmp(argv[i], "--save") == 0 && i + 1 < argc) {
+			save = argv[++i];
+		} else if (strcmp(argv[i], "--baseline") == 0 && i + 1 < argc) {
+			baseline = argv[++i];
+		} else if (strcmp(argv[i], "--threshold") == 0 && i + 1 < argc) {
+			threshold = atoi(argv[++i]);
+		} else {
+			g_printerr("Usage: %s [--save FILE] [--baseline FILE] [--threshold PERCENT]\n", argv[0]);
+			return 1;
+		}
+	}
+
+	setenv("TZ", "UTC", 1);
+	dng_init();
+
+	bench_frame(2592, 1944);
+	bench_frame(800, 600);
+
+	if (save && save_results(save) < 0) {
+		return 1;
+	}
+	if (baseline) {
+		int regressions = compare_results(baseline, threshold);
+		if (regressions != 0) {
+			return 1;
+		}
+		printf("No stage more than %d%% slower than %s\n", threshold, baseline);
+	}
+	return 0;
+}
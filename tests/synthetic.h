@@ -0,0 +1,155 @@
+#ifndef SYNTHETIC_H
+#define SYNTHETIC_H
+
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "rawformat.h"
+
+#define ARRAY_SIZE(array) \
+    (sizeof(array) / sizeof(*array))
+
+// Deterministic raw frames for the tests and benchmarks, a diagonal gradient
+// with noise on top so every sample value and every bit of the packed
+// layouts gets used
+
+struct synthetic_frame {
+	int width;
+	int height;
+	int stride;
+	enum raw_layout layout;
+	// One right aligned sample per pixel, what the frame should unpack to
+	uint16_t *samples;
+	uint8_t *data;
+};
+
+static inline uint32_t
+synthetic_random(uint32_t *state)
+{
+	uint32_t x = *state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return *state = x;
+}
+
+static inline void
+synthetic_pack_row(enum raw_layout layout, const uint16_t *in, uint8_t *out, int width)
+{
+	switch (layout) {
+		case RAW_10:
+		case RAW_12:
+			memcpy(out, in, width * sizeof(uint16_t));
+			break;
+		case RAW_10P:
+			for (int x = 0; x < width; x += 4) {
+				uint8_t *group = out + x / 4 * 5;
+				group[4] = 0;
+				for (int i = 0; i < 4; i++) {
+					group[i] = in[x + i] >> 2;
+					group[4] |= (in[x + i] & 3) << (2 * i);
+				}
+			}
+			break;
+		case RAW_12P:
+			for (int x = 0; x < width; x += 2) {
+				uint8_t *group = out + x / 2 * 3;
+				group[0] = in[x] >> 4;
+				group[1] = in[x + 1] >> 4;
+				group[2] = (in[x] & 0x0f) | ((in[x + 1] & 0x0f) << 4);
+			}
+			break;
+		default:
+			for (int x = 0; x < width; x++) {
+				out[x] = in[x];
+			}
+			break;
+	}
+}
+
+// The stride is padded like some drivers do, to catch code that assumes
+// tightly packed lines
+static inline void
+synthetic_frame_init(struct synthetic_frame *frame, int width, int height, enum raw_layout layout)
+{
+	int bits = raw_bits(layout);
+	uint32_t state = 0x12345678 ^ (width * 31 + height * 7 + layout);
+
+	frame->width = width;
+	frame->height = height;
+	frame->layout = layout;
+	frame->stride = (raw_bytes_per_line(layout, width) + 63) / 64 * 64;
+	frame->samples = malloc((size_t)width * height * sizeof(uint16_t));
+	frame->data = calloc((size_t)frame->stride * height, 1);
+
+	for (int y = 0; y < height; y++) {
+		uint16_t *row = frame->samples + (size_t)y * width;
+		for (int x = 0; x < width; x++) {
+			int gradient = (x + y) * ((1 << bits) - 1) / (width + height);
+			int noise = synthetic_random(&state) % (1 << (bits - 3));
+			row[x] = (gradient + noise) & ((1 << bits) - 1);
+		}
+		synthetic_pack_row(layout, row, frame->data + (size_t)y * frame->stride, width);
+	}
+}
+
+static inline void
+synthetic_frame_free(struct synthetic_frame *frame)
+{
+	free(frame->samples);
+	free(frame->data);
+}
+
+// FNV-1a, for the golden checksums
+static inline uint64_t
+checksum(const uint8_t *data, size_t size, uint64_t hash)
+{
+	for (size_t i = 0; i < size; i++) {
+		hash = (hash ^ data[i]) * 0x100000001b3ULL;
+	}
+	return hash;
+}
+
+#define CHECKSUM_INIT 0xcbf29ce484222325ULL
+
+// Failed checks of the test program, counted in a function so programs that
+// don't check anything don't get an unused variable
+static inline int *
+check_failures()
+{
+	static int failures = 0;
+	return &failures;
+}
+
+static inline void
+check(int ok, const char *what, const char *detail)
+{
+	if (!ok) {
+		printf("FAIL %s %s\n", what, detail);
+		(*check_failures())++;
+	}
+}
+
+// The exit status of the test program
+static inline int
+check_summary()
+{
+	if (*check_failures()) {
+		printf("%d checks failed\n", *check_failures());
+		return 1;
+	}
+	printf("All checks passed\n");
+	return 0;
+}
+
+// Fixtures for the loaders of the text files
+static inline void
+write_text_file(const char *path, const char *text)
+{
+	FILE *file = fopen(path, "w");
+	fputs(text, file);
+	fclose(file);
+}
+
+#endif
@@ -0,0 +1,160 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "badpixels.h"
+#include "synthetic.h"
+
+// Loading and saving lists, the replacement samples that are picked for
+// defects next to each other and at the edges, and the calibration on
+// synthetic dark frames with known hot pixels
+
+static const struct badpixel *
+find(const struct badpixels *map, int x, int y)
+{
+	for (int i = 0; i < map->count; i++) {
+		if (map->pixels[i].x == x && map->pixels[i].y == y) {
+			return &map->pixels[i];
+		}
+	}
+	return NULL;
+}
+
+static void
+test_load_save()
+{
+	static const uint16_t coords[] = {30, 2, 5, 1, 7, 1, 5, 1, 0, 0};
+	struct badpixels *map = badpixels_new(40, 3, coords, 5);
+	int ok = map && map->count == 4;
+
+	// Sorted by row and indexed per row, the duplicate is gone
+	ok = ok && map->pixels[0].y == 0 && map->pixels[1].x == 5 && map->pixels[2].x == 7 &&
+		map->pixels[3].x == 30;
+	ok = ok && map->rows[0] == 0 && map->rows[1] == 1 && map->rows[2] == 3 && map->rows[3] == 4;
+	check(ok, "new", "sorted");
+
+	ok = badpixels_save("test_badpixels.txt", map) == 0;
+	struct badpixels *loaded = ok ? badpixels_load("test_badpixels.txt") : NULL;
+	ok = loaded && loaded->width == 40 && loaded->height == 3 && loaded->count == map->count &&
+		memcmp(loaded->pixels, map->pixels, map->count * sizeof(struct badpixel)) == 0;
+	check(ok, "load", "saved list");
+	badpixels_free(loaded);
+
+	write_text_file("test_badpixels.txt", "# comment\nsize 10 10\n1 2 # more\n3 4\n");
+	loaded = badpixels_load("test_badpixels.txt");
+	check(loaded && loaded->count == 2, "load", "comments");
+	badpixels_free(loaded);
+
+	// Outside the frame and half a coordinate are rejected
+	write_text_file("test_badpixels.txt", "size 10 10\n1 2\n3 10\n");
+	check(badpixels_load("test_badpixels.txt") == NULL, "load", "outside");
+	write_text_file("test_badpixels.txt", "size 10 10\n1 2\n3\n");
+	check(badpixels_load("test_badpixels.txt") == NULL, "load", "half");
+
+	unlink("test_badpixels.txt");
+	badpixels_free(map);
+}
+
+static void
+test_neighbors()
+{
+	// A pair two apart, one at each edge and a run of five in one color
+	static const uint16_t coords[] = {10, 0, 12, 0, 0, 0, 39, 0, 1, 1, 3, 1, 5, 1, 7, 1, 9, 1};
+	struct badpixels *map = badpixels_new(40, 2, coords, 9);
+	const struct badpixel *p;
+
+	p = find(map, 10, 0);
+	check(p && p->left == 8 && p->right == 14, "neighbors", "pair left");
+	p = find(map, 12, 0);
+	check(p && p->left == 8 && p->right == 14, "neighbors", "pair right");
+	p = find(map, 0, 0);
+	check(p && p->left == 2 && p->right == 2, "neighbors", "left edge");
+	p = find(map, 39, 0);
+	check(p && p->left == 37 && p->right == 37, "neighbors", "right edge");
+	// Too far from any good sample on one side, too close to the edge on the other
+	p = find(map, 1, 1);
+	check(p && p->left == 1 && p->right == 1, "neighbors", "run start");
+	p = find(map, 9, 1);
+	check(p && p->left == 11 && p->right == 11, "neighbors", "run end");
+	p = find(map, 5, 1);
+	check(p && p->left == 11 && p->right == 11, "neighbors", "run middle");
+
+	uint16_t row[40];
+	for (int x = 0; x < 40; x++) {
+		row[x] = 100 + x;
+	}
+	row[10] = row[12] = 1023;
+	badpixels_apply_row(map, 0, row);
+	check(row[10] == 111 && row[12] == 111 && row[0] == 102 && row[39] == 137 && row[11] == 111,
+		"apply", "row");
+
+	badpixels_free(map);
+}
+
+static void
+test_calibrate(enum raw_layout layout, const char *name)
+{
+	int width = 320, height = 240, frames = 4;
+	int white = (1 << raw_bits(layout)) - 1;
+	int black = white / 16;
+	struct synthetic_frame frame;
+	struct badpixels_calibration *cal = badpixels_calibration_new(width, height, layout);
+	uint32_t state = 7;
+	static const int hot[][2] = {{0, 0}, {17, 3}, {19, 3}, {100, 100}, {319, 239}, {200, 51}};
+	int count = ARRAY_SIZE(hot);
+
+	synthetic_frame_init(&frame, width, height, layout);
+	for (int f = 0; f < frames; f++) {
+		for (int y = 0; y < height; y++) {
+			uint16_t *row = frame.samples + y * width;
+			for (int x = 0; x < width; x++) {
+				// Noise and a little glow toward the right
+				row[x] = black + synthetic_random(&state) % (white / 64 + 1) + x * white / 2048;
+			}
+			for (int i = 0; i < count; i++) {
+				if (hot[i][1] == y) {
+					// The last one is only warm, but in every frame
+					row[hot[i][0]] = i == count - 1 ? row[hot[i][0]] + white / 16 : white - f;
+				}
+			}
+			synthetic_pack_row(layout, row, frame.data + y * frame.stride, width);
+		}
+		badpixels_measure(cal, frame.data, layout, frame.stride);
+	}
+
+	struct badpixels *map = badpixels_finish(cal);
+	int ok = map && map->count == count;
+	for (int i = 0; i < count && ok; i++) {
+		ok = find(map, hot[i][0], hot[i][1]) != NULL;
+	}
+	check(ok, "calibrate", name);
+	badpixels_free(map);
+
+	// A frame with light in it isn't a dark frame
+	badpixels_calibration_free(cal);
+	cal = badpixels_calibration_new(width, height, layout);
+	for (int y = 0; y < height; y++) {
+		uint16_t *row = frame.samples + y * width;
+		for (int x = 0; x < width; x++) {
+			row[x] = synthetic_random(&state) & white;
+		}
+		synthetic_pack_row(layout, row, frame.data + y * frame.stride, width);
+	}
+	badpixels_measure(cal, frame.data, layout, frame.stride);
+	check(badpixels_finish(cal) == NULL, "calibrate light", name);
+
+	badpixels_calibration_free(cal);
+	synthetic_frame_free(&frame);
+}
+
+int
+main(int argc, char *argv[])
+{
+	test_load_save();
+	test_neighbors();
+	test_calibrate(RAW_8, "8");
+	test_calibrate(RAW_10P, "10p");
+	test_calibrate(RAW_12P, "12p");
+
+	return check_summary();
+}
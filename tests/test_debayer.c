@@ -0,0 +1,353 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include "quickdebayer.h"
+#include "synthetic.h"
+
+// The unpacking and every debayer variant are checked against plain
+// reference versions on small frames for every CFA order and layout, and
+// the full size outputs against golden checksums. The C and NEON paths are
+// bit exact, so the checksums hold on every architecture.
+
+static const char *layout_names[] = {"8", "10", "12", "10p", "12p"};
+static const char *layout_enums[] = {"RAW_8", "RAW_10", "RAW_12", "RAW_10P", "RAW_12P"};
+static const char *order_names[] = {"bggr", "gbrg", "grbg", "rggb"};
+
+// Color in each quad position, 0 = red, 1 = green, 2 = blue
+static const int order_colors[][4] = {
+	[BAYER_BGGR] = {2, 1, 1, 0},
+	[BAYER_GBRG] = {1, 2, 0, 1},
+	[BAYER_GRBG] = {1, 0, 2, 1},
+	[BAYER_RGGB] = {0, 1, 1, 2},
+};
+
+static void
+check_variant(int ok, const char *what, const char *order, const char *layout)
+{
+	char detail[32];
+	snprintf(detail, sizeof(detail), "%s%s", order, layout);
+	check(ok, what, detail);
+}
+
+static int
+sample8(const struct synthetic_frame *frame, int x, int y)
+{
+	return frame->samples[(size_t)y * frame->width + x] >> (raw_bits(frame->layout) - 8);
+}
+
+// Position in the quad of the first sample of a color
+static int
+color_position(enum bayer_order order, int color)
+{
+	for (int i = 0; i < 4; i++) {
+		if (order_colors[order][i] == color) {
+			return i;
+		}
+	}
+	return 0;
+}
+
+static void
+test_unpack(const struct synthetic_frame *frame)
+{
+	uint16_t *row = malloc(frame->width * sizeof(uint16_t));
+	int ok = 1;
+
+	for (int y = 0; y < frame->height && ok; y++) {
+		raw_unpack_row(frame->layout, frame->data + y * frame->stride, row, frame->width);
+		ok = memcmp(row, frame->samples + (size_t)y * frame->width,
+			frame->width * sizeof(uint16_t)) == 0;
+	}
+	check_variant(ok, "unpack", "", layout_names[frame->layout]);
+	free(row);
+}
+
+static void
+test_quick(const struct synthetic_frame *frame, enum bayer_order order, int skip)
+{
+	const struct debayer_kernels *kernels = debayer_kernels_get(order, frame->layout);
+	int step = 2 * skip;
+	int width = frame->width / step;
+	int height = frame->height / step;
+	uint8_t *out = malloc(width * height * 3);
+	int ok = 1;
+
+	kernels->quick(frame->data, out, frame->width, frame->height, frame->stride, width * 3, skip);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			for (int c = 0; c < 3; c++) {
+				int pos = color_position(order, c);
+				int expected = sample8(frame, x * step + (pos & 1), y * step + (pos >> 1));
+				ok &= out[(y * width + x) * 3 + c] == expected;
+			}
+		}
+	}
+	check_variant(ok, "quick", order_names[order], layout_names[frame->layout]);
+	free(out);
+}
+
+static void
+test_binned(const struct synthetic_frame *frame, enum bayer_order order, int width, int height)
+{
+	const struct debayer_kernels *kernels = debayer_kernels_get(order, frame->layout);
+	int quads_x = frame->width / 2;
+	int quads_y = frame->height / 2;
+	uint8_t *out = malloc(width * height * 3);
+	int ok = 1;
+
+	if (kernels->binned(frame->data, out, frame->width, frame->height, frame->stride,
+			width, height, width * 3, NULL) != 0) {
+		check_variant(0, "binned", order_names[order], layout_names[frame->layout]);
+		free(out);
+		return;
+	}
+
+	for (int y = 0; y < height; y++) {
+		int y0 = y * quads_y / height;
+		int y1 = (y + 1) * quads_y / height;
+		for (int x = 0; x < width; x++) {
+			int x0 = x * quads_x / width;
+			int x1 = (x + 1) * quads_x / width;
+			uint32_t sum[3] = {0};
+			uint32_t count = (x1 - x0) * (y1 - y0);
+
+			for (int qy = y0; qy < y1; qy++) {
+				for (int qx = x0; qx < x1; qx++) {
+					for (int pos = 0; pos < 4; pos++) {
+						sum[order_colors[order][pos]] +=
+							sample8(frame, 2 * qx + (pos & 1), 2 * qy + (pos >> 1));
+					}
+				}
+			}
+			// Same rounding as the kernel, 12 bit averages then 8 bits
+			int avg[3] = {
+				(sum[0] * 16 + count / 2) / count,
+				(sum[1] * 8 + count / 2) / count,
+				(sum[2] * 16 + count / 2) / count,
+			};
+			for (int c = 0; c < 3; c++) {
+				ok &= out[(y * width + x) * 3 + c] == (avg[c] + 8) >> 4;
+			}
+		}
+	}
+	check_variant(ok, "binned", order_names[order], layout_names[frame->layout]);
+	free(out);
+}
+
+// A zoomed in part of the frame, read from the middle of the rows, comes out
+// the same as that part of the whole frame
+static void
+test_binned_region(const struct synthetic_frame *frame, enum bayer_order order)
+{
+	const struct debayer_kernels *kernels = debayer_kernels_get(order, frame->layout);
+	int quads_x = frame->width / 2, quads_y = frame->height / 2;
+	int x = 48, y = 10, width = frame->width - 2 * x, height = frame->height - 2 * y;
+	uint8_t *full = malloc(quads_x * quads_y * 3);
+	uint8_t *part = malloc(width / 2 * height / 2 * 3);
+	const uint8_t *source = frame->data + y * frame->stride + raw_bytes_per_line(frame->layout, x);
+	int ok;
+
+	ok = kernels->binned(frame->data, full, frame->width, frame->height, frame->stride,
+		quads_x, quads_y, quads_x * 3, NULL) == 0;
+	ok = ok && kernels->binned(source, part, width, height, frame->stride,
+		width / 2, height / 2, width / 2 * 3, NULL) == 0;
+	for (int row = 0; row < height / 2 && ok; row++) {
+		ok = memcmp(part + row * width / 2 * 3, full + ((row + y / 2) * quads_x + x / 2) * 3,
+			width / 2 * 3) == 0;
+	}
+	check_variant(ok, "binned region", order_names[order], layout_names[frame->layout]);
+	free(full);
+	free(part);
+}
+
+// Fills the frame with a flat level and up to noise of random noise
+static void
+flat_frame(struct synthetic_frame *frame, int level, int noise, uint32_t *state)
+{
+	for (int y = 0; y < frame->height; y++) {
+		uint16_t *row = frame->samples + y * frame->width;
+		for (int x = 0; x < frame->width; x++) {
+			row[x] = level + (noise ? (int)(synthetic_random(state) % (2 * noise + 1)) - noise : 0);
+		}
+		synthetic_pack_row(frame->layout, row, frame->data + y * frame->stride, frame->width);
+	}
+}
+
+static int
+total_error(const uint8_t *a, const uint8_t *b, int size)
+{
+	int error = 0;
+	for (int i = 0; i < size; i++) {
+		error += abs(a[i] - b[i]);
+	}
+	return error;
+}
+
+// The low light average of a still scene has less noise than a single frame,
+// and a change bigger than the noise comes through right away
+static void
+test_lowlight(enum raw_layout layout)
+{
+	static const float matrix[] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+	static const float neutral[] = {1, 1, 1};
+	int width = 100, height = 30, size = width * height * 3;
+	int level = 60 << (raw_bits(layout) - 8), noise = 4 << (raw_bits(layout) - 8);
+	const struct debayer_kernels *kernels = debayer_kernels_get(BAYER_BGGR, layout);
+	struct synthetic_frame frame;
+	struct preview_color color;
+	uint8_t *clean = malloc(size), *single = malloc(size), *averaged = malloc(size);
+	uint32_t state = 3;
+
+	synthetic_frame_init(&frame, 2 * width, 2 * height, layout);
+	preview_color_init(&color, raw_bits(layout), 0, 0, matrix, neutral);
+	flat_frame(&frame, level, 0, &state);
+	kernels->binned(frame.data, clean, frame.width, frame.height, frame.stride, width, height,
+		width * 3, &color);
+
+	struct preview_accumulator *accumulator = preview_accumulator_new(width, height);
+	for (int i = 0; i < 16; i++) {
+		flat_frame(&frame, level, noise, &state);
+		color.accumulator = NULL;
+		kernels->binned(frame.data, single, frame.width, frame.height, frame.stride, width, height,
+			width * 3, &color);
+		color.accumulator = accumulator;
+		kernels->binned(frame.data, averaged, frame.width, frame.height, frame.stride, width, height,
+			width * 3, &color);
+	}
+	check_variant(accumulator->frames == 16 && total_error(averaged, clean, size) * 2 < total_error(single, clean, size),
+		"lowlight noise", "", layout_names[layout]);
+
+	flat_frame(&frame, level * 3, 0, &state);
+	kernels->binned(frame.data, averaged, frame.width, frame.height, frame.stride, width, height,
+		width * 3, &color);
+	color.accumulator = NULL;
+	kernels->binned(frame.data, single, frame.width, frame.height, frame.stride, width, height,
+		width * 3, &color);
+	check_variant(memcmp(averaged, single, size) == 0, "lowlight motion", "", layout_names[layout]);
+
+	preview_accumulator_free(accumulator);
+	synthetic_frame_free(&frame);
+	free(clean);
+	free(single);
+	free(averaged);
+}
+
+static void
+test_luma(const struct synthetic_frame *frame)
+{
+	int width = frame->width / 2;
+	int height = frame->height / 2;
+	uint8_t *out = malloc(width * height);
+	int ok = 1;
+
+	quick_luma(frame->data, out, frame->width, frame->height, frame->stride, width, frame->layout);
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			int sum = sample8(frame, 2 * x, 2 * y) + sample8(frame, 2 * x + 1, 2 * y) +
+				sample8(frame, 2 * x, 2 * y + 1) + sample8(frame, 2 * x + 1, 2 * y + 1);
+			ok &= out[y * width + x] == (sum + 2) >> 2;
+		}
+	}
+	check_variant(ok, "luma", "", layout_names[frame->layout]);
+	free(out);
+}
+
+// Full size outputs on the PinePhone sensor modes, the preview goes through
+// the color stage with the levels of the rear camera
+struct golden {
+	int width;
+	int height;
+	enum raw_layout layout;
+	uint64_t quick;
+	uint64_t preview;
+	uint64_t luma;
+};
+
+static const struct golden goldens[] = {
+	{2592, 1944, RAW_8, 0x9431d36f770ef2bdULL, 0xb0940a3cd377dc9cULL, 0xc1cd690b0620a776ULL},
+	{2592, 1944, RAW_10P, 0xc1ae4a91e192e04aULL, 0x2ab0657c136c9a11ULL, 0xe4180f28949104dfULL},
+	{800, 600, RAW_8, 0xa1aa644c288e1701ULL, 0x4c64caeb9afbbba2ULL, 0x80d6c126f3c58119ULL},
+	{800, 600, RAW_10P, 0xebc328d78007934aULL, 0x9108e9391ba851a2ULL, 0x72aaec1acb7ca0aeULL},
+};
+
+static void
+test_golden(const struct golden *golden)
+{
+	static const float matrix[] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+	static const float neutral[] = {1, 1, 1};
+	struct synthetic_frame frame;
+	struct preview_color color;
+	char name[32];
+
+	synthetic_frame_init(&frame, golden->width, golden->height, golden->layout);
+	const struct debayer_kernels *kernels = debayer_kernels_get(BAYER_BGGR, golden->layout);
+	int bits = raw_bits(golden->layout);
+	preview_color_init(&color, bits, 10 << (bits - 8), 0, matrix, neutral);
+
+	// Same sizes as the app, skip 3 above 1280 wide and the preview for the
+	// 720 pixel wide portrait screen, at most one pixel per quad
+	int skip = golden->width > 1280 ? 3 : 2;
+	int width = golden->width / (skip * 2);
+	int height = golden->height / (skip * 2);
+	int preview_width = MIN(golden->width / 2, 720 * golden->width / golden->height);
+	int preview_height = MIN(golden->height / 2, preview_width * golden->height / golden->width);
+	size_t size = MAX(MAX(width * height * 3, preview_width * preview_height * 3),
+		(frame.width / 2) * (frame.height / 2));
+	uint8_t *out = malloc(size);
+
+	snprintf(name, sizeof(name), " %dx%d ", golden->width, golden->height);
+
+	kernels->quick(frame.data, out, frame.width, frame.height, frame.stride, width * 3, skip);
+	uint64_t quick = checksum(out, width * height * 3, CHECKSUM_INIT);
+
+	int binned = kernels->binned(frame.data, out, frame.width, frame.height, frame.stride,
+		preview_width, preview_height, preview_width * 3, &color);
+	check_variant(binned == 0, "golden binned", name, layout_names[golden->layout]);
+	uint64_t preview = checksum(out, preview_width * preview_height * 3, CHECKSUM_INIT);
+
+	quick_luma(frame.data, out, frame.width, frame.height, frame.stride, frame.width / 2, golden->layout);
+	uint64_t luma = checksum(out, (frame.width / 2) * (frame.height / 2), CHECKSUM_INIT);
+
+	check_variant(quick == golden->quick, "golden quick", name, layout_names[golden->layout]);
+	check_variant(preview == golden->preview, "golden preview", name, layout_names[golden->layout]);
+	check_variant(luma == golden->luma, "golden luma", name, layout_names[golden->layout]);
+	if (quick != golden->quick || preview != golden->preview || luma != golden->luma) {
+		printf("  got {%d, %d, %s, 0x%016llxULL, 0x%016llxULL, 0x%016llxULL}\n",
+			golden->width, golden->height, layout_enums[golden->layout],
+			(unsigned long long)quick, (unsigned long long)preview, (unsigned long long)luma);
+	}
+
+	free(out);
+	synthetic_frame_free(&frame);
+}
+
+int
+main(int argc, char *argv[])
+{
+	for (enum raw_layout layout = RAW_8; layout <= RAW_12P; layout++) {
+		struct synthetic_frame frame;
+
+		// Wide enough for the vector loops and their scalar tails
+		synthetic_frame_init(&frame, 200, 60, layout);
+		test_unpack(&frame);
+		test_luma(&frame);
+		for (enum bayer_order order = BAYER_BGGR; order <= BAYER_RGGB; order++) {
+			for (int skip = 1; skip <= 3; skip++) {
+				test_quick(&frame, order, skip);
+			}
+			test_binned(&frame, order, 100, 30);
+			test_binned(&frame, order, 37, 11);
+			test_binned_region(&frame, order);
+		}
+		synthetic_frame_free(&frame);
+	}
+
+	test_lowlight(RAW_8);
+	test_lowlight(RAW_10P);
+
+	for (int i = 0; i < ARRAY_SIZE(goldens); i++) {
+		test_golden(&goldens[i]);
+	}
+
+	return check_summary();
+}
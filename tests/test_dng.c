@@ -0,0 +1,260 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "dng.h"
+#include "synthetic.h"
+
+// Writes DNGs of synthetic frames and reads them back with libtiff, the
+// structure has to be what raw converters expect and the pixels have to
+// survive unchanged
+
+// How lens shading and defective pixels are corrected
+enum correction {
+	CORRECT_NONE,
+	CORRECT_PIXELS,
+	CORRECT_OPCODES,
+};
+
+static uint32_t
+get_u32(const uint8_t *p)
+{
+	return (p[0] << 24) | (p[1] << 16) | (p[2] << 8) | p[3];
+}
+
+static void
+test_dng(int width, int height, enum raw_layout layout, enum correction shading,
+	enum correction badpixels, const char *name)
+{
+	static const float colormatrix[] = {1.5, -0.5, 0, -0.25, 1.25, 0, 0, -0.5, 1.5};
+	static const float neutral[] = {0.5, 1, 0.75};
+	struct synthetic_frame frame;
+	char path[64];
+	int bits = raw_bits(layout);
+
+	synthetic_frame_init(&frame, width, height, layout);
+	struct dng_info info = {
+		.width = width,
+		.height = height,
+		.stride = frame.stride,
+		.layout = layout,
+		.cfapattern = "\002\001\001\000",
+		.make = "PINE64",
+		.model = "PinePhone",
+		.colormatrix = colormatrix,
+		.neutral = neutral,
+		.blacklevel = 16,
+		.focallength = 3.33,
+		.cropfactor = 10.81,
+		.fnumber = 3.0,
+		.time = 1600000000,
+	};
+	// The packed 10 bit frames are written zoomed in
+	int zoomed = layout == RAW_10P;
+	if (zoomed) {
+		info.crop_x = width / 4;
+		info.crop_y = height / 4;
+		info.crop_width = width / 2;
+		info.crop_height = height / 2;
+	}
+
+	struct shading_grid *grid = shading_grid_new(5, 4);
+	for (int p = 0; p < 4; p++) {
+		for (int i = 0; i < 5 * 4; i++) {
+			grid->gains[p][i] = 1.0f + 0.1f * p + 0.05f * i;
+		}
+	}
+	uint16_t *table = shading_table(grid, BAYER_BGGR, width, height);
+	if (shading == CORRECT_PIXELS) {
+		info.shading_table = table;
+	} else if (shading == CORRECT_OPCODES) {
+		info.shading_grid = grid;
+	}
+
+	// One at each corner and a pair in the middle
+	uint16_t coords[] = {0, 0, width - 1, 0, 0, height - 1, width - 1, height - 1, 100, 50, 102, 50};
+	struct badpixels *map = badpixels_new(width, height, coords, 6);
+	if (badpixels != CORRECT_NONE) {
+		info.badpixels = map;
+		info.badpixel_opcodes = badpixels == CORRECT_OPCODES;
+	}
+
+	snprintf(path, sizeof(path), "test_dng_%s.dng", name);
+	TIFF *tif = TIFFOpen(path, "w");
+	if (!tif) {
+		check(0, "open for writing", name);
+		synthetic_frame_free(&frame);
+		return;
+	}
+	dng_write(tif, frame.data, &info);
+	TIFFClose(tif);
+
+	tif = TIFFOpen(path, "r");
+	if (!tif) {
+		check(0, "open for reading", name);
+		synthetic_frame_free(&frame);
+		return;
+	}
+
+	// The first directory is the thumbnail with the camera description
+	uint32_t value32 = 0;
+	char *text = NULL;
+	TIFFGetField(tif, TIFFTAG_SUBFILETYPE, &value32);
+	check(value32 == 1, "thumbnail subfile type", name);
+	TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &value32);
+	check(value32 == width >> 4, "thumbnail width", name);
+	check(TIFFGetField(tif, TIFFTAG_MAKE, &text) && strcmp(text, "PINE64") == 0, "make", name);
+	check(TIFFGetField(tif, TIFFTAG_MODEL, &text) && strcmp(text, "PinePhone") == 0, "model", name);
+	check(TIFFGetField(tif, TIFFTAG_UNIQUECAMERAMODEL, &text) &&
+		strcmp(text, "PINE64 PinePhone") == 0, "unique camera model", name);
+
+	uint16_t count = 0;
+	float *floats = NULL;
+	check(TIFFGetField(tif, TIFFTAG_COLORMATRIX1, &count, &floats) && count == 9 &&
+		memcmp(floats, colormatrix, sizeof(colormatrix)) == 0, "color matrix", name);
+	check(TIFFGetField(tif, TIFFTAG_ASSHOTNEUTRAL, &count, &floats) && count == 3 &&
+		memcmp(floats, neutral, sizeof(neutral)) == 0, "as shot neutral", name);
+
+	uint64_t *subifds = NULL;
+	uint64_t exif = 0;
+	int has_subifd = TIFFGetField(tif, TIFFTAG_SUBIFD, &count, &subifds) && count == 1;
+	check(has_subifd, "subifd", name);
+	check(TIFFGetField(tif, TIFFTAG_EXIFIFD, &exif) && exif != 0, "exif ifd", name);
+
+	uint8_t *version = NULL;
+	check(TIFFGetField(tif, TIFFTAG_DNGVERSION, &version) &&
+		version[1] == (shading == CORRECT_OPCODES || badpixels == CORRECT_OPCODES ? 3 : 1),
+		"dng version", name);
+
+	if (has_subifd && TIFFSetSubDirectory(tif, subifds[0])) {
+		uint16_t value16 = 0;
+		uint8_t *pattern = NULL;
+
+		TIFFGetField(tif, TIFFTAG_IMAGEWIDTH, &value32);
+		check(value32 == width, "width", name);
+		TIFFGetField(tif, TIFFTAG_IMAGELENGTH, &value32);
+		check(value32 == height, "height", name);
+		TIFFGetField(tif, TIFFTAG_BITSPERSAMPLE, &value16);
+		check(value16 == (bits > 8 ? 16 : 8), "bits per sample", name);
+		TIFFGetField(tif, TIFFTAG_PHOTOMETRIC, &value16);
+		check(value16 == PHOTOMETRIC_CFA, "photometric", name);
+		check(TIFFGetField(tif, TIFFTAG_CFAPATTERN, &count, &pattern) && count == 4 &&
+			memcmp(pattern, info.cfapattern, 4) == 0, "cfa pattern", name);
+		// Four gain maps, one for each position in the quad
+		uint32_t size = 0;
+		uint8_t *opcodes = NULL;
+		int has_opcodes = TIFFGetField(tif, TIFFTAG_OPCODELIST2, &size, &opcodes);
+		if (shading == CORRECT_OPCODES) {
+			uint32_t map = 16 + 76 + 5 * 4 * 4;
+			check(has_opcodes && size == 4 + 4 * map && get_u32(opcodes) == 4 &&
+				get_u32(opcodes + 4) == 9 && get_u32(opcodes + 4 + 3 * map) == 9 &&
+				get_u32(opcodes + 4 + 3 * map + 16) == 1 && get_u32(opcodes + 4 + 3 * map + 20) == 1,
+				"opcodes", name);
+			// And the same grid when read back
+			struct shading_grid *read = has_opcodes ?
+				dng_read_gainmaps(opcodes, size, info.cfapattern, width, height) : NULL;
+			int same = read && read->cols == 5 && read->rows == 4;
+			for (int p = 0; p < 4 && same; p++) {
+				same = memcmp(read->gains[p], grid->gains[p], 5 * 4 * sizeof(float)) == 0;
+			}
+			check(same, "read opcodes", name);
+			shading_grid_free(read);
+		} else {
+			check(!has_opcodes, "no opcodes", name);
+		}
+		// A single FixBadPixelsList, blue at the top left is phase 3
+		has_opcodes = TIFFGetField(tif, TIFFTAG_OPCODELIST1, &size, &opcodes);
+		if (badpixels == CORRECT_OPCODES) {
+			check(has_opcodes && size == 4 + 16 + 12 + 6 * 8 && get_u32(opcodes) == 1 &&
+				get_u32(opcodes + 4) == 5 && get_u32(opcodes + 20) == 3 &&
+				get_u32(opcodes + 24) == 6 && get_u32(opcodes + 28) == 0 &&
+				get_u32(opcodes + 32) == 0 && get_u32(opcodes + 32 + 8 * 5) == height - 1 &&
+				get_u32(opcodes + 36 + 8 * 5) == width - 1, "bad pixel opcodes", name);
+			struct badpixels *read = has_opcodes ?
+				dng_read_badpixels(opcodes, size, width, height) : NULL;
+			check(read && read->count == map->count &&
+				memcmp(read->pixels, map->pixels, map->count * sizeof(struct badpixel)) == 0,
+				"read bad pixel opcodes", name);
+			badpixels_free(read);
+		} else {
+			check(!has_opcodes, "no bad pixel opcodes", name);
+		}
+
+		float *blacklevel = NULL;
+		check(TIFFGetField(tif, TIFFTAG_BLACKLEVEL, &count, &blacklevel) && count == 1 &&
+			*blacklevel == 16, "black level", name);
+		float *origin = NULL, *cropsize = NULL;
+		int has_crop = TIFFGetField(tif, TIFFTAG_DEFAULTCROPORIGIN, &origin) &&
+			TIFFGetField(tif, TIFFTAG_DEFAULTCROPSIZE, &cropsize);
+		if (zoomed) {
+			check(has_crop && origin[0] == width / 4 && origin[1] == height / 4 &&
+				cropsize[0] == width / 2 && cropsize[1] == height / 2, "crop", name);
+		} else {
+			check(!has_crop, "no crop", name);
+		}
+		if (bits > 8) {
+			uint32_t *whitelevel = NULL;
+			check(TIFFGetField(tif, TIFFTAG_WHITELEVEL, &count, &whitelevel) &&
+				*whitelevel == (1 << bits) - 1, "white level", name);
+		}
+
+		uint8_t *line = malloc(width * sizeof(uint16_t));
+		uint16_t *samples = malloc(width * sizeof(uint16_t));
+		int ok = 1;
+		for (int y = 0; y < height && ok; y++) {
+			memcpy(samples, frame.samples + (size_t)y * width, width * sizeof(uint16_t));
+			if (badpixels == CORRECT_PIXELS) {
+				badpixels_apply_row(map, y, samples);
+			}
+			if (shading == CORRECT_PIXELS) {
+				shading_apply_row(table + (size_t)y * width, samples, width, 16, (1 << bits) - 1);
+			}
+			ok = TIFFReadScanline(tif, line, y, 0) == 1;
+			for (int x = 0; x < width && ok; x++) {
+				int sample = bits > 8 ? ((uint16_t *)line)[x] : line[x];
+				ok = sample == samples[x];
+			}
+		}
+		check(ok, "pixels", name);
+		free(line);
+		free(samples);
+	} else {
+		check(0, "raw directory", name);
+	}
+
+	if (exif && TIFFReadEXIFDirectory(tif, exif)) {
+		// The tests run in UTC
+		check(TIFFGetField(tif, EXIFTAG_DATETIMEORIGINAL, &text) &&
+			strcmp(text, "2020:09:13 12:26:40") == 0, "exif date", name);
+	} else {
+		check(0, "exif directory", name);
+	}
+
+	TIFFClose(tif);
+	unlink(path);
+	free(table);
+	shading_grid_free(grid);
+	badpixels_free(map);
+	synthetic_frame_free(&frame);
+}
+
+int
+main(int argc, char *argv[])
+{
+	setenv("TZ", "UTC", 1);
+	tzset();
+	dng_init();
+
+	test_dng(800, 600, RAW_8, CORRECT_NONE, CORRECT_NONE, "8");
+	test_dng(800, 600, RAW_10, CORRECT_NONE, CORRECT_NONE, "10");
+	test_dng(800, 600, RAW_10P, CORRECT_NONE, CORRECT_NONE, "10p");
+	test_dng(800, 600, RAW_12P, CORRECT_NONE, CORRECT_NONE, "12p");
+	test_dng(800, 600, RAW_8, CORRECT_PIXELS, CORRECT_NONE, "8-shaded");
+	test_dng(800, 600, RAW_10P, CORRECT_PIXELS, CORRECT_NONE, "10p-shaded");
+	test_dng(800, 600, RAW_10P, CORRECT_OPCODES, CORRECT_NONE, "10p-opcodes");
+	test_dng(800, 600, RAW_8, CORRECT_NONE, CORRECT_PIXELS, "8-fixed");
+	test_dng(800, 600, RAW_10P, CORRECT_PIXELS, CORRECT_PIXELS, "10p-shaded-fixed");
+	test_dng(800, 600, RAW_12P, CORRECT_OPCODES, CORRECT_OPCODES, "12p-all-opcodes");
+
+	return check_summary();
+}
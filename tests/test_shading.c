@@ -0,0 +1,232 @@
+#include <math.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include "shading.h"
+#include "synthetic.h"
+
+// The expanded gain tables against the interpolated grid, the fixed point
+// correction against a plain version, and the calibration on a synthetic
+// flat field with known falloff
+
+static const char *order_names[] = {"bggr", "gbrg", "grbg", "rggb"};
+
+// Darker toward the corners, a bit differently for every color
+static float
+falloff(enum shading_plane plane, float u, float v)
+{
+	float du = u - 0.5f;
+	float dv = v - 0.5f;
+	return 1.0f - (0.5f + 0.05f * plane) * (du * du + dv * dv) * 2;
+}
+
+static struct shading_grid *
+make_grid(int cols, int rows)
+{
+	struct shading_grid *grid = shading_grid_new(cols, rows);
+	for (int p = 0; p < 4; p++) {
+		for (int y = 0; y < rows; y++) {
+			for (int x = 0; x < cols; x++) {
+				grid->gains[p][y * cols + x] =
+					1.0f / falloff(p, (float)x / (cols - 1), (float)y / (rows - 1));
+			}
+		}
+	}
+	return grid;
+}
+
+static void
+test_load_save()
+{
+	struct shading_grid *grid = make_grid(9, 7);
+	int ok = shading_save("test_shading.txt", grid) == 0;
+	struct shading_grid *loaded = ok ? shading_load("test_shading.txt") : NULL;
+
+	ok = loaded && loaded->cols == 9 && loaded->rows == 7;
+	for (int p = 0; p < 4 && ok; p++) {
+		for (int i = 0; i < 9 * 7; i++) {
+			ok &= fabsf(loaded->gains[p][i] - grid->gains[p][i]) < 0.0001f;
+		}
+	}
+	check(ok, "load", "saved grid");
+
+	// Missing planes and gains out of range are rejected
+	write_text_file("test_shading.txt", "# comment\nsize 2 2\nr 1 1 1 1\ngr 1 1 1 1 # more\ngb 1 1 1 1\n");
+	check(shading_load("test_shading.txt") == NULL, "load", "missing plane");
+	write_text_file("test_shading.txt", "size 2 2\nr 1 1 1 1\ngr 1 1 1 1\ngb 1 1 1 1\nb 1 1 1 17\n");
+	check(shading_load("test_shading.txt") == NULL, "load", "gain out of range");
+
+	unlink("test_shading.txt");
+	shading_grid_free(loaded);
+	shading_grid_free(grid);
+}
+
+static void
+test_table(enum bayer_order order)
+{
+	int width = 200, height = 150;
+	struct shading_grid *grid = make_grid(9, 7);
+	uint16_t *table = shading_table(grid, order, width, height);
+	int ok = 1;
+
+	for (int y = 0; y < height; y++) {
+		for (int x = 0; x < width; x++) {
+			float gain = shading_gain(grid, shading_plane_at(order, x, y),
+				(x + 0.5f) / width, (y + 0.5f) / height);
+			int expected = lroundf(gain * (1 << SHADING_SHIFT));
+			ok &= abs(table[y * width + x] - expected) <= 1;
+		}
+	}
+	check(ok, "table", order_names[order]);
+
+	free(table);
+	shading_grid_free(grid);
+}
+
+static void
+test_apply()
+{
+	int width = 203;
+	uint16_t gains[203], row[203], expected[203];
+	uint32_t state = 1;
+
+	for (int bits = 8; bits <= 12; bits += 2) {
+		uint16_t black = 16 << (bits - 8);
+		uint16_t white = (1 << bits) - 1;
+
+		for (int x = 0; x < width; x++) {
+			gains[x] = synthetic_random(&state) % (4 << SHADING_SHIFT);
+			row[x] = synthetic_random(&state) & white;
+			expected[x] = row[x];
+			if (row[x] >= black) {
+				double v = black + (row[x] - black) * gains[x] / (double)(1 << SHADING_SHIFT);
+				expected[x] = MIN(white, (int)floor(v + 0.5));
+			}
+		}
+		shading_apply_row(gains, row, width, black, white);
+		check(memcmp(row, expected, sizeof(row)) == 0, "apply", bits == 8 ? "8" : bits == 10 ? "10" : "12");
+	}
+}
+
+// Unity gains leave the preview exactly as it was
+static void
+test_preview()
+{
+	static const float matrix[] = {1, 0, 0, 0, 1, 0, 0, 0, 1};
+	static const float neutral[] = {1, 1, 1};
+	struct synthetic_frame frame;
+	struct preview_color color;
+	struct shading_grid *grid = shading_grid_new(2, 2);
+	int width = 100, height = 30;
+	uint8_t *plain = malloc(width * height * 3);
+	uint8_t *shaded = malloc(width * height * 3);
+
+	for (int p = 0; p < 4; p++) {
+		for (int i = 0; i < 4; i++) {
+			grid->gains[p][i] = 1.0f;
+		}
+	}
+	synthetic_frame_init(&frame, 200, 60, RAW_10P);
+	const struct debayer_kernels *kernels = debayer_kernels_get(BAYER_BGGR, RAW_10P);
+	preview_color_init(&color, 10, 40, 0, matrix, neutral);
+
+	kernels->binned(frame.data, plain, frame.width, frame.height, frame.stride,
+		width, height, width * 3, &color);
+	color.shading = shading_preview_table(grid, width, height, 0, 0, 1, 1);
+	color.shading_width = width;
+	color.shading_height = height;
+	kernels->binned(frame.data, shaded, frame.width, frame.height, frame.stride,
+		width, height, width * 3, &color);
+	check(memcmp(plain, shaded, width * height * 3) == 0, "preview", "unity gains");
+
+	free((void *)color.shading);
+	free(plain);
+	free(shaded);
+	synthetic_frame_free(&frame);
+	shading_grid_free(grid);
+}
+
+// The gains for a zoomed in part of the frame are the same ones the whole
+// frame has there
+static void
+test_preview_region()
+{
+	struct shading_grid *grid = shading_grid_new(3, 3);
+	int width = 200, height = 100;
+	int ok = 1;
+
+	for (int p = 0; p < 4; p++) {
+		for (int i = 0; i < 9; i++) {
+			grid->gains[p][i] = 1.0f + (i * 7 + p) % 9 * 0.1f;
+		}
+	}
+	uint16_t *full = shading_preview_table(grid, width, height, 0, 0, 1, 1);
+	uint16_t *part = shading_preview_table(grid, width / 2, height / 2, 0.5f, 0.25f, 1, 0.75f);
+
+	for (int y = 0; y < height / 2; y++) {
+		for (int i = 0; i < width / 2 * 3; i++) {
+			int c = i / (width / 2), x = i % (width / 2);
+			int expected = full[(size_t)(y + height / 4) * width * 3 + c * width + x + width / 2];
+			ok &= abs(part[(size_t)y * width / 2 * 3 + i] - expected) <= 1;
+		}
+	}
+	check(ok, "preview", "region");
+
+	free(full);
+	free(part);
+	shading_grid_free(grid);
+}
+
+// The measured gains undo the falloff the flat field was made with
+static void
+test_calibrate(enum bayer_order order)
+{
+	int width = 640, height = 480, black = 64;
+	struct synthetic_frame frame;
+	struct shading_grid *grid = shading_grid_new(SHADING_CALIBRATION_COLS, SHADING_CALIBRATION_ROWS);
+	int ok = 1;
+
+	synthetic_frame_init(&frame, width, height, RAW_10);
+	for (int y = 0; y < height; y++) {
+		uint16_t *row = frame.samples + y * width;
+		for (int x = 0; x < width; x++) {
+			float f = falloff(shading_plane_at(order, x, y), (x + 0.5f) / width, (y + 0.5f) / height);
+			row[x] = black + lroundf(800 * f);
+		}
+		synthetic_pack_row(RAW_10, row, frame.data + y * frame.stride, width);
+	}
+
+	shading_measure(grid, frame.data, RAW_10, order, width, height, frame.stride, black);
+	ok = shading_finish(grid) == 0;
+	for (int p = 0; p < 4 && ok; p++) {
+		float center = falloff(p, 0.5f, 0.5f);
+		for (int y = 0; y < grid->rows; y++) {
+			for (int x = 0; x < grid->cols; x++) {
+				float u = (float)x / (grid->cols - 1);
+				float v = (float)y / (grid->rows - 1);
+				float expected = center / falloff(p, u, v);
+				ok &= fabsf(grid->gains[p][y * grid->cols + x] / expected - 1) < 0.02f;
+			}
+		}
+	}
+	check(ok, "calibrate", order_names[order]);
+
+	synthetic_frame_free(&frame);
+	shading_grid_free(grid);
+}
+
+int
+main(int argc, char *argv[])
+{
+	test_load_save();
+	for (enum bayer_order order = BAYER_BGGR; order <= BAYER_RGGB; order++) {
+		test_table(order);
+		test_calibrate(order);
+	}
+	test_apply();
+	test_preview();
+	test_preview_region();
+
+	return check_summary();
+}
@@ -0,0 +1,58 @@
+#include <stdlib.h>
+#include "textfile.h"
+
+static int
+is_space(int c)
+{
+	return c == ' ' || c == '\t' || c == '\n' || c == '\r';
+}
+
+int
+text_read_word(FILE *file, char *word, int size)
+{
+	int c, length = 0;
+
+	for (;;) {
+		c = fgetc(file);
+		if (c == '#') {
+			while (c != '\n' && c != EOF) {
+				c = fgetc(file);
+			}
+		}
+		if (c == EOF) {
+			return -1;
+		}
+		if (!is_space(c)) {
+			break;
+		}
+	}
+
+	while (c != EOF && !is_space(c) && c != '#') {
+		if (length < size - 1) {
+			word[length++] = c;
+		}
+		c = fgetc(file);
+	}
+	if (c == '#') {
+		ungetc(c, file);
+	}
+	word[length] = '\0';
+	return 0;
+}
+
+int
+text_read_int(FILE *file, int *value)
+{
+	char word[16];
+	char *end;
+
+	if (text_read_word(file, word, sizeof(word)) < 0) {
+		return -1;
+	}
+	long number = strtol(word, &end, 10);
+	if (end == word || *end != '\0' || number < -2147483647 || number > 2147483647) {
+		return -1;
+	}
+	*value = number;
+	return 0;
+}
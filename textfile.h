@@ -0,0 +1,15 @@
+#ifndef TEXTFILE_H
+#define TEXTFILE_H
+
+#include <stdio.h>
+
+// The calibration files are text of whitespace separated words, # starts a
+// comment that runs to the end of the line
+
+// Next word, cut to size - 1 characters. -1 at the end of the file.
+int text_read_word(FILE *file, char *word, int size);
+
+// Next word as a number, -1 at the end of the file or when it isn't one
+int text_read_int(FILE *file, int *value);
+
+#endif